@@ -28,6 +28,13 @@ typedef int64_t Long;  // signed
 #define ROTATE_RIGHT_MACRO(val,shift) (((val) >> (shift)) | ((val) << (64 - (shift))))
 #define ROTATE_LEFT_MACRO(val,shift)  (((val) << (shift)) | ((val) >> (64 - (shift))))
 
+// A hint that the given address will soon be read or written. It is a no-op for other compilers.
+#ifdef __GNUC__
+#define PREFETCH_MACRO(addr) __builtin_prefetch ((const void *) (addr), 1, 3)
+#else
+#define PREFETCH_MACRO(addr) do { } while (0)
+#endif
+
 /* some C syntax magic */
 #define FATAL_ERROR(msg) \
   do { \
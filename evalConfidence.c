@@ -2,7 +2,7 @@
 
 /*
 
-  gcc -O3 -Wall -pedantic -o evalConfidence u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Confidence.c fm85Compression.c fm85Merging.c fm85Testing.c evalConfidence.c
+  gcc -O3 -Wall -pedantic -o evalConfidence u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Confidence.c fm85Compression.c fm85Merging.c fm85Testing.c evalConfidence.c -lpthread
 
 */
 
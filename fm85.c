@@ -1,5 +1,7 @@
 // Copyright 2018, Kevin Lang, Oath Research
 
+#include <pthread.h>
+
 #include "common.h"
 #include "u32Table.h"
 #include "fm85.h"
@@ -7,13 +9,14 @@
 #include "fm85Compression.h"
 
 #include "mycity.h"
+#include "murmur3.h"
 
 /*******************************************************/
 
 U32 rowColFromTwoHashes (U64 hash0, U64 hash1, Short lgK) {
   assert (lgK <= 26);
   Long k = (1LL << lgK);
-  Short col = countLeadingZerosInUnsignedLong (hash1); // 0 <= col <= 64
+  Short col = fastCountLeadingZeros64 (hash1); // 0 <= col <= 64
   if (col > 63) col = 63;                    // clip so that 0 <= col <= 63
   Long row = hash0 & (k - 1);
   U32 rowCol = (U32) ((row << 6) | col);
@@ -23,6 +26,24 @@ U32 rowColFromTwoHashes (U64 hash0, U64 hash1, Short lgK) {
   return (rowCol);
 }
 
+/*******************************************************/
+// This splits a single 64-bit hash into independent row and column bits.
+// The low lgK bits choose the row, and the remaining (64 - lgK) high bits
+// choose the column by counting their leading zeros. OR'ing in the row mask
+// stops the count at (64 - lgK), which is at least 38, so the column is
+// clipped slightly earlier than in rowColFromTwoHashes(), but only with
+// negligible probability.
+
+U32 rowColFromOneHash (U64 hash, Short lgK) {
+  assert (lgK <= 26);
+  Long k = (1LL << lgK);
+  Short col = fastCountLeadingZeros64 (hash | ((U64) (k - 1))); // 0 <= col <= 64 - lgK
+  Long row = hash & (k - 1);
+  U32 rowCol = (U32) ((row << 6) | col);
+  assert (rowCol != ALL32BITS); // impossible because col <= 60
+  return (rowCol);
+}
+
 /*******************************************************/
 
 Boolean fm85Initialized = 0;
@@ -37,7 +58,7 @@ void fm85Init (void) {
     fillByteTrailingZerosTable();
     makeTheDecodingTables();
     fillInvPow2Tab ();
-    fillKxpByteLookup ();
+    selectBitCountingRoutines ();
   }
 }
 
@@ -71,6 +92,36 @@ Short determineCorrectOffset (Short lgK, Long c) {
   return ((Short) (tmp >> (lgK + 3))); // tmp / 8K
 }
 
+/*******************************************************/
+// The update routines only compare numCoupons with nextThreshold, instead of
+// recomputing the flavor and the offset on every call. The thresholds are
+// the same ones that determineFlavor() and determineCorrectOffset() use.
+
+void refreshUpdateMode (FM85 * self) {
+  Long k = (1LL << self->lgK);
+  if (self->isCompressed)                     { self->updateMode = UPDATE_COMPRESSED; }
+  else if (self->surprisingValueTable == NULL) { self->updateMode = UPDATE_EMPTY; }
+  else if (self->slidingWindow == NULL)        { self->updateMode = UPDATE_SPARSE; }
+  else if (self->shiftCursor != FM85_NO_SHIFT_IN_PROGRESS || self->ficScanCursor >= 0) {
+    self->updateMode = UPDATE_SHIFTING;
+  }
+  else                                         { self->updateMode = UPDATE_WINDOWED; }
+  if (self->windowRefCount != NULL || self->tableRefCount != NULL) {
+    self->updateMode = UPDATE_SHARED; // see updateShared()
+  }
+
+  if (self->slidingWindow == NULL) {
+    self->nextThreshold = (3*k + 31) >> 5;  // C >= 3K/32
+  }
+  else if (self->deferOffsets) {
+    self->nextThreshold = FM85_NO_THRESHOLD;
+  }
+  else {
+    Long w8 = ((Long) self->windowOffset) << 3;
+    self->nextThreshold = ((27 + w8) * k + 7) >> 3; // C >= (K * 27/8) + (K * windowOffset)
+  }
+}
+
 /*******************************************************/
 
 FM85 * fm85Make (Short lgK) {
@@ -86,21 +137,90 @@ FM85 * fm85Make (Short lgK) {
   self->windowOffset = 0;
   self->slidingWindow = (U8 *) NULL;
   self->surprisingValueTable = (u32Table *) NULL;
+  self->sparseTableLgSize = 2;
+  self->windowedTableLgSize = 2;
+  self->windowRefCount = (Long *) NULL;
+  self->tableRefCount = (Long *) NULL;
+  self->sharedWindow = (U8 *) NULL;
+  self->windowBlockOwned = (U64 *) NULL;
+  self->windowCopyCursor = 0;
 
   self->numCompressedSurprisingValues = 0;
   self->compressedSurprisingValues = (U32 *) NULL;
   self->csvLength = 0;
   self->compressedWindow = (U32 *) NULL;
   self->cwLength = 0;
+  self->lgCompressedSegments = 0;
   
   self->firstInterestingColumn = 0;
+  self->blockFirstInterestingColumn = (U8 *) NULL;
 
   Long k = (1LL << self->lgK);
 
-  self->kxp = ((double) k) * 1.0;
+  self->deferOffsets = 0;
+  self->shiftBudget = 0;
+  self->lgShiftThreads = 0;
+  self->shiftCursor = FM85_NO_SHIFT_IN_PROGRESS;
+  self->ficScanCursor = -1;
+  self->ficScanNumSlots = 0;
+  self->ficScanResult = 0;
+
+  // Every cell is 0, so each row contributes 1 - 2^-64, and the total is (k - 1) + (2^64 - k) * 2^-64.
+  self->kxpHi = (U64) (k - 1);
+  self->kxpLo = (U64) (-k);
   self->hipEstAccum = 0.0;
   self->hipErrAccum = 0.0;
+  self->estimateSeq = 0;
+
+  refreshUpdateMode (self);
+  return (self);
+}
+
+/*******************************************************/
+// After n distinct items, a cell in column col is a 1 with probability
+// 1 - exp(-n / (k * 2^(col+1))), approximately. These are good enough for sizing tables.
+
+static double expectedOnesInColumn (double kf, double nf, Short col) {
+  return (-1.0 * kf * expm1 (-1.0 * nf * invPow2Tab[col+1] / kf));
+}
+
+static double expectedCouponsOfN (double kf, double nf) {
+  double total = 0.0;
+  Short col;
+  for (col = 63; col >= 0; col--) { total += expectedOnesInColumn (kf, nf, col); }
+  return (total);
+}
+
+// The early zone's surprises are 0's, and the late zone's surprises are 1's.
+static double expectedSurprisesOfN (double kf, double nf, Short offset) {
+  double total = 0.0;
+  Short col;
+  for (col = 63; col >= offset + 8; col--) { total += expectedOnesInColumn (kf, nf, col); }
+  for (col = offset - 1; col >= 0; col--) { total += kf - expectedOnesInColumn (kf, nf, col); }
+  return (total);
+}
+
+/*******************************************************/
+// The table sizes are chosen for the expected number of items in each table.
+// The SPARSE flavor's table holds every coupon, but is abandoned at 3K/32 of them.
+// The windowed flavors' table holds the surprising values for the final offset.
+
+FM85 * fm85MakeWithHint (Short lgK, Long expectedN) {
+  FM85 * self = fm85Make (lgK);
+  if (expectedN <= 0) { return (self); }
+  Long k = (1LL << lgK);
+  double kf = (double) k;
+  double nf = (double) expectedN;
+  Long expectedC = (Long) expectedCouponsOfN (kf, nf);
+
+  Long numSparseItems = (32 * expectedC < 3 * k) ? expectedC : (3 * k) / 32;
+  self->sparseTableLgSize = u32TableLgSizeForNumItems (numSparseItems);
 
+  if (determineFlavor (lgK, expectedC) > SPARSE) {
+    Short offset = determineCorrectOffset (lgK, expectedC);
+    Long numSurprises = (Long) expectedSurprisesOfN (kf, nf, offset);
+    self->windowedTableLgSize = u32TableLgSizeForNumItems (numSurprises);
+  }
   return (self);
 }
 
@@ -117,6 +237,10 @@ FM85 * fm85Copy (FM85 * self) {
     Long k = (1LL << self->lgK);
     size_t theSize = k * sizeof(U8);
     newObj->slidingWindow = (U8 *) shallowCopy ((void *) self->slidingWindow, theSize);
+    if (self->windowBlockOwned != NULL) { // some of the rows are still only in the shared window
+      Long row;
+      for (row = 0; row < k; row++) { newObj->slidingWindow[row] = windowOfRow (self, row)[row]; }
+    }
   }
   if (self->compressedSurprisingValues != NULL) {
     size_t theSize = self->csvLength * sizeof(U32);
@@ -126,18 +250,196 @@ FM85 * fm85Copy (FM85 * self) {
     size_t theSize = self->cwLength * sizeof(U32);
     newObj->compressedWindow = (U32 *) shallowCopy ((void *) self->compressedWindow, theSize);
   }
+  if (self->blockFirstInterestingColumn != NULL) {
+    Long numBlocks = ((1LL << self->lgK) + (1LL << FM85_LG_ROWS_PER_BLOCK) - 1) >> FM85_LG_ROWS_PER_BLOCK;
+    newObj->blockFirstInterestingColumn = (U8 *) shallowCopy ((void *) self->blockFirstInterestingColumn, numBlocks * sizeof(U8));
+  }
+  newObj->windowRefCount = (Long *) NULL;
+  newObj->tableRefCount = (Long *) NULL;
+  newObj->sharedWindow = (U8 *) NULL;
+  newObj->windowBlockOwned = (U64 *) NULL;
+  newObj->windowCopyCursor = 0;
+  refreshUpdateMode (newObj);
 
   return (newObj);
 }
 
+/*******************************************************/
+// Copy-on-write. All of the sketches that share a window (or a table) point to
+// the same reference count. Before one of them modifies the shared buffer, it
+// makes its own copy, unless all of the others have been freed, in which case
+// it simply takes the buffer over. Since only a sharer can make a new sharer,
+// a count of 1 can't go up behind the back of the sketch that sees it.
+//
+// A window is copied one block of rows at a time. The first write to a shared
+// window allocates a private one, but only copies the block being written. Each
+// later update copies FM85_WINDOW_COPY_BUDGET more, and the shared window is
+// let go of once they have all been copied. Until then, the rows of the blocks
+// that haven't been copied are read from the shared window (see windowOfRow).
+// The table is still copied all at once, since its items aren't kept by row.
+
+static void addSharer (Long ** refCount) {
+  if (*refCount == NULL) {
+    *refCount = (Long *) malloc (sizeof(Long));
+    assert (*refCount != NULL);
+    **refCount = 1;
+  }
+  __atomic_add_fetch (*refCount, 1, __ATOMIC_RELAXED);
+}
+
+// Returns 1 if the caller was the last sharer, in which case the buffer is its to free.
+static Boolean dropSharer (Long * refCount) {
+  if (refCount == NULL) return 1;
+  if (__atomic_sub_fetch (refCount, 1, __ATOMIC_ACQ_REL) > 0) return 0;
+  free (refCount);
+  return 1;
+}
+
+static Long numWindowBlocks (FM85 * self) {
+  return (((1LL << self->lgK) + (1LL << FM85_LG_ROWS_PER_BLOCK) - 1) >> FM85_LG_ROWS_PER_BLOCK);
+}
+
+static Boolean windowBlockIsOwned (FM85 * self, Long block) {
+  return ((Boolean) ((self->windowBlockOwned[block >> 6] >> (block & 63)) & 1));
+}
+
+U8 * windowOfRow (FM85 * self, Long row) {
+  if (self->windowBlockOwned == NULL) { return (self->slidingWindow); }
+  Boolean owned = windowBlockIsOwned (self, row >> FM85_LG_ROWS_PER_BLOCK);
+  return (owned ? self->slidingWindow : self->sharedWindow);
+}
+
+static void freeWindow (FM85 * self) {
+  if (self->windowBlockOwned != NULL) { // the private window is only partly copied
+    free (self->slidingWindow);
+    free (self->windowBlockOwned);
+    self->windowBlockOwned = (U64 *) NULL;
+    self->slidingWindow = self->sharedWindow;
+    self->sharedWindow = (U8 *) NULL;
+  }
+  if (dropSharer (self->windowRefCount)) { free (self->slidingWindow); }
+  self->slidingWindow = (U8 *) NULL;
+  self->windowRefCount = (Long *) NULL;
+}
+
+static void freeTable (FM85 * self) {
+  if (dropSharer (self->tableRefCount)) { u32TableFree (self->surprisingValueTable); }
+  self->surprisingValueTable = (u32Table *) NULL;
+  self->tableRefCount = (Long *) NULL;
+}
+
+static void copyWindowBlock (FM85 * self, Long block) {
+  Long k = (1LL << self->lgK);
+  Long rowLo = block << FM85_LG_ROWS_PER_BLOCK;
+  Long numRows = (1LL << FM85_LG_ROWS_PER_BLOCK);
+  if (numRows > k - rowLo) { numRows = k - rowLo; }
+  memcpy ((void *) (self->slidingWindow + rowLo), (void *) (self->sharedWindow + rowLo), (size_t) numRows);
+  self->windowBlockOwned[block >> 6] |= (1ULL << (block & 63));
+}
+
+// Copies the blocks below blockHi that haven't been copied yet,
+// and lets go of the shared window once all of them have been.
+static void copyWindowBlocks (FM85 * self, Long blockHi) {
+  Long numBlocks = numWindowBlocks (self);
+  if (blockHi > numBlocks) { blockHi = numBlocks; }
+  Long block;
+  for (block = self->windowCopyCursor; block < blockHi; block++) {
+    if (!windowBlockIsOwned (self, block)) { copyWindowBlock (self, block); }
+  }
+  self->windowCopyCursor = blockHi;
+  if (blockHi == numBlocks) {
+    free (self->windowBlockOwned);
+    self->windowBlockOwned = (U64 *) NULL;
+    if (dropSharer (self->windowRefCount)) { free (self->sharedWindow); }
+    self->sharedWindow = (U8 *) NULL;
+    self->windowRefCount = (Long *) NULL;
+    refreshUpdateMode (self);
+  }
+}
+
+static void ownWindow (FM85 * self) {
+  Long * refCount = self->windowRefCount;
+  if (refCount == NULL) return;
+  if (self->windowBlockOwned != NULL) { // finish the copy that is under way
+    copyWindowBlocks (self, numWindowBlocks (self));
+    return;
+  }
+  if (__atomic_load_n (refCount, __ATOMIC_ACQUIRE) == 1) { // the other sharers are gone
+    free (refCount);
+    self->windowRefCount = (Long *) NULL;
+    return;
+  }
+  U8 * copy = (U8 *) shallowCopy ((void *) self->slidingWindow, (size_t) (1LL << self->lgK));
+  freeWindow (self);
+  self->slidingWindow = copy;
+}
+
+// Makes the block that holds the row private, starting a copy of the window if necessary.
+static void ownWindowBlock (FM85 * self, Long row) {
+  Long * refCount = self->windowRefCount;
+  if (refCount == NULL) return;
+  if (self->windowBlockOwned == NULL) {
+    if (__atomic_load_n (refCount, __ATOMIC_ACQUIRE) == 1) { ownWindow (self); return; } // it can simply be taken over
+    Long numBlocks = numWindowBlocks (self);
+    self->sharedWindow = self->slidingWindow;
+    self->slidingWindow = (U8 *) malloc ((size_t) (1LL << self->lgK));
+    assert (self->slidingWindow != NULL);
+    self->windowBlockOwned = (U64 *) calloc ((size_t) ((numBlocks + 63) >> 6), sizeof(U64));
+    assert (self->windowBlockOwned != NULL);
+    self->windowCopyCursor = 0;
+  }
+  Long block = row >> FM85_LG_ROWS_PER_BLOCK;
+  if (!windowBlockIsOwned (self, block)) { copyWindowBlock (self, block); }
+}
+
+static void ownTable (FM85 * self) {
+  Long * refCount = self->tableRefCount;
+  if (refCount == NULL) return;
+  if (__atomic_load_n (refCount, __ATOMIC_ACQUIRE) == 1) { // the other sharers are gone
+    free (refCount);
+    self->tableRefCount = (Long *) NULL;
+    return;
+  }
+  u32Table * copy = u32TableCopy (self->surprisingValueTable);
+  freeTable (self);
+  self->surprisingValueTable = copy;
+}
+
+/*******************************************************/
+
+FM85 * fm85Snapshot (FM85 * self) {
+  assert (self != NULL);
+  if (self->isCompressed || self->surprisingValueTable == NULL) { return (fm85Copy (self)); } // nothing big to share
+  if (self->windowBlockOwned != NULL) { // a window that is only partly copied can't be shared
+    copyWindowBlocks (self, numWindowBlocks (self));
+  }
+  FM85 * newObj = (FM85 *) shallowCopy ((void *) self, sizeof(FM85));
+  if (self->slidingWindow != NULL) {
+    addSharer (&self->windowRefCount);
+    newObj->windowRefCount = self->windowRefCount;
+  }
+  // A shared table is never changed, which includes a resize in progress. That only
+  // moves along when an item is inserted or deleted, and a sharer copies the table first.
+  addSharer (&self->tableRefCount);
+  newObj->tableRefCount = self->tableRefCount;
+  if (self->blockFirstInterestingColumn != NULL) {
+    Long numBlocks = numWindowBlocks (self);
+    newObj->blockFirstInterestingColumn = (U8 *) shallowCopy ((void *) self->blockFirstInterestingColumn, numBlocks * sizeof(U8));
+  }
+  refreshUpdateMode (self);
+  refreshUpdateMode (newObj);
+  return (newObj);
+}
+
 /*******************************************************/
 
 void fm85Free (FM85 * self) {
   if (self != NULL) {
-    if (self->surprisingValueTable != NULL) u32TableFree (self->surprisingValueTable);
-    if (self->slidingWindow != NULL) free (self->slidingWindow);
+    if (self->surprisingValueTable != NULL) freeTable (self);
+    if (self->slidingWindow != NULL) freeWindow (self);
     if (self->compressedSurprisingValues != NULL) free (self->compressedSurprisingValues);
     if (self->compressedWindow != NULL) free (self->compressedWindow);
+    if (self->blockFirstInterestingColumn != NULL) free (self->blockFirstInterestingColumn);
     free (self);
   }
 }
@@ -152,6 +454,8 @@ void fm85Free (FM85 * self) {
 // structures "as is".
 
 // This produces a full-size k-by-64 bit matrix from any Live sketch.
+// It also works while an amortized window shift is in progress, in which
+// case the rows at or above shiftCursor are still at (offset - 1).
 
 U64 * bitMatrixOfSketch (FM85 * self) {
   assert (self->isCompressed == 0);
@@ -164,33 +468,41 @@ U64 * bitMatrixOfSketch (FM85 * self) {
 
 // Fill the matrix with default rows in which the "early zone" is filled with ones.
 // This is essential for the routine's O(k) time cost (as opposed to O(C)).
+  Long shiftCursor = (self->shiftCursor < k) ? self->shiftCursor : k;
+  assert (shiftCursor == k || offset >= 1);
   U64 defaultRow = (1ULL << offset) - 1;
-  for (i = 0; i < k; i++) { matrix[i] = defaultRow; } 
+  for (i = 0; i < shiftCursor; i++) { matrix[i] = defaultRow; } 
+  for (i = shiftCursor; i < k; i++) { matrix[i] = defaultRow >> 1; } 
 
   if (self->numCoupons == 0) { 
     return (matrix); // Returning a matrix of zeros rather than NULL.
   }
 
-  U8 * window = self->slidingWindow;
-  if (window != NULL) { // In other words, we are in window mode, not sparse mode.
-    for (i = 0; i < k; i++) { // set the window bits, trusting the sketch's current offset.
-      matrix[i] |= (((U64) window[i]) << offset);
+  if (self->slidingWindow != NULL) { // In other words, we are in window mode, not sparse mode.
+    for (i = 0; i < shiftCursor; i++) { // set the window bits, trusting the sketch's current offset.
+      matrix[i] |= (((U64) windowOfRow (self, i)[i]) << offset);
+    }
+    for (i = shiftCursor; i < k; i++) {
+      matrix[i] |= (((U64) windowOfRow (self, i)[i]) << (offset - 1));
     }
   }
 
   u32Table * table = self->surprisingValueTable;
   assert (table != NULL);
-  U32 * slots = table->slots;
-  Long numSlots = (1LL << table->lgSize); 
-  for (i = 0; i < numSlots; i++) { 
-    U32 rowCol = slots[i];
-    if (rowCol != ALL32BITS) {
-      Short col = (Short) (rowCol & 63);
-      Long  row = (Long)  (rowCol >> 6);
-      // Flip the specified matrix bit from its default value.
-      // In the "early" zone the bit changes from 1 to 0.
-      // In the "late" zone the bit changes from 0 to 1.
-      matrix[row] ^= (1ULL << col); 
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) { 
+      U32 rowCol = slots[i];
+      if (rowCol != ALL32BITS) {
+	Short col = (Short) (rowCol & 63);
+	Long  row = (Long)  (rowCol >> 6);
+	// Flip the specified matrix bit from its default value.
+	// In the "early" zone the bit changes from 1 to 0.
+	// In the "late" zone the bit changes from 0 to 1.
+	matrix[row] ^= (1ULL << col); 
+      }
     }
   }
 
@@ -202,7 +514,8 @@ U64 * bitMatrixOfSketch (FM85 * self) {
 void promoteEmptyToSparse (FM85 * self) {
   assert (self->numCoupons == 0);
   assert (self->surprisingValueTable == NULL);
-  self->surprisingValueTable = u32TableMake (2, 6 + self->lgK);
+  self->surprisingValueTable = u32TableMake (self->sparseTableLgSize, 6 + self->lgK);
+  refreshUpdateMode (self);
 }
 
 /*******************************************************/
@@ -211,145 +524,700 @@ void promoteEmptyToSparse (FM85 * self) {
 void promoteSparseToWindowed (FM85 * self) {
   Long k = (1LL << self->lgK);
   Long c32 = self->numCoupons << 5;
-  assert (c32 == 3 * k || (self->lgK == 4 && c32 > 3 * k));
+  assert (c32 >= 3 * k); // with equality, except for K = 2^4 and for the concurrent sketch, which may promote late
   Long i;
 
   U8 * window = (U8 *) malloc ((size_t) (k * sizeof(U8)));
   assert (window != NULL);
   bzero ((void *) window, (size_t) k); // zero the memory (because we will be OR'ing into it)
 
-  u32Table * newTable = u32TableMake (2, 6 + self->lgK);
+  u32Table * newTable = u32TableMake (self->windowedTableLgSize, 6 + self->lgK);
 
   u32Table * oldTable = self->surprisingValueTable;
-  U32 * oldSlots = oldTable->slots;
-  Long oldNumSlots = (1LL << oldTable->lgSize); 
 
   assert (self->windowOffset == 0);
 
-  for (i = 0; i < oldNumSlots; i++) { 
-    U32 rowCol = oldSlots[i];
-    if (rowCol != ALL32BITS) {
-      Short col = (Short) (rowCol & 63);
-      if (col < 8) {
-	Long  row = (Long) (rowCol >> 6);
-	window[row] |= (1 << col);
-      }
-      else {
-	// cannot use u32TableMustInsert(), because it doesn't provide for growth
-	Boolean isNovel = u32TableMaybeInsert (newTable, rowCol);
-	assert (isNovel == 1);
+  int part;
+  for (part = 0; part < 2; part++) { // the old table is about to be freed, so a resize in progress doesn't matter
+    Long oldNumSlots;
+    U32 * oldSlots = u32TableSlotsOfPart (oldTable, part, &oldNumSlots);
+    for (i = 0; i < oldNumSlots; i++) { 
+      U32 rowCol = oldSlots[i];
+      if (rowCol != ALL32BITS) {
+	Short col = (Short) (rowCol & 63);
+	if (col < 8) {
+	  Long  row = (Long) (rowCol >> 6);
+	  window[row] |= (1 << col);
+	}
+	else {
+	  // cannot use u32TableMustInsert(), because it doesn't provide for growth
+	  Boolean isNovel = u32TableMaybeInsert (newTable, rowCol);
+	  assert (isNovel == 1);
+	}
       }
     }
   }
   //  fprintf (stderr, "Number of surprising values dropped from %lld to %lld\n", oldTable->numItems, newTable->numItems);
 
-  assert (self->slidingWindow == NULL);
+  assert (self->slidingWindow == NULL && self->windowRefCount == NULL);
   self->slidingWindow = window;
   
+  freeTable (self); // the old one might be shared with a snapshot
   self->surprisingValueTable = newTable;
-  u32TableFree (oldTable);
+  refreshUpdateMode (self);
 }
 
 /*******************************************************/
-// The KXP register is a double with roughly 50 bits of precision, but
-// it might need roughly 90 bits to track the value with perfect accuracy.
-// Therefore we recalculate KXP occasionally from the sketch's full bitmatrix
-// so that it will reflect changes that were previously outside the mantissa.
+// This moves the window of the rows in [rowLo, rowHi) one column to the right,
+// working in place. For each row, column oldOffset leaves the window and joins
+// the early zone, where a 0 is surprising, and column (oldOffset + 8) joins the
+// window from the late zone, where a 1 was surprising. Those are the only two
+// matrix cells per row whose representation changes, so no other surprising
+// values are touched.
+
+// This version looks up the entering cell of each row in the table, so its
+// cost is proportional to the number of rows, which makes it suitable for
+// moving the window a few rows at a time.
+
+void shiftWindowOfRows (U8 * window, u32Table * table, Long rowLo, Long rowHi, Short oldOffset) {
+  assert (oldOffset >= 0 && oldOffset + 8 <= 63);
+  Long row;
+  for (row = rowLo; row < rowHi; row++) {
+    U8 oldBits = window[row];
+    U32 rowColEnteringWindow = (U32) ((row << 6) | (oldOffset + 8));
+    U32 enteringBit = (U32) u32TableMaybeDelete (table, rowColEnteringWindow); // no longer surprising
+    if ((oldBits & 1) == 0) { // this 0 is now in the early zone, so it becomes surprising
+      U32 rowColLeavingWindow = (U32) ((row << 6) | oldOffset);
+      Boolean isNovel = u32TableMaybeInsert (table, rowColLeavingWindow);
+      assert (isNovel == 1);
+    }
+    window[row] = (U8) ((oldBits >> 1) | (enteringBit << 7));
+  }
+}
 
-void refreshKXP (FM85 * self, U64 * bitMatrix) {
-  Long k = (1LL << self->lgK);
+/*******************************************************/
+// This moves the window of all k rows from oldOffset to any larger newOffset
+// in one pass. The cells in columns [oldOffset, newOffset) join the early zone,
+// where each 0 becomes a surprise, and the cells in columns [oldOffset + 8, newOffset + 8)
+// leave the late zone, where each 1 was a surprise. Instead of k table lookups,
+// the latter are found with one sequential scan of the table.
+
+// When the window moves by at most 8 columns, all of the cells that join the
+// early zone come from the old window, and all of the cells that leave the late
+// zone land in the new window, so each row can be handled on its own. Longer
+// moves also turn late-zone cells directly into early-zone cells, so the leaving
+// surprises are sorted and merged into the rows while walking them in order.
+
+void shiftWholeWindow (U8 * window, u32Table * table, Long k, Short oldOffset, Short newOffset) {
+  assert (oldOffset >= 0 && oldOffset < newOffset && newOffset <= 56);
+  Short distance = newOffset - oldOffset;
+  Short colLo = oldOffset + 8; // the late-zone columns in [colLo, colHi) are leaving it
+  Short colHi = newOffset + 8;
+  U64 earlyMask = (1ULL << distance) - 1; // the columns joining the early zone, relative to oldOffset
   Long i;
   Short j;
 
- // for improved numerical accuracy, we separately sum the bytes of the U64's
-  double byteSums [8]; // allocating on the stack
+  Long numLeaving = 0;
+  U32 * leaving = (U32 *) malloc ((size_t) ((table->numItems + 1) * sizeof(U32)));
+  assert (leaving != NULL);
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) {
+      U32 rowCol = slots[i];
+      Short col = (Short) (rowCol & 63);
+      if (rowCol != ALL32BITS && col >= colLo && col < colHi) { leaving[numLeaving++] = rowCol; }
+    }
+  }
+  if (distance > 8 && numLeaving > 1) { introspectiveInsertionSort (leaving, 0, numLeaving - 1); } // the scan order is nearly sorted
+
+  // Count the new early-zone surprises, so that the table can be grown
+  // up front instead of through a cascade of rebuilds in the middle of the shift.
+  Long numEarly = 0;
+  Long next = 0;
+  if (distance <= 8) {
+    for (j = 0; j < distance; j++) {
+      for (i = 0; i < k; i++) { numEarly += ((~window[i]) >> j) & 1; }
+    }
+  }
+  else {
+    for (i = 0; i < k; i++) {
+      U64 cells = (U64) window[i]; // these are relative to oldOffset
+      while (next < numLeaving && (Long) (leaving[next] >> 6) == i) {
+	cells |= (1ULL << ((leaving[next] & 63) - oldOffset));
+	next++;
+      }
+      U64 zeros = (~cells) & earlyMask;
+      while (zeros != 0) { zeros &= (zeros - 1); numEarly++; }
+    }
+  }
+  u32TableReserve (table, table->numItems - numLeaving + numEarly);
 
-  for (j = 0; j < 8; j++) { byteSums[j] = 0.0; }
+  for (i = 0; i < numLeaving; i++) {
+    Boolean wasPresent = u32TableMaybeDelete (table, leaving[i]); // no longer surprising
+    assert (wasPresent == 1);
+  }
 
+  next = 0;
   for (i = 0; i < k; i++) {
-    U64 word = bitMatrix[i];
-    for (j = 0; j < 8; j++) { 
-      U8 byte = word & 0xff;
-      byteSums[j] += kxpByteLookup[byte];
-      word >>= 8;
+    U64 cells = (U64) window[i];
+    while (distance > 8 && next < numLeaving && (Long) (leaving[next] >> 6) == i) {
+      cells |= (1ULL << ((leaving[next] & 63) - oldOffset));
+      next++;
     }
+    U64 zeros = (~cells) & earlyMask;
+    while (zeros != 0) { // each of these 0's is now in the early zone, so it becomes surprising
+      Short col = oldOffset + fastCountTrailingZeros64 (zeros);
+      Boolean isNovel = u32TableMaybeInsert (table, (U32) ((i << 6) | col));
+      assert (isNovel == 1);
+      zeros &= (zeros - 1);
+    }
+    window[i] = (U8) (cells >> distance);
   }
 
-  double total = 0.0;
-  for (j = 7; j >= 0; j--) { // the reverse order is important
-    double factor = invPow2Tab[8*j]; // pow (256.0, (-1.0 * ((double) j)));
-    total += factor * byteSums[j];
+  if (distance <= 8) {
+    for (i = 0; i < numLeaving; i++) {
+      window[leaving[i] >> 6] |= (U8) (1 << ((leaving[i] & 63) - newOffset));
+    }
+  }
+  free (leaving);
+}
+
+/*******************************************************/
+// Early-zone surprises are never added between window shifts, only removed,
+// so a value computed here remains a valid lower bound until the next shift.
+
+Short calculateFirstInterestingColumnOfTable (u32Table * table, Short offset) {
+  Long i;
+  Short result = offset;
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) { 
+      U32 rowCol = slots[i];
+      if (rowCol != ALL32BITS) {
+	Short col = (Short) (rowCol & 63);
+	if (col < result) { result = col; }
+      }
+    }
   }
+  return (result);
+}
+
+/*******************************************************/
+// A row's first 0 only ever moves to the right as coupons are collected,
+// so a lower bound on it, taken over each block of 64 rows, stays valid
+// forever. This refreshes those bounds from the window and the early-zone
+// surprises. It requires every row to be at the same offset.
 
-  //  fprintf (stderr, "%.3f\n", ((double) self->numCoupons) / k);
-  //  fprintf (stderr, "%.19g\told value of KXP\n", self->kxp);
-  //  fprintf (stderr, "%.19g\tnew value of KXP\n", total);
-  //  fflush (stderr);
+void refreshBlockFirstInterestingColumns (FM85 * self) {
+  Long k = (1LL << self->lgK);
+  Long rowsPerBlock = (1LL << FM85_LG_ROWS_PER_BLOCK);
+  Long numBlocks = (k + rowsPerBlock - 1) >> FM85_LG_ROWS_PER_BLOCK;
+  Short offset = self->windowOffset;
+  U8 * window = self->slidingWindow;
+  assert (window != NULL);
+  assert (self->shiftCursor == FM85_NO_SHIFT_IN_PROGRESS);
+  if (self->blockFirstInterestingColumn == NULL) {
+    self->blockFirstInterestingColumn = (U8 *) malloc ((size_t) (numBlocks * sizeof(U8)));
+    assert (self->blockFirstInterestingColumn != NULL);
+  }
+  U8 * blockFIC = self->blockFirstInterestingColumn;
+  Long block, i;
+
+  for (block = 0; block < numBlocks; block++) {
+    Long rowHi = (block + 1) * rowsPerBlock;
+    if (rowHi > k) { rowHi = k; }
+    U8 allBits = 0xff;
+    for (i = block * rowsPerBlock; i < rowHi; i++) { allBits &= window[i]; }
+    // The 0's beyond the window are not tracked, so offset + 8 is the largest safe bound.
+    blockFIC[block] = (U8) (offset + fastCountTrailingZeros8 ((U8) ~allBits));
+  }
 
-  self->kxp = total;
+  u32Table * table = self->surprisingValueTable;
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) {
+      U32 rowCol = slots[i];
+      if (rowCol != ALL32BITS && (Short) (rowCol & 63) < offset) { // a 0 in the early zone
+	block = (Long) (rowCol >> (6 + FM85_LG_ROWS_PER_BLOCK));
+	if ((rowCol & 63) < blockFIC[block]) { blockFIC[block] = (U8) (rowCol & 63); }
+      }
+    }
+  }
+}
 
+/*******************************************************/
+// The same thing as shiftWholeWindow() followed by the two recalculations of the
+// interesting columns, split across 2^lgNumThreads threads that each own an equal
+// range of rows. An item's home slot in the table is the top lgSize bits of its
+// rowCol, so each range of rows also has a contiguous range of home slots, and a
+// thread finds all of its rows' surprises in that range of slots or in the cluster
+// that spills past its end. Each thread shifts its rows and produces their new
+// surprises in sorted order. Then the table is rebuilt, with each thread laying out
+// its surprises in its own range of the new slots. The few that would spill past
+// the end of that range are inserted afterwards by a single thread.
+
+typedef struct fm85_shift_worker_type
+{
+  FM85 * sketch;
+  Short newOffset;
+  Short lgNumThreads;
+  Long id;
+  pthread_barrier_t * barrier;
+  U32 * items;        // The surprising values of this thread's rows after the shift, in order.
+  Long numItems;
+  Short firstInterestingColumn;
+  u32Table * newTable;  // This is made between the phases.
+  Long firstSpilled;    // The items from here on didn't fit in this thread's range of the new table.
+} FM85SW;
+
+// Finds this thread's surprises in one part of the table (see u32TableSlotsOfPart), and
+// returns how many there are. They are also stored in mine, unless it is NULL.
+
+static Long gatherSurprisesOfPart (FM85SW * worker, int part, U32 * mine) {
+  FM85 * self = worker->sketch;
+  Short lgRows = self->lgK - worker->lgNumThreads;
+  Long rowLo = worker->id << lgRows;
+  Long rowHi = rowLo + (1LL << lgRows);
+  u32Table * table = self->surprisingValueTable;
+  Long numSlots;
+  U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+  if (numSlots == 0) { return (0); }
+  Long mask = numSlots - 1;
+  Short lgSlots = ((part == 1) ? table->oldLgSize : table->lgSize) - worker->lgNumThreads;
+  Long slotLo = worker->id << lgSlots;
+  Long scanEnd = slotLo + (1LL << lgSlots);
+  while (slots[scanEnd & mask] != ALL32BITS) { scanEnd++; } // the table is never full
+  Long numMine = 0;
+  Long s;
+  for (s = slotLo; s < scanEnd; s++) {
+    Long row = (Long) (slots[s & mask] >> 6);
+    if (slots[s & mask] != ALL32BITS && row >= rowLo && row < rowHi) {
+      if (mine != NULL) { mine[numMine] = slots[s & mask]; }
+      numMine++;
+    }
+  }
+  if (mine != NULL && numMine > 1) { introspectiveInsertionSort (mine, 0, numMine - 1); } // the scan order is nearly sorted
+  return (numMine);
 }
 
+static void shiftRowsOfOneThread (FM85SW * worker) {
+  FM85 * self = worker->sketch;
+  Short lgRows = self->lgK - worker->lgNumThreads;
+  Long rowLo = worker->id << lgRows;
+  Long rowHi = rowLo + (1LL << lgRows);
+  Long i;
+
+  // gather this thread's surprises, merging those in the old slots of a resize in progress
+  Long numNew = gatherSurprisesOfPart (worker, 0, (U32 *) NULL);
+  Long numOld = gatherSurprisesOfPart (worker, 1, (U32 *) NULL);
+  Long numMine = numNew + numOld;
+  U32 * mine = (U32 *) malloc ((size_t) ((numMine + 1) * sizeof(U32)));
+  assert (mine != NULL);
+  gatherSurprisesOfPart (worker, 0, mine);
+  if (numOld > 0) {
+    U32 * both = (U32 *) malloc ((size_t) ((numMine + 1) * sizeof(U32)));
+    assert (both != NULL);
+    gatherSurprisesOfPart (worker, 1, both + numNew);
+    u32Merge (mine, 0, numNew, both, numNew, numOld, both, 0); // the output stays behind the old ones
+    free (mine);
+    mine = both;
+  }
+
+  Short oldOffset = self->windowOffset;
+  Short newOffset = worker->newOffset;
+  Short distance = newOffset - oldOffset;
+  Short colHi = newOffset + 8; // the late-zone columns in [oldOffset + 8, colHi) are leaving it
+  U64 earlyMask = (1ULL << distance) - 1; // the columns joining the early zone, relative to oldOffset
+  U8 * window = self->slidingWindow;
+
+  // count the new surprises, which are the old ones that aren't leaving, plus the new 0's in the early zone
+  Long numItems = 0;
+  Long next = 0;
+  for (i = rowLo; i < rowHi; i++) {
+    U64 cells = (U64) window[i]; // these are relative to oldOffset
+    for (; next < numMine && (Long) (mine[next] >> 6) == i; next++) {
+      Short col = (Short) (mine[next] & 63);
+      if (col >= oldOffset && col < colHi) { cells |= (1ULL << (col - oldOffset)); }
+      else { numItems++; }
+    }
+    U64 zeros = (~cells) & earlyMask;
+    while (zeros != 0) { zeros &= (zeros - 1); numItems++; }
+  }
+  U32 * items = (U32 *) malloc ((size_t) ((numItems + 1) * sizeof(U32)));
+  assert (items != NULL);
+
+  // then move the rows, and recalculate the interesting columns along the way
+  U8 * blockFIC = self->blockFirstInterestingColumn;
+  Long rowsPerBlock = (1LL << FM85_LG_ROWS_PER_BLOCK);
+  Short firstInterestingColumn = newOffset;
+  Short blockFirstEarlyColumn = 64; // none yet
+  U8 allBits = 0xff;
+  numItems = 0;
+  next = 0;
+  for (i = rowLo; i < rowHi; i++) {
+    U64 cells = (U64) window[i];
+    for (; next < numMine && (Long) (mine[next] >> 6) == i && (Short) (mine[next] & 63) < colHi; next++) {
+      Short col = (Short) (mine[next] & 63);
+      if (col < oldOffset) { // this 0 stays in the early zone
+	items[numItems++] = mine[next];
+	if (col < blockFirstEarlyColumn) { blockFirstEarlyColumn = col; }
+      }
+      else { cells |= (1ULL << (col - oldOffset)); }
+    }
+    U64 zeros = (~cells) & earlyMask;
+    if (zeros != 0 && oldOffset + fastCountTrailingZeros64 (zeros) < blockFirstEarlyColumn) {
+      blockFirstEarlyColumn = oldOffset + fastCountTrailingZeros64 (zeros);
+    }
+    while (zeros != 0) { // each of these 0's is now in the early zone, so it becomes surprising
+      items[numItems++] = (U32) ((i << 6) | (oldOffset + fastCountTrailingZeros64 (zeros)));
+      zeros &= (zeros - 1);
+    }
+    for (; next < numMine && (Long) (mine[next] >> 6) == i; next++) { items[numItems++] = mine[next]; } // these stay in the late zone
+    window[i] = (U8) (cells >> distance);
+
+    allBits &= window[i];
+    if (((i + 1) & (rowsPerBlock - 1)) == 0) { // the end of a block (see refreshBlockFirstInterestingColumns)
+      Short bound = newOffset + fastCountTrailingZeros8 ((U8) ~allBits);
+      if (blockFirstEarlyColumn < bound) { bound = blockFirstEarlyColumn; }
+      blockFIC[i >> FM85_LG_ROWS_PER_BLOCK] = (U8) bound;
+      if (blockFirstEarlyColumn < firstInterestingColumn) { firstInterestingColumn = blockFirstEarlyColumn; }
+      blockFirstEarlyColumn = 64;
+      allBits = 0xff;
+    }
+  }
+  free (mine);
+  worker->items = items;
+  worker->numItems = numItems;
+  worker->firstInterestingColumn = firstInterestingColumn;
+}
+
+static void layOutItemsOfOneThread (FM85SW * worker) {
+  Short lgSlots = worker->newTable->lgSize - worker->lgNumThreads;
+  Long slotLo = worker->id << lgSlots;
+  worker->firstSpilled = u32TableLayOutSortedItems (worker->newTable, slotLo, slotLo + (1LL << lgSlots),
+						   worker->items, worker->numItems);
+}
+
+static void * shiftWorkerMain (void * arg) {
+  FM85SW * worker = (FM85SW *) arg;
+  shiftRowsOfOneThread (worker);
+  pthread_barrier_wait (worker->barrier);
+  pthread_barrier_wait (worker->barrier); // meanwhile, the first thread makes the new table
+  layOutItemsOfOneThread (worker);
+  return (NULL);
+}
+
+static void shiftWholeWindowInParallel (FM85 * self, Short newOffset, Short lgNumThreads) {
+  Long numThreads = (1LL << lgNumThreads);
+  Long k = (1LL << self->lgK);
+  u32Table * table = self->surprisingValueTable;
+  assert (self->lgK - lgNumThreads >= FM85_LG_ROWS_PER_BLOCK);
+  assert (table->lgSize >= lgNumThreads);
+  assert (table->oldSlots == NULL || table->oldLgSize >= lgNumThreads);
+  if (self->blockFirstInterestingColumn == NULL) {
+    self->blockFirstInterestingColumn = (U8 *) malloc ((size_t) (k >> FM85_LG_ROWS_PER_BLOCK));
+    assert (self->blockFirstInterestingColumn != NULL);
+  }
+
+  FM85SW * workers = (FM85SW *) malloc (((size_t) numThreads) * sizeof(FM85SW));
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numThreads) * sizeof(pthread_t));
+  assert (workers != NULL && threads != NULL);
+  pthread_barrier_t barrier;
+  pthread_barrier_init (&barrier, NULL, (unsigned) numThreads);
+  Long t, j;
+  for (t = 0; t < numThreads; t++) {
+    workers[t].sketch = self;
+    workers[t].newOffset = newOffset;
+    workers[t].lgNumThreads = lgNumThreads;
+    workers[t].id = t;
+    workers[t].barrier = &barrier;
+  }
+  for (t = 1; t < numThreads; t++) {
+    if (pthread_create (&threads[t], NULL, shiftWorkerMain, (void *) &workers[t]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+  shiftRowsOfOneThread (&workers[0]);
+  pthread_barrier_wait (&barrier);
+
+  // the new table has the size that the old one would have ended up with
+  Long numItems = 0;
+  Short firstInterestingColumn = newOffset;
+  for (t = 0; t < numThreads; t++) {
+    numItems += workers[t].numItems;
+    if (workers[t].firstInterestingColumn < firstInterestingColumn) { firstInterestingColumn = workers[t].firstInterestingColumn; }
+  }
+  Short newLgSize = u32TableLgSizeForResize (table->lgSize, numItems);
+  if (newLgSize < lgNumThreads) { newLgSize = lgNumThreads; }
+  u32Table * newTable = u32TableMake (newLgSize, table->validBits);
+  for (t = 0; t < numThreads; t++) { workers[t].newTable = newTable; }
+  pthread_barrier_wait (&barrier);
+  layOutItemsOfOneThread (&workers[0]);
+  for (t = 1; t < numThreads; t++) { pthread_join (threads[t], NULL); }
+  pthread_barrier_destroy (&barrier);
+
+  for (t = 0; t < numThreads; t++) { newTable->numItems += workers[t].firstSpilled; }
+  for (t = 0; t < numThreads; t++) {
+    for (j = workers[t].firstSpilled; j < workers[t].numItems; j++) {
+      Boolean isNovel = u32TableMaybeInsert (newTable, workers[t].items[j]);
+      assert (isNovel == 1);
+    }
+    free (workers[t].items);
+  }
+  assert (newTable->numItems == numItems);
+  free (table->slots); // the table keeps its identity, but takes over the new slots
+  // They hold all of the items, so a resize in progress is simply dropped.
+  if (table->nextSlots != NULL) { free (table->nextSlots); table->nextSlots = (U32 *) NULL; }
+  if (table->oldSlots != NULL) { free (table->oldSlots); table->oldSlots = (U32 *) NULL; }
+  table->slots = newTable->slots;
+  table->lgSize = newTable->lgSize;
+  table->numItems = newTable->numItems;
+  table->numRebuilds += 1;
+  table->numRebuildMoves += numItems;
+  free (newTable);
+  self->windowOffset = newOffset;
+  self->firstInterestingColumn = firstInterestingColumn;
+  free (workers);
+  free (threads);
+}
 
 /*******************************************************/
-// this moves the sliding window
+// this moves the sliding window, possibly by several columns at once
 
 void modifyOffset (FM85 * self, Short newOffset) {
   assert (newOffset >= 0 && newOffset <= 56);
-  assert (newOffset == self->windowOffset + 1);
+  assert (newOffset > self->windowOffset);
   assert (newOffset == determineCorrectOffset (self->lgK, self->numCoupons));
 
   assert (self->slidingWindow != NULL);
   assert (self->surprisingValueTable != NULL);
+  assert (self->shiftCursor == FM85_NO_SHIFT_IN_PROGRESS); // the previous shift has been completed
+
+  if (self->shiftBudget > 0 && newOffset == self->windowOffset + 1) {
+    // the rows will be moved a few at a time by continueShift()
+    self->windowOffset = newOffset;
+    self->shiftCursor = 0;
+    self->ficScanCursor = -1; // firstInterestingColumn is still a valid lower bound
+    refreshUpdateMode (self);
+    return;
+  }
+
+  moveWindowTo (self, newOffset);
+}
+
+/*******************************************************/
+// This is the synchronous part of modifyOffset(), without the check that
+// newOffset is the correct one for C. The partitioned engine uses it
+// to move each partition to the offset of the whole sketch.
+
+void moveWindowTo (FM85 * self, Short newOffset) {
+  assert (newOffset >= 0 && newOffset <= 56);
+  assert (newOffset > self->windowOffset);
+  assert (self->slidingWindow != NULL);
+  assert (self->shiftCursor == FM85_NO_SHIFT_IN_PROGRESS);
   Long k = (1LL << self->lgK);
 
-  // Construct the full-sized bit matrix that corresponds to the sketch
-  U64 * bitMatrix = bitMatrixOfSketch (self);
-  assert (bitMatrix != NULL);
+  ownWindow (self);
+  ownTable (self);
+  u32Table * table = self->surprisingValueTable;
+  if (self->lgShiftThreads > 0 && table->lgSize >= self->lgShiftThreads &&
+      (table->oldSlots == NULL || table->oldLgSize >= self->lgShiftThreads)) {
+    shiftWholeWindowInParallel (self, newOffset, self->lgShiftThreads);
+  }
+  else {
+    shiftWholeWindow (self->slidingWindow, self->surprisingValueTable, k, self->windowOffset, newOffset);
+    self->windowOffset = newOffset;
+    self->firstInterestingColumn = calculateFirstInterestingColumnOfTable (self->surprisingValueTable, newOffset);
+    refreshBlockFirstInterestingColumns (self);
+  }
+  self->ficScanCursor = -1;
+  refreshUpdateMode (self);
+}
 
-  // refresh the KXP register on every 8th window shift.
-  if ((newOffset & 0x7) == 0) { refreshKXP (self, bitMatrix); }
 
-  u32TableClear (self->surprisingValueTable); // the new number of surprises will be about the same
+  //  fprintf (stderr, "Changed the offset from %d to %d because C = %lld;", 
+  //	  (int) self->windowOffset, (int) newOffset, self->numCoupons); 
+  //  fprintf (stderr, "\t[%d]\n", (int) self->firstInterestingColumn);
+  // fflush (stderr);
 
+/*******************************************************/
+// In amortized mode, modifyOffset() only changes windowOffset, and the
+// rows are moved afterwards, shiftBudget rows per update. Each row is
+// always consistent with its own offset, which is windowOffset for the
+// rows below shiftCursor and (windowOffset - 1) for the others.
+
+// Early-zone surprises are only added by the shift itself, at column
+// (windowOffset - 1), so the old firstInterestingColumn remains a valid
+// lower bound throughout. Once all of the rows have been moved, the table
+// is scanned a piece at a time to find the new value. The scan has to see
+// every item, so it starts over whenever an item might have jumped from in
+// front of the cursor to behind it. The only ways that happens are a deletion,
+// whose backward shift moves items back along their cluster, and, with
+// U32_TABLE_ORDERED, an insertion that pushes the item in the last slot around
+// to slot 0. Other insertions never move the other items backwards.
+
+// While the table is being resized, the scan visits the old slots before the new
+// ones, as if they came first. The items only ever move from the old slots to the
+// new ones, so an item that lands behind the cursor has already been seen, and the
+// resize can carry on at its own pace. The scan only starts over when the slots are
+// swapped out from under it, which changes their total number.
+
+static Long ficScanNumSlotsOfTable (u32Table * table) {
+  Long numOldSlots;
+  u32TableSlotsOfPart (table, 1, &numOldSlots);
+  return ((1LL << table->lgSize) + numOldSlots);
+}
+
+static void restartFicScan (FM85 * self) {
+  self->ficScanCursor = 0;
+  self->ficScanNumSlots = ficScanNumSlotsOfTable (self->surprisingValueTable);
+  self->ficScanResult = self->windowOffset;
+}
+
+// Called after each update during the scan. deletedItem is the item that the update
+// deleted from the table, if any, and lastItem was in the last slot beforehand.
+
+static void checkFicScanAfterUpdate (FM85 * self, U32 deletedItem, U32 lastItem) {
   u32Table * table = self->surprisingValueTable;
-  U8 * window = self->slidingWindow;
-  U64 maskForClearingWindow = (0xffULL << newOffset) ^ ALL64BITS;
-  U64 maskForFlippingEarlyZone = (1ULL << newOffset) - 1;
-  U64 allSurprisesORed = 0;
-  Long i = 0;
+  if (self->ficScanNumSlots != ficScanNumSlotsOfTable (table)) { restartFicScan (self); return; }
+  Long numOldSlots;
+  u32TableSlotsOfPart (table, 1, &numOldSlots);
+  int part = (self->ficScanCursor < numOldSlots) ? 1 : 0;
+  Long cursor = (part == 1) ? self->ficScanCursor : self->ficScanCursor - numOldSlots;
+  if (cursor == 0) { return; } // nothing in this part has been seen yet, and the parts before it are done
+  Long numSlots;
+  U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+  Short lgSize = (part == 1) ? table->oldLgSize : table->lgSize;
+  if (deletedItem != ALL32BITS) {
+    // The backward shift only moved items within the run of full slots that now
+    // follows the item's home, so none crossed the cursor unless that run reaches it.
+    // If the item wasn't in this part, nothing moved here, and this is merely cautious.
+    Long mask = numSlots - 1;
+    Long probe = ((Long) deletedItem) >> (table->validBits - lgSize);
+    do {
+      probe = (probe + 1) & mask;
+      if (probe == cursor) { restartFicScan (self); return; }
+    } while (slots[probe] != ALL32BITS);
+  }
+#ifdef U32_TABLE_ORDERED
+  // Insertions only go into the new slots (part 0). Any item that was pushed around
+  // to slot 0 moved the last slot's item, and the migration can push several.
+  if (part == 0 && lastItem != ALL32BITS && slots[numSlots - 1] != lastItem) { restartFicScan (self); }
+#endif
+}
 
-  for (i = 0; i < k; i++) {
-    U64 pattern = bitMatrix[i];
-    window[i] = (U8) ((pattern >> newOffset) & 0xff);
-    pattern &= maskForClearingWindow;
-    // The following line converts surprising 0's to 1's in the "early zone", 
-    // (and vice versa, which is essential for this procedure's O(k) time cost).
-    pattern ^= maskForFlippingEarlyZone; 
-    allSurprisesORed |= pattern; // a cheap way to recalculate firstInterestingColumn
-    while (pattern != 0) {
-      Short col = countTrailingZerosInUnsignedLong (pattern);
-      pattern = pattern ^ (1ULL << col); // erase the 1.
-      U32 rowCol = (i << 6) | col;
-      Boolean isNovel = u32TableMaybeInsert (table, rowCol);
-      assert (isNovel == 1);
+static void continueShift (FM85 * self) {
+  Long k = (1LL << self->lgK);
+  Long budget = self->shiftBudget;
+  u32Table * table = self->surprisingValueTable;
+  assert (budget > 0);
+
+  if (self->shiftCursor < k) {
+    Long rowHi = self->shiftCursor + budget;
+    if (rowHi > k) { rowHi = k; }
+    shiftWindowOfRows (self->slidingWindow, table, self->shiftCursor, rowHi, self->windowOffset - 1);
+    self->shiftCursor = rowHi;
+    if (rowHi == k) {
+      self->shiftCursor = FM85_NO_SHIFT_IN_PROGRESS;
+      restartFicScan (self);
     }
+    return;
   }
 
-  free (bitMatrix);
-  self->windowOffset = newOffset;
+  assert (self->ficScanCursor >= 0);
+  if (self->ficScanNumSlots != ficScanNumSlotsOfTable (table)) { restartFicScan (self); } // the slots were swapped out
+  Long numOldSlots, numNewSlots;
+  U32 * oldSlots = u32TableSlotsOfPart (table, 1, &numOldSlots);
+  U32 * newSlots = u32TableSlotsOfPart (table, 0, &numNewSlots);
+  Long numSlots = numOldSlots + numNewSlots;
+  Long slotHi = self->ficScanCursor + budget;
+  if (slotHi > numSlots) { slotHi = numSlots; }
+  Long i;
+  Short result = self->ficScanResult;
+  for (i = self->ficScanCursor; i < slotHi; i++) {
+    U32 rowCol = (i < numOldSlots) ? oldSlots[i] : newSlots[i - numOldSlots];
+    if (rowCol != ALL32BITS && (Short) (rowCol & 63) < result) { result = (Short) (rowCol & 63); }
+  }
+  self->ficScanResult = result;
+  self->ficScanCursor = slotHi;
+  if (slotHi == numSlots) {
+    assert (result >= self->firstInterestingColumn);
+    self->firstInterestingColumn = result;
+    self->ficScanCursor = -1;
+    refreshUpdateMode (self);
+  }
+}
 
-  self->firstInterestingColumn = countTrailingZerosInUnsignedLong (allSurprisesORed);
-  if (self->firstInterestingColumn > newOffset) self->firstInterestingColumn = newOffset; // corner case
+/*******************************************************/
 
+void fm85FinishShift (FM85 * self) {
+  Long k = (1LL << self->lgK);
+  if (self->shiftCursor < k) {
+    ownWindow (self);
+    ownTable (self);
+    shiftWindowOfRows (self->slidingWindow, self->surprisingValueTable, self->shiftCursor, k, self->windowOffset - 1);
+    self->shiftCursor = FM85_NO_SHIFT_IN_PROGRESS;
+    self->ficScanCursor = 0;
+    refreshBlockFirstInterestingColumns (self);
+  }
+  if (self->ficScanCursor >= 0) {
+    self->firstInterestingColumn = calculateFirstInterestingColumnOfTable (self->surprisingValueTable, self->windowOffset);
+    self->ficScanCursor = -1;
+  }
+  refreshUpdateMode (self);
 }
 
+/*******************************************************/
 
-  //  fprintf (stderr, "Changed the offset from %d to %d because C = %lld;", 
-  //	  (int) self->windowOffset, (int) newOffset, self->numCoupons); 
-  //  fprintf (stderr, "\t[%d]\n", (int) self->firstInterestingColumn);
-  // fflush (stderr);
+void fm85CatchUpOffset (FM85 * self) {
+  fm85FinishShift (self);
+  if (self->slidingWindow == NULL) { return; } // the flavor is EMPTY or SPARSE
+  Short correctOffset = determineCorrectOffset (self->lgK, self->numCoupons);
+  assert (correctOffset >= self->windowOffset);
+  if (correctOffset > self->windowOffset) { modifyOffset (self, correctOffset); }
+}
 
+/*******************************************************/
+
+void fm85DeferOffsets (FM85 * self, Boolean defer) {
+  if (self->isCompressed) { FATAL_ERROR ("Cannot update a compressed sketch."); }
+  if (!defer) { fm85CatchUpOffset (self); }
+  self->deferOffsets = defer;
+  refreshUpdateMode (self);
+}
+
+/*******************************************************/
+
+void fm85SetShiftThreads (FM85 * self, Long numThreads) {
+  assert (numThreads >= 1);
+  Short lgNumThreads = 0;
+  while ((2LL << lgNumThreads) <= numThreads && self->lgK - (lgNumThreads + 1) >= FM85_LG_ROWS_PER_BLOCK) { lgNumThreads++; }
+  self->lgShiftThreads = lgNumThreads;
+}
+
+/*******************************************************/
+
+void fm85SetShiftBudget (FM85 * self, Long rowsPerUpdate) {
+  assert (rowsPerUpdate >= 0);
+  if (self->isCompressed) { FATAL_ERROR ("Cannot update a compressed sketch."); }
+  fm85FinishShift (self);
+  self->shiftBudget = rowsPerUpdate;
+}
+
+
+/*******************************************************/
+// The KXP register is the sum of 2^-(col+1) over all of the 0's in the
+// bit matrix. It is kept exactly, as a 128-bit fixed-point number whose
+// low word counts units of 2^-64, so it never needs to be recalculated
+// from the matrix, and the HIP estimate is the same on every platform.
+
+double getKXP (FM85 * self) {
+  return (((double) self->kxpHi) + ((double) self->kxpLo) * invPow2Tab[64]);
+}
 
 /*******************************************************/
 // Call this whenever a new coupon has been collected.
@@ -357,10 +1225,14 @@ void modifyOffset (FM85 * self, Short newOffset) {
 void updateHIP (FM85 * self, Short rowCol) {
   Long k = (1LL << self->lgK);
   Short col = (Short) (rowCol & 63);  
-  double oneOverP = ((double) k) / self->kxp;
-  self->hipEstAccum += oneOverP;
-  self->hipErrAccum += ((oneOverP * oneOverP) - oneOverP);
-  self->kxp -= invPow2Tab[col+1]; // notice the "+1"
+  double oneOverP = ((double) k) / getKXP (self);
+  double newEstAccum = self->hipEstAccum + oneOverP;
+  double newErrAccum = self->hipErrAccum + ((oneOverP * oneOverP) - oneOverP);
+  __atomic_store (&self->hipEstAccum, &newEstAccum, __ATOMIC_RELAXED); // these may be read by fm85GetEstimates()
+  __atomic_store (&self->hipErrAccum, &newErrAccum, __ATOMIC_RELAXED);
+  U64 delta = 1ULL << (63 - col); // 2^-(col+1) in units of 2^-64
+  if (self->kxpLo < delta) { self->kxpHi -= 1; } // borrow
+  self->kxpLo -= delta;
 }
 
 /*******************************************************/
@@ -370,19 +1242,83 @@ double getHIPEstimate (FM85 * self) {
   return (self->hipEstAccum);
 }
 
+/*******************************************************/
+// A sequence lock. The updating thread makes estimateSeq odd before it changes
+// numCoupons and the HIP accumulators, and even again afterwards, so a reader
+// that saw the same even value before and after reading them has a consistent copy.
+// The fences keep the reader's loads, and the writer's stores, inside the two
+// accesses to estimateSeq. On x86 all of this compiles to plain moves.
+
+void fm85GetEstimates (FM85 * self, FM85E * estimates) {
+  Long before, after;
+  do {
+    before = __atomic_load_n (&self->estimateSeq, __ATOMIC_ACQUIRE);
+    estimates->numCoupons = __atomic_load_n (&self->numCoupons, __ATOMIC_RELAXED);
+    __atomic_load (&self->hipEstAccum, &estimates->hipEstAccum, __ATOMIC_RELAXED);
+    __atomic_load (&self->hipErrAccum, &estimates->hipErrAccum, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    after = __atomic_load_n (&self->estimateSeq, __ATOMIC_RELAXED);
+  } while ((before & 1) != 0 || before != after);
+  estimates->lgK = self->lgK;
+  estimates->mergeFlag = __atomic_load_n (&self->mergeFlag, __ATOMIC_RELAXED);
+}
+
+double getHIPEstimateOfEstimates (FM85E * estimates) {
+  if (estimates->mergeFlag != 0) { FATAL_ERROR ("tried to get HIP estimate of merged sketch"); }
+  return (estimates->hipEstAccum);
+}
+
+/*******************************************************/
+// Call this whenever a new coupon has been collected. Crossing a threshold is
+// rare, so the common case costs one comparison.
+
+static inline void collectCoupon (FM85 * self, U32 rowCol) {
+  Long seq = self->estimateSeq;
+  __atomic_store_n (&self->estimateSeq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store_n (&self->numCoupons, self->numCoupons + 1, __ATOMIC_RELAXED);
+  updateHIP (self, rowCol);
+  __atomic_store_n (&self->estimateSeq, seq + 2, __ATOMIC_RELEASE);
+  if (self->numCoupons >= self->nextThreshold) {
+    if (self->slidingWindow == NULL) { // C >= 3K/32
+      promoteSparseToWindowed (self);
+    }
+    else { // C >= (K * 27/8) + (K * windowOffset)
+      modifyOffset (self, self->windowOffset + 1);
+      assert (self->windowOffset >= 1 && self->windowOffset <= 56);
+    }
+    assert (self->numCoupons < self->nextThreshold);
+  }
+}
+
 /*******************************************************/
 
 void updateSparse (FM85 * self, U32 rowCol) {
-  Long k = (1LL << self->lgK);
-  Long c32pre = self->numCoupons << 5;
-  assert (c32pre < 3*k); // C < 3K/32, in other words flavor == SPARSE
-  assert (self->surprisingValueTable != NULL);
+  assert (self->updateMode == UPDATE_SPARSE);
+  assert (self->numCoupons < self->nextThreshold); // C < 3K/32, in other words flavor == SPARSE
   Boolean isNovel = u32TableMaybeInsert (self->surprisingValueTable, rowCol);
-  if (isNovel) {
-    self->numCoupons += 1;
-    updateHIP (self, rowCol);
-    Long c32post = self->numCoupons << 5;
-    if (c32post >= 3*k) { promoteSparseToWindowed (self); } // C >= 3K/32
+  if (isNovel) { collectCoupon (self, rowCol); }
+}
+
+/*******************************************************/
+// This applies the update to a row that is at the given offset,
+// and returns 1 if a new coupon was collected.
+
+static inline Boolean updateRowAtOffset (FM85 * self, U32 rowCol, Short offset) {
+  Short col = (Short) (rowCol & 63);
+  if (col < offset) { // track the surprising 0's "before" the window
+    return (u32TableMaybeDelete (self->surprisingValueTable, rowCol)); // inverted logic
+  }
+  else if (col < offset + 8) { // track the 8 bits inside the window
+    Long row = (Long) (rowCol >> 6);
+    U8 oldBits = self->slidingWindow[row];
+    U8 newBits = oldBits | (1 << (col - offset));
+    if (newBits == oldBits) { return (0); }
+    self->slidingWindow[row] = newBits;
+    return (1);
+  }
+  else { // track the surprising 1's "after" the window
+    return (u32TableMaybeInsert (self->surprisingValueTable, rowCol)); // normal logic
   }
 }
 
@@ -390,46 +1326,76 @@ void updateSparse (FM85 * self, U32 rowCol) {
 
 // the flavor is HYBRID, PINNED, or SLIDING.
 void updateWindowed (FM85 * self, U32 rowCol) {
+  assert (self->updateMode == UPDATE_WINDOWED);
   assert (self->windowOffset >= 0 && self->windowOffset <= 56);
-  Long k = (1LL << self->lgK);
-  Long c32pre = self->numCoupons << 5;
-  assert (c32pre >= 3*k); // C < 3K/32, in other words flavor >= HYBRID
-  Long c8pre = self->numCoupons << 3;
-  Long w8pre = ((Long) self->windowOffset) << 3;
-  assert (c8pre < (27 + w8pre) * k); // C < (K * 27/8) + (K * windowOffset)
+  assert (self->numCoupons < self->nextThreshold); // C < (K * 27/8) + (K * windowOffset), unless deferring
+  if (updateRowAtOffset (self, rowCol, self->windowOffset)) { collectCoupon (self, rowCol); }
+}
+
+/*******************************************************/
+// The same thing while an amortized window shift is in progress.
+
+static void updateWindowedDuringShift (FM85 * self, U32 rowCol) {
+  assert (self->updateMode == UPDATE_SHIFTING);
+  continueShift (self);
 
-  Boolean isNovel = 0;
   Short col = (Short) (rowCol & 63);
+  Long row = (Long) (rowCol >> 6);
+  Short offset = self->windowOffset;
+  if (row >= self->shiftCursor) { offset -= 1; } // this row has not been moved yet
+  u32Table * table = self->surprisingValueTable;
+  U32 lastItem = table->slots[(1LL << table->lgSize) - 1];
 
-  if (col < self->windowOffset) { // track the surprising 0's "before" the window
-    isNovel = u32TableMaybeDelete (self->surprisingValueTable, rowCol); // inverted logic
+  Boolean isNovel = updateRowAtOffset (self, rowCol, offset);
+  // Even an update that changes nothing can move the items along, since the table
+  // does a piece of any resize in progress whenever it is asked to insert or delete.
+  if (self->ficScanCursor >= 0) {
+    checkFicScanAfterUpdate (self, (isNovel && col < offset) ? rowCol : ALL32BITS, lastItem);
   }
-  else if (col < self->windowOffset + 8) { // track the 8 bits inside the window
-    assert (col >= self->windowOffset);
-    Long row = (Long) (rowCol >> 6);
-    U8 oldBits = self->slidingWindow[row];
-    U8 newBits = oldBits | (1 << (col - self->windowOffset));
-    if (newBits != oldBits) {
-      self->slidingWindow[row] = newBits;      
-      isNovel = 1;
-    }
+  if (isNovel) { collectCoupon (self, rowCol); }
+}
+
+/*******************************************************/
+// The same thing when the window or the table is shared with a snapshot. Most updates
+// don't change anything, so this only makes a private copy of the buffer that is about
+// to change, or of the block of the window, which also changes updateMode once nothing
+// is shared any more. Meanwhile, it does a piece of any window copy that is under way.
+
+static void updateShared (FM85 * self, U32 rowCol) {
+  assert (self->updateMode == UPDATE_SHARED);
+  u32Table * table = self->surprisingValueTable;
+  if (self->slidingWindow == NULL) { // the flavor is SPARSE
+    if (u32TableContains (table, rowCol)) { return; }
+    ownTable (self);
+    refreshUpdateMode (self);
+    updateSparse (self, rowCol);
+    return;
   }
-  else { // track the surprising 1's "after" the window
-    assert (col >= self->windowOffset + 8); 
-    isNovel = u32TableMaybeInsert (self->surprisingValueTable, rowCol); // normal logic
+  if (self->shiftCursor != FM85_NO_SHIFT_IN_PROGRESS || self->ficScanCursor >= 0) {
+    ownWindow (self); // continueShift() is about to modify both of them
+    ownTable (self);
+    refreshUpdateMode (self);
+    updateWindowedDuringShift (self, rowCol);
+    return;
   }
 
-  if (isNovel) {
-    self->numCoupons += 1;
-    updateHIP (self, rowCol);
-    Long c8post = self->numCoupons << 3;
-    if (c8post >= (27 + w8pre) * k) { 
-      modifyOffset (self, self->windowOffset + 1);
-      assert (self->windowOffset >= 1 && self->windowOffset <= 56);
-      Long w8post = ((Long) self->windowOffset) << 3;
-      assert (c8post < (27 + w8post) * k); // C < (K * 27/8) + (K * windowOffset)
-    }
+  if (self->windowBlockOwned != NULL) {
+    copyWindowBlocks (self, self->windowCopyCursor + FM85_WINDOW_COPY_BUDGET);
+  }
+  Short col = (Short) (rowCol & 63);
+  Short offset = self->windowOffset;
+  if (col >= offset && col < offset + 8) {
+    Long row = (Long) (rowCol >> 6);
+    if ((windowOfRow (self, row)[row] >> (col - offset)) & 1) { return; }
+    ownWindowBlock (self, row);
+  }
+  else {
+    // a surprising 0 would be deleted, and a surprising 1 would be inserted
+    if (u32TableContains (table, rowCol) == (col >= offset)) { return; }
+    ownTable (self);
   }
+  refreshUpdateMode (self);
+  if (updateRowAtOffset (self, rowCol, offset)) { collectCoupon (self, rowCol); }
 }
 
 /*******************************************************/
@@ -437,12 +1403,16 @@ void updateWindowed (FM85 * self, U32 rowCol) {
 void fm85RowColUpdate (FM85 * self, U32 rowCol) {
   Short col = (Short) (rowCol & 63);
   if (col < self->firstInterestingColumn) { return; } // important speed optimization
-  if (self->isCompressed) { FATAL_ERROR ("Cannot update a compressed sketch."); }
-  Long c = self->numCoupons;
-  if (c == 0) { promoteEmptyToSparse (self); }
-  Long k = (1LL << self->lgK);
-  if ((c << 5) < 3*k) { updateSparse (self, rowCol); }
-  else { updateWindowed (self, rowCol); }
+  U8 * blockFIC = self->blockFirstInterestingColumn;
+  if (blockFIC != NULL && col < blockFIC[rowCol >> (6 + FM85_LG_ROWS_PER_BLOCK)]) { return; } // likewise
+  switch (self->updateMode) {
+  case UPDATE_WINDOWED: updateWindowed (self, rowCol); break;
+  case UPDATE_SPARSE:   updateSparse   (self, rowCol); break;
+  case UPDATE_SHIFTING: updateWindowedDuringShift (self, rowCol); break;
+  case UPDATE_EMPTY:    promoteEmptyToSparse (self); updateSparse (self, rowCol); break;
+  case UPDATE_SHARED:   updateShared   (self, rowCol); break;
+  default: FATAL_ERROR ("Cannot update a compressed sketch.");
+  }
 }
 
 
@@ -451,3 +1421,77 @@ void fm85Update (FM85 * self, U64 hash0, U64 hash1) {
   fm85RowColUpdate (self, rowCol);
 }
 
+void fm85UpdateOneHash (FM85 * self, U64 hash) {
+  U32 rowCol = rowColFromOneHash (hash, self->lgK);
+  fm85RowColUpdate (self, rowCol);
+}
+
+/*******************************************************/
+// These hash the raw item with a seeded 128-bit hash, whose two halves
+// provide the row bits and the column bits respectively.
+
+void fm85UpdateBytes (FM85 * self, const void * data, size_t numBytes) {
+  U64 twoHashes[2]; // allocated on the stack
+  MurmurHash3_x64_128 (data, numBytes, FM85_HASH_SEED, twoHashes);
+  U32 rowCol = rowColFromTwoHashes (twoHashes[0], twoHashes[1], self->lgK);
+  fm85RowColUpdate (self, rowCol);
+}
+
+// The item is hashed as 8 bytes in the machine's native byte order.
+void fm85UpdateU64 (FM85 * self, U64 datum) {
+  fm85UpdateBytes (self, (const void *) &datum, sizeof(U64));
+}
+
+/*******************************************************/
+// Issues a prefetch for the memory that fm85RowColUpdate is about to touch.
+// This is only a hint, so it doesn't matter if the sketch changes
+// (because of a promotion, window shift, or table resize) before the update happens.
+
+static inline void prefetchForRowCol (FM85 * self, U32 rowCol) {
+  Short col = (Short) (rowCol & 63);
+  U8 * window = self->slidingWindow;
+  if (window != NULL && col >= self->windowOffset && col < self->windowOffset + 8) {
+    PREFETCH_MACRO (&window[rowCol >> 6]);
+    return;
+  }
+  u32Table * table = self->surprisingValueTable;
+  if (table != NULL) {
+    PREFETCH_MACRO (&table->slots[rowCol >> (table->validBits - table->lgSize)]);
+  }
+}
+
+/*******************************************************/
+// This is equivalent to calling fm85Update() on each pair of hashes in order,
+// and produces exactly the same sketch (including the HIP registers).
+// It works on blocks of items so that the cache misses on the window
+// and the table can overlap instead of being paid one at a time.
+
+#define FM85_BATCH_BLOCK_SIZE 64
+
+void fm85UpdateBatch (FM85 * self, U64 * hash0, U64 * hash1, Long n) {
+  U32 rowCols [FM85_BATCH_BLOCK_SIZE]; // allocated on the stack
+  Long start, i;
+  for (start = 0; start < n; start += FM85_BATCH_BLOCK_SIZE) {
+    Long blockLen = n - start;
+    if (blockLen > FM85_BATCH_BLOCK_SIZE) blockLen = FM85_BATCH_BLOCK_SIZE;
+
+    // firstInterestingColumn and its per-block versions never decrease, so the following
+    // early rejection is safe even if the window moves in the middle of the block.
+    Short firstInterestingColumn = self->firstInterestingColumn;
+    U8 * blockFIC = self->blockFirstInterestingColumn;
+    Long numSurvivors = 0;
+    for (i = 0; i < blockLen; i++) {
+      U32 rowCol = rowColFromTwoHashes (hash0[start+i], hash1[start+i], self->lgK);
+      Short col = (Short) (rowCol & 63);
+      if (col >= firstInterestingColumn &&
+	  (blockFIC == NULL || col >= blockFIC[rowCol >> (6 + FM85_LG_ROWS_PER_BLOCK)])) {
+	rowCols[numSurvivors++] = rowCol;
+      }
+    }
+
+    for (i = 0; i < numSurvivors; i++) { prefetchForRowCol (self, rowCols[i]); }
+
+    for (i = 0; i < numSurvivors; i++) { fm85RowColUpdate (self, rowCols[i]); }
+  }
+}
+
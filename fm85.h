@@ -18,6 +18,40 @@ enum flavorType {
   SLIDING  // 27K/8 <= C
 };
 
+// Which routine fm85RowColUpdate() dispatches to. This only changes when
+// the sketch is promoted, compressed, snapshotted, or starts or finishes a window shift.
+
+enum updateModeType {
+  UPDATE_EMPTY,      // promote to SPARSE first
+  UPDATE_SPARSE,
+  UPDATE_WINDOWED,   // HYBRID, PINNED, or SLIDING
+  UPDATE_SHIFTING,   // windowed, with an amortized shift or FIC scan in progress
+  UPDATE_SHARED,     // the window or table is shared with a snapshot, so check before writing
+  UPDATE_COMPRESSED  // not updateable
+};
+
+/*******************************************************/
+
+// The seed used by fm85UpdateU64() and fm85UpdateBytes(). Sketches
+// can only be merged if their items were hashed with the same seed.
+#ifndef FM85_HASH_SEED
+#define FM85_HASH_SEED 9001ULL
+#endif
+
+// The rows are grouped into blocks of this size for blockFirstInterestingColumn,
+// and for copying a window that is shared with a snapshot (see updateShared).
+#define FM85_LG_ROWS_PER_BLOCK 6
+
+// While a window that was shared is being copied, each update copies this many more blocks.
+#define FM85_WINDOW_COPY_BUDGET 2
+
+// The value of shiftCursor when no window shift is in progress.
+// It is at least k for every legal value of lgK.
+#define FM85_NO_SHIFT_IN_PROGRESS (1LL << 26)
+
+// The value of nextThreshold while offset changes are being deferred.
+#define FM85_NO_THRESHOLD (1LL << 62)
+
 /*******************************************************/
 
 typedef struct fm85_sketch_type
@@ -33,6 +67,13 @@ typedef struct fm85_sketch_type
   U8 * slidingWindow;
   Short windowOffset; // Derivable from numCoupons, but made explicit for speed.
   u32Table * surprisingValueTable;
+  Short sparseTableLgSize;   // The initial sizes of the table for the SPARSE flavor
+  Short windowedTableLgSize; // and for the windowed flavors (see fm85MakeWithHint).
+  Long * windowRefCount; // These are non-NULL while the window or the table
+  Long * tableRefCount;  // is shared with a snapshot (see fm85Snapshot).
+  U8 * sharedWindow;      // While the window is being copied from a shared one, block by block,
+  U64 * windowBlockOwned; // the blocks not yet marked here are only in that one (see windowOfRow),
+  Long windowCopyCursor;  // and windowRefCount belongs to it. The blocks below this have been copied.
 
   // The following variables occur in the non-updateable fully-compressed type.
   U32 * compressedWindow; // A bitstream.
@@ -40,17 +81,45 @@ typedef struct fm85_sketch_type
   Long  numCompressedSurprisingValues;
   U32 * compressedSurprisingValues; // A bitstream.
   Long  csvLength; // The number of 32-bit words in this bitstream. (Not needed in Java).
+  Short lgCompressedSegments; // Zero unless the bitstreams are segmented (see fm85CompressSegmented).
 
   // Note that (as an optimization) the two bitstreams could be concatenated.
 
+  enum updateModeType updateMode; // These are derived from the other variables (see refreshUpdateMode),
+  Long nextThreshold;             // which is called whenever one of their inputs changes.
+
   Short firstInterestingColumn; // This is part of a speed optimization.
+  U8 * blockFirstInterestingColumn; // The same thing for each block of 64 rows (NULL until the first window shift).
+
+  Boolean deferOffsets; // If set, the window is left in place until fm85CatchUpOffset().
+
+  // The following variables support amortized window shifting (see fm85SetShiftBudget).
+  Long  shiftBudget;    // The most rows to move per update, or 0 to move all of them at once.
+  Short lgShiftThreads; // Whole-window shifts are split across 2^lgShiftThreads threads (see fm85SetShiftThreads).
+  Long  shiftCursor;    // Rows below this are at windowOffset, the rest are still at windowOffset - 1.
+  Long  ficScanCursor;  // Progress of the incremental recalculation of firstInterestingColumn, or -1.
+  Long  ficScanNumSlots; // The table's number of slots, counting the old ones of a resize, when that scan started.
+  Short ficScanResult;  // The smallest column seen so far by that scan.
 
-  double kxp;
+  U64 kxpHi; // The KXP register is an exact fixed-point number (see getKXP).
+  U64 kxpLo;
   double hipEstAccum;
   double hipErrAccum;
 
+  Long estimateSeq; // Odd while numCoupons and the HIP accumulators are changing (see fm85GetEstimates).
+
 } FM85;
 
+// A consistent copy of the inputs to the estimators.
+typedef struct fm85_estimates_type
+{
+  Short lgK;
+  Boolean mergeFlag;
+  Long numCoupons;
+  double hipEstAccum;
+  double hipErrAccum;
+} FM85E;
+
 /*******************************************************/
 // These routines are exported.
 
@@ -58,20 +127,76 @@ void fm85Init (void); // Call this before anything else.
 
 FM85 * fm85Make (Short lgK);
 
+// Same as fm85Make(), but the tables start out big enough for about expectedN distinct
+// items, so they don't have to grow through a series of rebuilds. Apart from memory
+// use, the resulting sketches are indistinguishable from those made by fm85Make().
+FM85 * fm85MakeWithHint (Short lgK, Long expectedN);
+
 FM85 * fm85Copy (FM85 * self);
 
+// Same as fm85Copy(), but the window and the table are shared with the original until
+// one of the two sketches modifies them, at which point it makes its own copy: of the
+// table all at once, and of the window one block of rows at a time, over its next
+// k/2^(FM85_LG_ROWS_PER_BLOCK) / FM85_WINDOW_COPY_BUDGET updates. So taking a snapshot
+// costs O(k/64), and if the snapshot is freed before the original collects a coupon,
+// nothing is ever copied. Snapshots are ordinary sketches that can be queried,
+// compressed, merged, updated, and freed by any thread, but creating a snapshot counts
+// as modifying its source, so it must happen on the thread that updates the source.
+FM85 * fm85Snapshot (FM85 * self);
+
 void fm85Free (FM85 * sketch);
 
 void fm85Update (FM85 * sketch, U64 hash0, U64 hash1);
 
+// Same result as calling fm85Update() n times, but faster for large sketches.
+void fm85UpdateBatch (FM85 * sketch, U64 * hash0, U64 * hash1, Long n);
+
+// Uses the low lgK bits of one hash for the row, and the other bits for the column.
+void fm85UpdateOneHash (FM85 * sketch, U64 hash);
+
+// These hash raw items internally, using MurmurHash3_x64_128 with FM85_HASH_SEED.
+void fm85UpdateU64   (FM85 * sketch, U64 datum);
+void fm85UpdateBytes (FM85 * sketch, const void * data, size_t numBytes);
+
+// Spreads each window shift over the following updates, so that no single update
+// moves more than rowsPerUpdate rows. Zero (the default) moves all k rows at once.
+void fm85SetShiftBudget (FM85 * sketch, Long rowsPerUpdate);
+
+// Splits each whole-window shift (but not an amortized one) across about numThreads
+// threads, each of which handles a range of rows. This only pays off for large sketches,
+// say lgK >= 20, since the threads are started for each shift. The number of threads is
+// rounded down to a power of 2, and each thread gets at least 64 rows.
+void fm85SetShiftThreads (FM85 * sketch, Long numThreads);
+
+// Completes any window shift that is still in progress.
+void fm85FinishShift (FM85 * sketch);
+
+// While deferring, the window stays put when C crosses an offset threshold, and
+// fm85CatchUpOffset() later moves it straight to the correct offset in one pass.
+// Meanwhile the surprises beyond the window accumulate in the table, so this
+// suits bulk loads that add at most a few K coupons between catch-ups.
+// Turning deferral off catches up.
+void fm85DeferOffsets (FM85 * sketch, Boolean defer);
+void fm85CatchUpOffset (FM85 * sketch);
+
 double getHIPEstimate (FM85 * sketch);
 
+// Can be called by other threads while one thread is updating the sketch (but not while
+// it is being merged into, compressed, or freed). The reader never blocks the writer;
+// it simply tries again if a coupon was collected while it was reading.
+// The ICON estimate is getIconEstimate (estimates->lgK, estimates->numCoupons).
+void fm85GetEstimates (FM85 * sketch, FM85E * estimates);
+double getHIPEstimateOfEstimates (FM85E * estimates);
+
+double getKXP (FM85 * sketch); // the register's value, rounded to a double
+
 // getIconEstimate() is defined in a separate file.
 
 /*******************************************************/
 
 // The following is used during testing, and is basically package private.
 U32 rowColFromTwoHashes (U64 hash0, U64 hash1, Short lgK);
+U32 rowColFromOneHash (U64 hash, Short lgK);
 
 /*******************************************************/
 // These routines are internal.
@@ -85,10 +210,23 @@ Short determineCorrectOffset (Short lgK, Long c);
 
 U64 * bitMatrixOfSketch (FM85 * self);
 
+// The buffer that holds the window byte of a row. This is slidingWindow, except while
+// the window is still being copied from one that is shared with a snapshot.
+U8 * windowOfRow (FM85 * self, Long row);
+
+// Recomputes updateMode, and nextThreshold, which is the value of numCoupons
+// at which the flavor or the offset has to change. Call this after changing
+// the flavor, offset, shift state, or compression state of a sketch by hand.
+void refreshUpdateMode (FM85 * self);
+
+// these are also used by the concurrent sketch and the partitioned engine
+void promoteEmptyToSparse (FM85 * self);
+void promoteSparseToWindowed (FM85 * self);
+void modifyOffset (FM85 * self, Short newOffset); // newOffset may be several columns ahead
+void moveWindowTo (FM85 * self, Short newOffset); // the same, but newOffset needn't match C
+Short calculateFirstInterestingColumnOfTable (u32Table * table, Short offset);
+
 // these are only used internally
-// void promoteEmptyToSparse (FM85 * self);
-// void promoteSparseToWindowed (FM85 * self);
-// void modifyOffset (FM85 * self, Short newOffset);
 // void updateSparse   (FM85 * self, U32 rowCol);
 // void updateWindowed (FM85 * self, U32 rowCol);
 
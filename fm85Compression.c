@@ -1,5 +1,7 @@
 // Copyright 2018, Kevin Lang, Oath Research
 
+#include <pthread.h>
+
 #include "fm85Compression.h"
 #include "fm85Util.h"
 
@@ -169,7 +171,7 @@ static inline Long readUnary (U32 * compressedWords,
   //  }
 
   int peek8 = bitbuf & 0xffULL; // These 8 bits include either all or part of the Unary codeword.
-  int trailingZeros = byteTrailingZerosTable[peek8];
+  int trailingZeros = fastCountTrailingZeros8 (peek8);
 
   assert (trailingZeros >= 0 && trailingZeros <= 8);
 
@@ -457,14 +459,273 @@ Short determinePseudoPhase (Short lgK, Long c) {
   }
 }
 
+/***************************************************************/
+/***************************************************************/
+// Scratch buffers. When a thread of fm85CompressMany or fm85UncompressMany is running,
+// the untrimmed output of the compressors and the pairs produced by the decompressor
+// are kept in that thread's own buffers, which only grow. Otherwise they are
+// allocated and freed every time, as before. At most one of each is in use at once.
+
+typedef struct fm85_compression_scratch_type
+{
+  U32 * outputBuf;  // For the compressors, before their output is trimmed.
+  Long outputBufLen;
+  U32 * pairBuf;    // For the pairs returned by uncompressTheSurprisingValues.
+  Long pairBufLen;
+} FM85CS;
+
+static __thread FM85CS * threadScratch = NULL;
+
+static U32 * getScratchWords (U32 ** bufPtr, Long * bufLenPtr, Long numWords) {
+  if (*bufLenPtr < numWords) {
+    free (*bufPtr);
+    *bufLenPtr = numWords + numWords / 4;
+    *bufPtr = (U32 *) malloc ((size_t) (*bufLenPtr * sizeof(U32)));
+    if (*bufPtr == NULL) { FATAL_ERROR ("Out of Memory"); }
+  }
+  return (*bufPtr);
+}
+
+static U32 * getOutputBuf (Long numWords) {
+  if (threadScratch != NULL) { return (getScratchWords (&threadScratch->outputBuf, &threadScratch->outputBufLen, numWords)); }
+  U32 * buf = (U32 *) malloc ((size_t) (numWords * sizeof(U32)));
+  assert (buf != NULL);
+  return (buf);
+}
+
+static void releaseOutputBuf (U32 * buf) {
+  if (threadScratch == NULL) { free (buf); }
+}
+
+static U32 * getPairBuf (Long numWords) {
+  if (threadScratch != NULL) { return (getScratchWords (&threadScratch->pairBuf, &threadScratch->pairBufLen, numWords)); }
+  U32 * buf = (U32 *) malloc ((size_t) (numWords * sizeof(U32)));
+  assert (buf != NULL);
+  return (buf);
+}
+
+static void releasePairBuf (U32 * buf) {
+  if (threadScratch == NULL) { free (buf); }
+}
+
+/***************************************************************/
+/***************************************************************/
+// The segmented format (see fm85CompressSegmented). The rows are split into 2^lgSegments
+// equal ranges, and each range is encoded as an independent substream, so the segments can
+// be encoded and decoded by different threads. The pairs of a segment are encoded relative
+// to its first row. Each bitstream begins with a table that says where each substream ends,
+// counting from the end of the table. For the surprising values, the table is followed by
+// the number of pairs in each segment.
+
+static __thread Long threadsPerSketch = 1; // Set by fm85CompressSegmented and fm85UncompressWithThreads.
+
+typedef struct fm85_segment_job_type
+{
+  void (* doSegment) (struct fm85_segment_job_type * job, Long segment);
+  Long numSegments;
+  Short lgRowsPerSegment;
+  Long nextSegment;     // Shared by the threads.
+  U8 * window;          // The window, for the window jobs.
+  U16 * codingTable;    // The encoding or decoding table, for the window jobs.
+  U32 * pairs;          // All of the pairs, for the pair jobs.
+  Long * pairStarts;    // The index of each segment's first pair, and then numPairs.
+  U32 ** segmentWords;  // The compressors leave each substream here,
+  Long * segmentLengths;
+  U32 * streamWords;    // and the decompressors read them from here.
+  Long * streamStarts;  // The index of each substream's first word, and then its length.
+} FM85SJ;
+
+static void * segmentWorkerMain (void * arg) {
+  FM85SJ * job = (FM85SJ *) arg;
+  Long segment;
+  while ((segment = __atomic_fetch_add (&job->nextSegment, 1, __ATOMIC_RELAXED)) < job->numSegments) {
+    job->doSegment (job, segment);
+  }
+  return (NULL);
+}
+
+static void runSegmentJob (FM85SJ * job) {
+  Long numThreads = (threadsPerSketch < job->numSegments) ? threadsPerSketch : job->numSegments;
+  job->nextSegment = 0;
+  if (numThreads <= 1) { segmentWorkerMain ((void *) job); return; }
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numThreads) * sizeof(pthread_t));
+  assert (threads != NULL);
+  Long t;
+  for (t = 1; t < numThreads; t++) {
+    if (pthread_create (&threads[t], NULL, segmentWorkerMain, (void *) job) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+  segmentWorkerMain ((void *) job);
+  for (t = 1; t < numThreads; t++) { pthread_join (threads[t], NULL); }
+  free (threads);
+}
+
+static void compressWindowSegment (FM85SJ * job, Long segment) {
+  Long rowsPerSegment = (1LL << job->lgRowsPerSegment);
+  U32 * words = (U32 *) malloc ((size_t) (safeLengthForCompressedWindowBuf (rowsPerSegment) * sizeof(U32)));
+  if (words == NULL) { FATAL_ERROR ("Out of Memory"); }
+  job->segmentLengths[segment] = lowLevelCompressBytes (job->window + segment * rowsPerSegment, rowsPerSegment,
+							job->codingTable, words);
+  job->segmentWords[segment] = words;
+}
+
+static void uncompressWindowSegment (FM85SJ * job, Long segment) {
+  Long rowsPerSegment = (1LL << job->lgRowsPerSegment);
+  lowLevelUncompressBytes (job->window + segment * rowsPerSegment, rowsPerSegment, job->codingTable,
+			   job->streamWords + job->streamStarts[segment],
+			   job->streamStarts[segment + 1] - job->streamStarts[segment]);
+}
+
+static void compressPairsSegment (FM85SJ * job, Long segment) {
+  Long rowsPerSegment = (1LL << job->lgRowsPerSegment);
+  U32 * pairs = job->pairs + job->pairStarts[segment];
+  Long numPairs = job->pairStarts[segment + 1] - job->pairStarts[segment];
+  job->segmentWords[segment] = (U32 *) NULL;
+  job->segmentLengths[segment] = 0;
+  if (numPairs == 0) return;
+  U32 firstPair = (U32) ((segment * rowsPerSegment) << 6);
+  Long i;
+  for (i = 0; i < numPairs; i++) { pairs[i] -= firstPair; } // the caller is done with the pairs
+  Long numBaseBits = golombChooseNumberOfBaseBits (rowsPerSegment + numPairs, numPairs);
+  U32 * words = (U32 *) malloc ((size_t) (safeLengthForCompressedPairBuf (rowsPerSegment, numPairs, numBaseBits) * sizeof(U32)));
+  if (words == NULL) { FATAL_ERROR ("Out of Memory"); }
+  job->segmentLengths[segment] = lowLevelCompressPairs (pairs, numPairs, numBaseBits, words);
+  job->segmentWords[segment] = words;
+}
+
+static void uncompressPairsSegment (FM85SJ * job, Long segment) {
+  Long rowsPerSegment = (1LL << job->lgRowsPerSegment);
+  U32 * pairs = job->pairs + job->pairStarts[segment];
+  Long numPairs = job->pairStarts[segment + 1] - job->pairStarts[segment];
+  if (numPairs == 0) return;
+  Long numBaseBits = golombChooseNumberOfBaseBits (rowsPerSegment + numPairs, numPairs);
+  lowLevelUncompressPairs (pairs, numPairs, numBaseBits,
+			   job->streamWords + job->streamStarts[segment],
+			   job->streamStarts[segment + 1] - job->streamStarts[segment]);
+  U32 firstPair = (U32) ((segment * rowsPerSegment) << 6);
+  Long i;
+  for (i = 0; i < numPairs; i++) { pairs[i] += firstPair; }
+}
+
+static FM85SJ * makeSegmentJob (Short lgK, Short lgSegments) {
+  assert (lgSegments > 0 && lgK - lgSegments >= FM85_LG_MIN_ROWS_PER_SEGMENT);
+  FM85SJ * job = (FM85SJ *) malloc (sizeof(FM85SJ));
+  assert (job != NULL);
+  Long numSegments = (1LL << lgSegments);
+  job->numSegments = numSegments;
+  job->lgRowsPerSegment = lgK - lgSegments;
+  job->pairStarts = (Long *) malloc ((size_t) ((numSegments + 1) * sizeof(Long)));
+  job->segmentWords = (U32 **) malloc ((size_t) (numSegments * sizeof(U32 *)));
+  job->segmentLengths = (Long *) malloc ((size_t) (numSegments * sizeof(Long)));
+  job->streamStarts = (Long *) malloc ((size_t) ((numSegments + 1) * sizeof(Long)));
+  assert (job->pairStarts != NULL && job->segmentWords != NULL && job->segmentLengths != NULL && job->streamStarts != NULL);
+  return (job);
+}
+
+static void freeSegmentJob (FM85SJ * job) {
+  free (job->pairStarts);
+  free (job->segmentWords);
+  free (job->segmentLengths);
+  free (job->streamStarts);
+  free (job);
+}
+
+// Concatenates the substreams after a table of numTables * numSegments words,
+// whose first row is filled in here with the substreams' ends.
+static U32 * gatherSegments (FM85SJ * job, Long numTables, Long * lengthPtr) {
+  Long numSegments = job->numSegments;
+  Long total = numTables * numSegments;
+  Long s;
+  for (s = 0; s < numSegments; s++) { total += job->segmentLengths[s]; }
+  U32 * words = (U32 *) malloc ((size_t) (total * sizeof(U32)));
+  if (words == NULL) { FATAL_ERROR ("Out of Memory"); }
+  Long end = 0;
+  for (s = 0; s < numSegments; s++) {
+    if (job->segmentLengths[s] > 0) {
+      memcpy ((void *) (words + numTables * numSegments + end), (void *) job->segmentWords[s], ((size_t) job->segmentLengths[s]) * sizeof(U32));
+      free (job->segmentWords[s]);
+    }
+    end += job->segmentLengths[s];
+    words[s] = (U32) end;
+  }
+  *lengthPtr = total;
+  return (words);
+}
+
+// The inverse of the previous routine, for the decompressors.
+static void scatterSegments (FM85SJ * job, Long numTables, U32 * words) {
+  Long numSegments = job->numSegments;
+  Long s;
+  job->streamWords = words + numTables * numSegments;
+  job->streamStarts[0] = 0;
+  for (s = 0; s < numSegments; s++) { job->streamStarts[s + 1] = (Long) words[s]; }
+}
+
+static void compressTheWindowSegmented (FM85 * target, FM85 * source, U16 * encodingTable) {
+  FM85SJ * job = makeSegmentJob (source->lgK, target->lgCompressedSegments);
+  job->doSegment = compressWindowSegment;
+  job->window = source->slidingWindow;
+  job->codingTable = encodingTable;
+  runSegmentJob (job);
+  target->compressedWindow = gatherSegments (job, 1, &target->cwLength);
+  freeSegmentJob (job);
+}
+
+static void uncompressTheWindowSegmented (U8 * window, FM85 * source, U16 * decodingTable) {
+  FM85SJ * job = makeSegmentJob (source->lgK, source->lgCompressedSegments);
+  job->doSegment = uncompressWindowSegment;
+  job->window = window;
+  job->codingTable = decodingTable;
+  scatterSegments (job, 1, source->compressedWindow);
+  runSegmentJob (job);
+  freeSegmentJob (job);
+}
+
+static void compressTheSurprisingValuesSegmented (FM85 * target, FM85 * source, U32 * pairs, Long numPairs) {
+  FM85SJ * job = makeSegmentJob (source->lgK, target->lgCompressedSegments);
+  Long numSegments = job->numSegments;
+  Long s, i = 0;
+  for (s = 0; s < numSegments; s++) { // the pairs are sorted, so each segment's pairs are contiguous
+    job->pairStarts[s] = i;
+    while (i < numPairs && (Long) (pairs[i] >> (6 + job->lgRowsPerSegment)) == s) { i++; }
+  }
+  assert (i == numPairs);
+  job->pairStarts[numSegments] = numPairs;
+  job->doSegment = compressPairsSegment;
+  job->pairs = pairs;
+  runSegmentJob (job);
+  U32 * words = gatherSegments (job, 2, &target->csvLength);
+  for (s = 0; s < numSegments; s++) { words[numSegments + s] = (U32) (job->pairStarts[s + 1] - job->pairStarts[s]); }
+  target->compressedSurprisingValues = words;
+  freeSegmentJob (job);
+}
+
+static void uncompressTheSurprisingValuesSegmented (U32 * pairs, FM85 * source) {
+  FM85SJ * job = makeSegmentJob (source->lgK, source->lgCompressedSegments);
+  Long numSegments = job->numSegments;
+  U32 * words = source->compressedSurprisingValues;
+  Long s;
+  job->pairStarts[0] = 0;
+  for (s = 0; s < numSegments; s++) { job->pairStarts[s + 1] = job->pairStarts[s] + (Long) words[numSegments + s]; }
+  assert (job->pairStarts[numSegments] == source->numCompressedSurprisingValues);
+  job->doSegment = uncompressPairsSegment;
+  job->pairs = pairs;
+  scatterSegments (job, 2, words);
+  runSegmentJob (job);
+  freeSegmentJob (job);
+}
+
 /***************************************************************/
 /***************************************************************/
 
 void compressTheWindow (FM85 * target, FM85 * source) {
   Long k = (1LL << source->lgK);  
+  if (target->lgCompressedSegments > 0) {
+    Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons);
+    compressTheWindowSegmented (target, source, encodingTablesForHighEntropyByte[pseudoPhase]);
+    return;
+  }
   Long windowBufLen = safeLengthForCompressedWindowBuf (k);
-  U32 * windowBuf = (U32 *) malloc ((size_t) (windowBufLen * sizeof(U32)));
-  assert (windowBuf != NULL);
+  U32 * windowBuf = getOutputBuf (windowBufLen);
   Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons);
   target->cwLength = lowLevelCompressBytes (source->slidingWindow, k,
 					    encodingTablesForHighEntropyByte[pseudoPhase],
@@ -476,7 +737,7 @@ void compressTheWindow (FM85 * target, FM85 * source) {
   U32 * shorterBuf = (U32 *) malloc (((size_t) target->cwLength) * sizeof(U32));
   if (shorterBuf == NULL) { FATAL_ERROR ("Out of Memory"); }
   memcpy ((void *) shorterBuf, (void *) windowBuf, ((size_t) target->cwLength) * sizeof(U32));
-  free (windowBuf);
+  releaseOutputBuf (windowBuf);
   target->compressedWindow = shorterBuf;
 
   return;
@@ -494,6 +755,10 @@ void uncompressTheWindow (FM85 * target, FM85 * source) {
   target->slidingWindow = window;
   Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons);
   assert (source->compressedWindow != NULL);
+  if (source->lgCompressedSegments > 0) {
+    uncompressTheWindowSegmented (window, source, decodingTablesForHighEntropyByte[pseudoPhase]);
+    return;
+  }
   lowLevelUncompressBytes (target->slidingWindow, k,
 			   decodingTablesForHighEntropyByte[pseudoPhase],
 			   source->compressedWindow,
@@ -507,11 +772,14 @@ void uncompressTheWindow (FM85 * target, FM85 * source) {
 void compressTheSurprisingValues (FM85 * target, FM85 * source, U32 * pairs, Long numPairs) {
   assert (numPairs > 0);
   target->numCompressedSurprisingValues = numPairs;  
+  if (target->lgCompressedSegments > 0) {
+    compressTheSurprisingValuesSegmented (target, source, pairs, numPairs);
+    return;
+  }
   Long k = (1LL << source->lgK);
   Long numBaseBits = golombChooseNumberOfBaseBits (k + numPairs, numPairs);
   Long pairBufLen = safeLengthForCompressedPairBuf (k, numPairs, numBaseBits);
-  U32 * pairBuf = (U32 *) malloc ((size_t) (pairBufLen * sizeof(U32)));
-  assert (pairBuf != NULL);
+  U32 * pairBuf = getOutputBuf (pairBufLen);
 
   target->csvLength = lowLevelCompressPairs (pairs, numPairs, numBaseBits, pairBuf);
 
@@ -521,13 +789,13 @@ void compressTheSurprisingValues (FM85 * target, FM85 * source, U32 * pairs, Lon
   U32 * shorterBuf = (U32 *) malloc (((size_t) target->csvLength) * sizeof(U32));
   if (shorterBuf == NULL) { FATAL_ERROR ("Out of Memory"); }
   memcpy ((void *) shorterBuf, (void *) pairBuf, ((size_t) target->csvLength) * sizeof(U32));
-  free (pairBuf);
+  releaseOutputBuf (pairBuf);
   target->compressedSurprisingValues = shorterBuf;
 }
 
 /***************************************************************/
 /***************************************************************/
-// allocates and returns an array of uncompressed pairs.
+// allocates and returns an array of uncompressed pairs, which the caller must release with releasePairBuf().
 // the length of this array is known to the source sketch.
 
 U32 * uncompressTheSurprisingValues (FM85 * source) {
@@ -535,8 +803,11 @@ U32 * uncompressTheSurprisingValues (FM85 * source) {
   Long k = (1LL << source->lgK);  
   Long numPairs = source->numCompressedSurprisingValues;
   assert (numPairs > 0);
-  U32 * pairs = (U32 *) malloc ((size_t) numPairs * sizeof(U32));
-  assert (pairs != NULL);
+  U32 * pairs = getPairBuf (numPairs);
+  if (source->lgCompressedSegments > 0) {
+    uncompressTheSurprisingValuesSegmented (pairs, source);
+    return (pairs);
+  }
   Long numBaseBits = golombChooseNumberOfBaseBits (k + numPairs, numPairs);
   lowLevelUncompressPairs(pairs, numPairs, numBaseBits, 
 			  source->compressedSurprisingValues, source->csvLength);
@@ -562,8 +833,7 @@ void uncompressEmptyFlavor (FM85 * target, FM85 * source) {
 void compressSparseFlavor (FM85 * target, FM85 * source) {
   assert (source->slidingWindow == NULL); // there is no window to compress
   Long numPairs = 0; 
-  U32 * pairs = u32TableUnwrappingGetItems (source->surprisingValueTable, &numPairs);
-  introspectiveInsertionSort(pairs, 0, numPairs-1);
+  U32 * pairs = u32TableGetSortedItems (source->surprisingValueTable, &numPairs);
   compressTheSurprisingValues (target, source, pairs, numPairs);
   free (pairs);
   return;
@@ -578,7 +848,7 @@ void uncompressSparseFlavor (FM85 * target, FM85 * source) {
   Long numPairs = source->numCompressedSurprisingValues;
   u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
   target->surprisingValueTable = table;
-  free (pairs);
+  releasePairBuf (pairs);
   return;
 }
 
@@ -596,7 +866,7 @@ U32 * trickyGetPairsFromWindow (U8 * window, Long k, Long numPairsToGet, Long em
   for (rowIndex = 0; rowIndex < k; rowIndex++) {
     U8 byte = window[rowIndex];
     while (byte != 0) {
-      Short colIndex = byteTrailingZerosTable[byte];
+      Short colIndex = fastCountTrailingZeros8 (byte);
       //      assert (colIndex < 8);
       byte = byte ^ (1 << colIndex); // erase the 1
       pairs[pairIndex++] = (U32) ((rowIndex << 6) | colIndex);
@@ -614,8 +884,7 @@ void compressHybridFlavor (FM85 * target, FM85 * source) {
   //  Long i;
   Long k = (1LL << source->lgK);
   Long numPairsFromTable = 0; 
-  U32 * pairsFromTable = u32TableUnwrappingGetItems (source->surprisingValueTable, &numPairsFromTable);
-  introspectiveInsertionSort(pairsFromTable, 0, numPairsFromTable-1);
+  U32 * pairsFromTable = u32TableGetSortedItems (source->surprisingValueTable, &numPairsFromTable);
   assert (source->slidingWindow != NULL);
   assert (source->windowOffset == 0);
   Long numPairsFromArray = source->numCoupons - numPairsFromTable; // because the window offset is zero
@@ -676,7 +945,7 @@ void uncompressHybridFlavor (FM85 * target, FM85 * source) {
   target->surprisingValueTable = table;
   target->slidingWindow = window;
 
-  free (pairs);
+  releasePairBuf (pairs);
 
   return;
 }
@@ -694,7 +963,7 @@ void compressPinnedFlavor (FM85 * target, FM85 * source) {
   //  }
   if (numPairs > 0) {
     Long chkNumPairs;
-    U32 * pairs = u32TableUnwrappingGetItems (source->surprisingValueTable, &chkNumPairs);
+    U32 * pairs = u32TableGetSortedItems (source->surprisingValueTable, &chkNumPairs);
     assert (chkNumPairs == numPairs);
 
     // Here we subtract 8 from the column indices.  Because they are stored in the low 6 bits 
@@ -706,8 +975,8 @@ void compressPinnedFlavor (FM85 * target, FM85 * source) {
       assert ((pairs[i] & 63) >= 8);
       pairs[i] -= 8; 
     }
+    // which doesn't change their order, so they are still sorted
 
-    introspectiveInsertionSort(pairs, 0, numPairs-1);
     compressTheSurprisingValues (target, source, pairs, numPairs);
     free (pairs);
   }
@@ -735,7 +1004,7 @@ void uncompressPinnedFlavor (FM85 * target, FM85 * source) {
     }
     u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
     target->surprisingValueTable = table;
-    free (pairs);
+    releasePairBuf (pairs);
   }
   return;
 }
@@ -755,7 +1024,7 @@ void compressSlidingFlavor (FM85 * target, FM85 * source) {
 
   if (numPairs > 0) {
     Long chkNumPairs;
-    U32 * pairs = u32TableUnwrappingGetItems (source->surprisingValueTable, &chkNumPairs);
+    U32 * pairs = u32TableGetSortedItems (source->surprisingValueTable, &chkNumPairs);
     assert (chkNumPairs == numPairs);
 
     // Here we apply a complicated transformation to the column indices, which
@@ -781,7 +1050,7 @@ void compressSlidingFlavor (FM85 * target, FM85 * source) {
       pairs[i] = (U32) ((row << 6) | col);
     }
 
-    introspectiveInsertionSort(pairs, 0, numPairs-1);
+    introspectiveInsertionSort(pairs, 0, numPairs-1); // the rows are still in order, so this only reorders within rows
     compressTheSurprisingValues (target, source, pairs, numPairs);
     free (pairs);
   }
@@ -822,11 +1091,14 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
       col = (col + (offset+8)) & 63;
       pairs[i] = (U32) ((row << 6) | col);
     }
+    // The pairs are still sorted by row, but not by column within each row. Since
+    // the rows only hold a few pairs each, insertion sort puts them back in order quickly.
+    introspectiveInsertionSort (pairs, 0, numPairs - 1);
 
     u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
     target->surprisingValueTable = table;
 
-    free (pairs);
+    releasePairBuf (pairs);
   }
   return;
 }
@@ -836,8 +1108,27 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
 
 // Note: in the final system, compressed and uncompressed sketches will have different types
 
-FM85 * fm85Compress (FM85 * source) {
+// Whether the window is at the correct offset for every row, and firstInterestingColumn
+// is up to date, which is what the encoders assume. They also read the whole window
+// from slidingWindow, which a sketch that is copying a shared one doesn't have yet.
+static Boolean sketchIsCaughtUp (FM85 * self) {
+  if (self->shiftCursor != FM85_NO_SHIFT_IN_PROGRESS || self->ficScanCursor >= 0) { return 0; }
+  if (self->slidingWindow == NULL) { return 1; }
+  if (self->windowBlockOwned != NULL) { return 0; }
+  return (determineCorrectOffset (self->lgK, self->numCoupons) == self->windowOffset);
+}
+
+static FM85 * compressWithSegments (FM85 * source, Short lgSegments) {
   assert (source->isCompressed == 0);
+  // Compressing only reads the source. If it is behind, this compresses a private copy
+  // that has been caught up instead, so the source isn't changed even then.
+  if (!sketchIsCaughtUp (source)) {
+    FM85 * caughtUp = fm85Copy (source);
+    fm85CatchUpOffset (caughtUp);
+    FM85 * result = compressWithSegments (caughtUp, lgSegments);
+    fm85Free (caughtUp);
+    return (result);
+  }
 
   FM85 * target = (FM85 *) malloc (sizeof(FM85));
   assert (target != NULL);
@@ -846,12 +1137,31 @@ FM85 * fm85Compress (FM85 * source) {
   target->numCoupons = source->numCoupons;
   target->windowOffset = source->windowOffset;
   target->firstInterestingColumn = source->firstInterestingColumn;
+  target->sparseTableLgSize = source->sparseTableLgSize;
+  target->windowedTableLgSize = source->windowedTableLgSize;
+  target->blockFirstInterestingColumn = (U8 *) NULL;
   target->mergeFlag = source->mergeFlag;
-  target->kxp = source->kxp;
+  target->kxpHi = source->kxpHi;
+  target->kxpLo = source->kxpLo;
   target->hipEstAccum = source->hipEstAccum;
   target->hipErrAccum = source->hipErrAccum;
+  target->estimateSeq = 0;
+  target->windowRefCount = (Long *) NULL;
+  target->tableRefCount = (Long *) NULL;
+  target->sharedWindow = (U8 *) NULL;
+  target->windowBlockOwned = (U64 *) NULL;
+  target->windowCopyCursor = 0;
+
+  target->deferOffsets = source->deferOffsets;
+  target->shiftBudget = source->shiftBudget;
+  target->lgShiftThreads = source->lgShiftThreads;
+  target->shiftCursor = FM85_NO_SHIFT_IN_PROGRESS;
+  target->ficScanCursor = -1;
+  target->ficScanNumSlots = 0;
+  target->ficScanResult = 0;
 
   target->isCompressed = 1;
+  target->lgCompressedSegments = lgSegments;
 
   // initialize the variables that belong in a compressed sketch
   target->numCompressedSurprisingValues = 0;
@@ -863,6 +1173,7 @@ FM85 * fm85Compress (FM85 * source) {
   // clear the variables that don't belong in a compressed sketch
   target->slidingWindow = NULL;
   target->surprisingValueTable = NULL;
+  refreshUpdateMode (target);
 
   enum flavorType flavor = determineSketchFlavor(source);
   switch (flavor) {
@@ -893,6 +1204,21 @@ FM85 * fm85Compress (FM85 * source) {
   return target;
 }
 
+FM85 * fm85Compress (FM85 * source) {
+  return (compressWithSegments (source, 0));
+}
+
+FM85 * fm85CompressSegmented (FM85 * source, Short lgNumSegments, Long numThreads) {
+  assert (lgNumSegments >= 0);
+  if (lgNumSegments > source->lgK - FM85_LG_MIN_ROWS_PER_SEGMENT) { lgNumSegments = source->lgK - FM85_LG_MIN_ROWS_PER_SEGMENT; }
+  if (lgNumSegments < 0) { lgNumSegments = 0; }
+  assert (numThreads >= 1);
+  threadsPerSketch = numThreads;
+  FM85 * target = compressWithSegments (source, lgNumSegments);
+  threadsPerSketch = 1;
+  return (target);
+}
+
 /***************************************************************/
 /***************************************************************/
 // Note: in the final system, compressed and uncompressed sketches will have different types
@@ -907,12 +1233,31 @@ FM85 * fm85Uncompress (FM85 * source) {
   target->numCoupons = source->numCoupons;
   target->windowOffset = source->windowOffset;
   target->firstInterestingColumn = source->firstInterestingColumn;
+  target->sparseTableLgSize = source->sparseTableLgSize;
+  target->windowedTableLgSize = source->windowedTableLgSize;
+  target->blockFirstInterestingColumn = (U8 *) NULL;
   target->mergeFlag = source->mergeFlag;
-  target->kxp = source->kxp;
+  target->kxpHi = source->kxpHi;
+  target->kxpLo = source->kxpLo;
   target->hipEstAccum = source->hipEstAccum;
   target->hipErrAccum = source->hipErrAccum;
+  target->estimateSeq = 0;
+  target->windowRefCount = (Long *) NULL;
+  target->tableRefCount = (Long *) NULL;
+  target->sharedWindow = (U8 *) NULL;
+  target->windowBlockOwned = (U64 *) NULL;
+  target->windowCopyCursor = 0;
+
+  target->deferOffsets = source->deferOffsets;
+  target->shiftBudget = source->shiftBudget;
+  target->lgShiftThreads = source->lgShiftThreads;
+  target->shiftCursor = FM85_NO_SHIFT_IN_PROGRESS;
+  target->ficScanCursor = -1;
+  target->ficScanNumSlots = 0;
+  target->ficScanResult = 0;
 
   target->isCompressed = 0;
+  target->lgCompressedSegments = 0;
 
   // initialize the variables that belong in an updateable sketch
   target->slidingWindow = (U8 *) NULL;
@@ -943,5 +1288,87 @@ FM85 * fm85Uncompress (FM85 * source) {
   default: FATAL_ERROR ("Unknown sketch flavor");
   }
 
+  refreshUpdateMode (target);
   return target;
 }
+
+FM85 * fm85UncompressWithThreads (FM85 * source, Long numThreads) {
+  assert (numThreads >= 1);
+  threadsPerSketch = numThreads;
+  FM85 * target = fm85Uncompress (source);
+  threadsPerSketch = 1;
+  return (target);
+}
+
+/***************************************************************/
+/***************************************************************/
+// The batch versions. The threads take FM85_BATCH_CHUNK sketches at a time from a shared counter,
+// which is cheap next to compressing them, and balances sketches of different sizes.
+
+#define FM85_BATCH_CHUNK 16
+
+typedef struct fm85_batch_worker_type
+{
+  FM85 ** sources;
+  FM85 ** targets;
+  Long numSketches;
+  Long * nextSketch;  // Shared by the threads.
+  Boolean compress;
+  FM85CS scratch;
+} FM85BW;
+
+static void * batchWorkerMain (void * arg) {
+  FM85BW * worker = (FM85BW *) arg;
+  Long start, i;
+  threadScratch = &worker->scratch;
+  while ((start = __atomic_fetch_add (worker->nextSketch, FM85_BATCH_CHUNK, __ATOMIC_RELAXED)) < worker->numSketches) {
+    Long end = start + FM85_BATCH_CHUNK;
+    if (end > worker->numSketches) { end = worker->numSketches; }
+    for (i = start; i < end; i++) {
+      if (worker->compress) { worker->targets[i] = fm85Compress (worker->sources[i]); }
+      else                  { worker->targets[i] = fm85Uncompress (worker->sources[i]); }
+    }
+  }
+  threadScratch = NULL;
+  free (worker->scratch.outputBuf);
+  free (worker->scratch.pairBuf);
+  return (NULL);
+}
+
+static void doManySketches (FM85 ** sources, FM85 ** targets, Long numSketches, Long numThreads, Boolean compress) {
+  assert (numSketches >= 0 && numThreads >= 1);
+  Long maxThreads = (numSketches + FM85_BATCH_CHUNK - 1) / FM85_BATCH_CHUNK;
+  if (numThreads > maxThreads) { numThreads = maxThreads; }
+  if (numThreads < 1) { numThreads = 1; }
+  FM85BW * workers = (FM85BW *) malloc (((size_t) numThreads) * sizeof(FM85BW));
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numThreads) * sizeof(pthread_t));
+  assert (workers != NULL && threads != NULL);
+  Long nextSketch = 0;
+  Long t;
+  for (t = 0; t < numThreads; t++) {
+    workers[t].sources = sources;
+    workers[t].targets = targets;
+    workers[t].numSketches = numSketches;
+    workers[t].nextSketch = &nextSketch;
+    workers[t].compress = compress;
+    workers[t].scratch.outputBuf = (U32 *) NULL;
+    workers[t].scratch.outputBufLen = 0;
+    workers[t].scratch.pairBuf = (U32 *) NULL;
+    workers[t].scratch.pairBufLen = 0;
+  }
+  for (t = 1; t < numThreads; t++) {
+    if (pthread_create (&threads[t], NULL, batchWorkerMain, (void *) &workers[t]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+  batchWorkerMain ((void *) &workers[0]);
+  for (t = 1; t < numThreads; t++) { pthread_join (threads[t], NULL); }
+  free (workers);
+  free (threads);
+}
+
+void fm85CompressMany (FM85 ** sources, FM85 ** targets, Long numSketches, Long numThreads) {
+  doManySketches (sources, targets, numSketches, numThreads, 1);
+}
+
+void fm85UncompressMany (FM85 ** sources, FM85 ** targets, Long numSketches, Long numThreads) {
+  doManySketches (sources, targets, numSketches, numThreads, 0);
+}
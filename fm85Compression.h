@@ -59,10 +59,34 @@ void lowLevelUncompressBytes (U8 * byteArray,         // output
 
 /****************************************/
 
+// Compressing never changes the input, so several threads can compress the same sketch
+// at once, as long as nothing updates it meanwhile. An input with a window shift or a
+// deferred offset still pending is first copied and caught up, which costs O(k) more.
 FM85 * fm85Compress (FM85 * uncompressedSketch); // returns a compressed copy of its input
 
 FM85 * fm85Uncompress (FM85 * compressedSketch); // returns an updateable copy of its input
 
+// The segmented format splits the rows into 2^lgNumSegments equal ranges, which are encoded
+// as independent substreams that up to numThreads threads can encode and decode at once.
+// It costs a table of a word or two per segment, plus the padding at the end of each
+// substream, and each segment's pairs are coded with less context. With the smallest
+// allowed segments, of 2^FM85_LG_MIN_ROWS_PER_SEGMENT rows, the result is about 0.7% bigger
+// once there are K coupons or more, 1.7% bigger with K/4 coupons, and 4% bigger with K/16.
+// Each halving of the segments roughly quadruples that, so a request for more segments than
+// this allows gets as many as it allows. fm85Uncompress handles the format by itself with
+// one thread, and fm85UncompressWithThreads also handles the ordinary format, with one thread.
+#define FM85_LG_MIN_ROWS_PER_SEGMENT 12
+
+FM85 * fm85CompressSegmented (FM85 * uncompressedSketch, Short lgNumSegments, Long numThreads);
+FM85 * fm85UncompressWithThreads (FM85 * compressedSketch, Long numThreads);
+
+// These fill in targets[i] with a compressed (or updateable) copy of sources[i], using up to
+// numThreads threads, one of which is the calling thread. Each thread takes a few sketches at a
+// time, and it keeps its own scratch buffers for the intermediate arrays, which the one-at-a-time
+// routines allocate and free for every sketch.
+void fm85CompressMany (FM85 ** sources, FM85 ** targets, Long numSketches, Long numThreads);
+void fm85UncompressMany (FM85 ** sources, FM85 ** targets, Long numSketches, Long numThreads);
+
 // Note: in the final system, compressed and uncompressed sketches will have different types
 
 /****************************************/
@@ -0,0 +1,208 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+#include <sched.h>
+
+#include "common.h"
+#include "fm85Util.h"
+#include "u32Table.h"
+#include "fm85.h"
+#include "fm85Concurrent.h"
+
+/*******************************************************/
+
+FM85C * fm85ConcurrentMake (Short lgK, Long numWriters) {
+  assert (lgK >= 4 && lgK <= FM85_CONCURRENT_MAX_LG_K);
+  assert (numWriters >= 1);
+  FM85C * self = (FM85C *) malloc (sizeof(FM85C));
+  assert (self != NULL);
+  FM85CW * writers = (FM85CW *) malloc (((size_t) numWriters) * sizeof(FM85CW));
+  assert (writers != NULL);
+  bzero ((void *) writers, ((size_t) numWriters) * sizeof(FM85CW));
+
+  FM85 * sketch = fm85Make (lgK);
+  sketch->mergeFlag = 1; // there is no HIP estimate
+  sketch->sparseTableLgSize = (lgK > 6) ? (lgK - 4) : 2; // K/16, to avoid several early pauses
+  promoteEmptyToSparse (sketch); // so that the writers always have a table
+
+  self->sketch = sketch;
+  self->numWriters = numWriters;
+  self->writers = writers;
+  self->paused = 0;
+  self->numTombstones = 0;
+  self->epoch = 0;
+  self->firstInterestingColumn = 0;
+  return (self);
+}
+
+/*******************************************************/
+
+void fm85ConcurrentFree (FM85C * self) {
+  if (self != NULL) {
+    fm85Free (self->sketch);
+    free (self->writers);
+    free (self);
+  }
+}
+
+/*******************************************************/
+// The epoch barrier. A writer raises its flag and then checks whether the
+// sketch is paused, while a thread that wants to pause it sets the paused
+// flag and then waits for the other writers' flags to fall. Because all four
+// of these operations are sequentially consistent, at least one of the two
+// threads sees what the other one did, so no writer can be inside the sketch
+// while it is paused.
+
+static void enterSketch (FM85C * self, Long * active) {
+  while (1) {
+    while (__atomic_load_n (&self->paused, __ATOMIC_ACQUIRE)) { sched_yield (); }
+    __atomic_store_n (active, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n (&self->paused, __ATOMIC_SEQ_CST)) { return; }
+    __atomic_store_n (active, 0, __ATOMIC_RELEASE); // back off until the pause is over
+  }
+}
+
+static void leaveSketch (Long * active) {
+  __atomic_store_n (active, 0, __ATOMIC_RELEASE);
+}
+
+// Returns 0 if another thread has already paused the sketch. In that case a writer
+// should simply carry on, because the other thread will see its changes.
+// The caller's own flag (if any) is not waited for.
+
+static Boolean tryToPause (FM85C * self, Long * active) {
+  Long expected = 0;
+  if (!__atomic_compare_exchange_n (&self->paused, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    return 0;
+  }
+  Long i;
+  for (i = 0; i < self->numWriters; i++) {
+    Long * other = &(self->writers[i].active);
+    if (other != active) {
+      while (__atomic_load_n (other, __ATOMIC_SEQ_CST)) { sched_yield (); }
+    }
+  }
+  return 1;
+}
+
+static void resume (FM85C * self) {
+  self->epoch += 1;
+  __atomic_store_n (&self->paused, 0, __ATOMIC_RELEASE);
+}
+
+/*******************************************************/
+// This does whatever the writers have postponed. It runs while the sketch
+// is paused, so it can use the ordinary single-threaded routines, but
+// those don't know about tombstones, so they are removed first.
+
+static void catchUp (FM85C * self) {
+  FM85 * sketch = self->sketch;
+  if (self->numTombstones > 0) {
+    u32TableRemoveTombstones (sketch->surprisingValueTable, sketch->surprisingValueTable->lgSize);
+    self->numTombstones = 0;
+  }
+
+  if (sketch->slidingWindow == NULL && sketch->numCoupons >= sketch->nextThreshold) {
+    promoteSparseToWindowed (sketch);
+  }
+  if (sketch->slidingWindow != NULL) {
+    Short correctOffset = determineCorrectOffset (sketch->lgK, sketch->numCoupons);
+    if (correctOffset > sketch->windowOffset) { modifyOffset (sketch, correctOffset); }
+  }
+
+  // leave room for the writers to double the number of surprising values before the next pause
+  u32Table * table = sketch->surprisingValueTable;
+  u32TableFinishResize (table); // the writers' routines can't handle a resize in progress, so the pause absorbs it
+  Short lgSize = u32TableLgSizeForNumItems (2 * table->numItems);
+  if (lgSize > table->lgSize) { u32TableRemoveTombstones (table, lgSize); } // there are none, so this just grows it
+
+  // This only ever increases, so the writers can use an out-of-date value.
+  __atomic_store_n (&self->firstInterestingColumn, sketch->firstInterestingColumn, __ATOMIC_RELAXED);
+}
+
+/*******************************************************/
+
+static Boolean tableIsCrowded (FM85C * self) {
+  u32Table * table = self->sketch->surprisingValueTable;
+  Long numUsedSlots = __atomic_load_n (&table->numItems, __ATOMIC_RELAXED) + __atomic_load_n (&self->numTombstones, __ATOMIC_RELAXED);
+  return (u32TableUpsizeDenom * numUsedSlots > u32TableUpsizeNumer * (1LL << table->lgSize));
+}
+
+/*******************************************************/
+// This is the concurrent counterpart of fm85RowColUpdate(). It returns 1 if a new
+// coupon was collected, 0 if not, and -1 if the table was too full to tell.
+// The sketch's other fields only change while it is paused, so they can be read normally.
+
+static Short concurrentRowColUpdate (FM85C * self, U32 rowCol) {
+  FM85 * sketch = self->sketch;
+  Short col = (Short) (rowCol & 63);
+  if (col < sketch->firstInterestingColumn) { return 0; }
+  U8 * blockFIC = sketch->blockFirstInterestingColumn;
+  if (blockFIC != NULL && col < blockFIC[rowCol >> (6 + FM85_LG_ROWS_PER_BLOCK)]) { return 0; }
+
+  u32Table * table = sketch->surprisingValueTable;
+  U8 * window = sketch->slidingWindow;
+  if (window == NULL) { return (u32TableConcurrentMaybeInsert (table, rowCol)); } // the flavor is SPARSE
+
+  Short offset = sketch->windowOffset;
+  if (col < offset) { // track the surprising 0's "before" the window
+    if (!u32TableConcurrentMaybeDelete (table, rowCol)) { return 0; }
+    __atomic_add_fetch (&self->numTombstones, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  else if (col < offset + 8) { // track the 8 bits inside the window
+    U8 bit = (U8) (1 << (col - offset));
+    U8 oldBits = __atomic_fetch_or (&window[rowCol >> 6], bit, __ATOMIC_RELAXED);
+    return ((oldBits & bit) == 0);
+  }
+  else { // track the surprising 1's "after" the window
+    return (u32TableConcurrentMaybeInsert (table, rowCol));
+  }
+}
+
+/*******************************************************/
+
+void fm85ConcurrentUpdate (FM85C * self, Long writerId, U64 hash0, U64 hash1) {
+  assert (writerId >= 0 && writerId < self->numWriters);
+  FM85 * sketch = self->sketch;
+  U32 rowCol = rowColFromTwoHashes (hash0, hash1, sketch->lgK);
+  Short col = (Short) (rowCol & 63);
+  if (col < __atomic_load_n (&self->firstInterestingColumn, __ATOMIC_RELAXED)) { return; } // doesn't need to enter
+  Long * active = &(self->writers[writerId].active);
+
+  enterSketch (self, active);
+  Short result;
+  while ((result = concurrentRowColUpdate (self, rowCol)) < 0) { // wait for the table to grow
+    if (tryToPause (self, active)) { catchUp (self); resume (self); }
+    else { leaveSketch (active); enterSketch (self, active); }
+  }
+  if (result == 1) {
+    Long c = __atomic_add_fetch (&sketch->numCoupons, 1, __ATOMIC_RELAXED);
+    if (c >= sketch->nextThreshold || tableIsCrowded (self)) {
+      if (tryToPause (self, active)) { catchUp (self); resume (self); }
+    }
+  }
+  leaveSketch (active);
+}
+
+/*******************************************************/
+
+Long fm85ConcurrentNumCoupons (FM85C * self) {
+  return (__atomic_load_n (&self->sketch->numCoupons, __ATOMIC_RELAXED));
+}
+
+/*******************************************************/
+
+FM85 * fm85ConcurrentGetResult (FM85C * self) {
+  while (!tryToPause (self, NULL)) { sched_yield (); }
+  catchUp (self); // the flavor and offset must be correct, and the tombstones must be gone
+  FM85 * result;
+  if (self->sketch->numCoupons == 0) {
+    result = fm85Make (self->sketch->lgK); // the shared sketch already has a table
+    result->mergeFlag = 1;
+  }
+  else {
+    result = fm85Copy (self->sketch);
+  }
+  resume (self);
+  return (result);
+}
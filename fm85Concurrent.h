@@ -0,0 +1,62 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+// A variant of the FM85 sketch that many threads can update at once.
+//
+// The writers share one underlying sketch. Window bits are set with an atomic
+// byte OR, the surprising values are inserted and deleted with the lock-free
+// routines of u32Table, and numCoupons is incremented atomically. Everything
+// else (promotion, moving the window, resizing the table) is done by a single
+// thread during a short pause, when every other writer has left the sketch.
+//
+// Since the order in which the coupons arrive is not defined, the sketch has
+// no HIP estimate. Its result is flagged like the result of a merge.
+
+#ifndef GOT_FM85_CONCURRENT_H
+#include "common.h"
+#include "u32Table.h"
+#include "fm85.h"
+
+/*******************************************************/
+
+// The table's tombstone must not be a valid item, so lgK can't be 26.
+#define FM85_CONCURRENT_MAX_LG_K 25
+
+// Each writer has a flag on its own cache line.
+typedef struct fm85_concurrent_writer_type
+{
+  Long active;     // Set while the writer is inside an update.
+  Long unused[7];
+} FM85CW;
+
+typedef struct fm85_concurrent_sketch_type
+{
+  FM85 * sketch;       // The shared sketch.
+  Long numWriters;
+  FM85CW * writers;
+  Long paused;         // Set while one thread has the sketch to itself.
+  Long numTombstones;  // Slots of the table that were emptied since the last pause.
+  Long epoch;          // The number of pauses so far.
+  Short firstInterestingColumn; // A copy of the sketch's, which can be read without entering it.
+} FM85C;
+
+/*******************************************************/
+
+FM85C * fm85ConcurrentMake (Short lgK, Long numWriters);
+
+void fm85ConcurrentFree (FM85C * self);
+
+// Can be called by several threads at once, provided that each one uses its own writerId,
+// which is in [0, numWriters).
+void fm85ConcurrentUpdate (FM85C * self, Long writerId, U64 hash0, U64 hash1);
+
+// Can be called at any time. The count includes the updates that have finished so far.
+Long fm85ConcurrentNumCoupons (FM85C * self);
+
+// Can be called at any time. Pauses the writers while copying the sketch.
+// The result is an ordinary updateable sketch with mergeFlag set.
+FM85 * fm85ConcurrentGetResult (FM85C * self);
+
+/*******************************************************/
+
+#define GOT_FM85_CONCURRENT_H
+#endif
@@ -1,5 +1,7 @@
 // Copyright 2018, Kevin Lang, Oath Research
 
+#include <pthread.h>
+
 #include "fm85Merging.h"
 
 
@@ -44,9 +46,7 @@ U64 * bitMatrixOfUG85 (UG85 * self, Boolean * needToFreePtr) {
 /*******************************************************************************************/
 /*******************************************************************************************/
 
-void walkTableUpdatingSketch (FM85 * dest, u32Table * table) {
-  U32 * slots = table->slots;
-  Long numSlots = (1LL << table->lgSize); 
+static void walkSlotsUpdatingSketch (FM85 * dest, U32 * slots, Long numSlots) {
   assert (dest->lgK <= 26);
   U32 destMask = (((1 << dest->lgK) - 1) << 6) | 63;  // downsamples when destlgK < srcLgK
 
@@ -67,19 +67,31 @@ void walkTableUpdatingSketch (FM85 * dest, u32Table * table) {
   }
 }
 
+void walkTableUpdatingSketch (FM85 * dest, u32Table * table) {
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    if (numSlots > 0) { walkSlotsUpdatingSketch (dest, slots, numSlots); }
+  }
+}
+
 /*******************************************************************************************/
 
 void orTableIntoMatrix (U64 * bitMatrix, Short destLgK, u32Table * table) {
-  U32 * slots = table->slots;
-  Long numSlots = (1LL << table->lgSize); 
   Long destMask = (1LL << destLgK) - 1LL;  // downsamples when destlgK < srcLgK
   Long i = 0;
-  for (i = 0; i < numSlots; i++) { 
-    U32 rowCol = slots[i];
-    if (rowCol != ALL32BITS) {
-      Short col = (Short) (rowCol & 63);
-      Long  row = (Long)  (rowCol >> 6);
-      bitMatrix[row & destMask] |= (1ULL << col); // Set the bit.
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) { 
+      U32 rowCol = slots[i];
+      if (rowCol != ALL32BITS) {
+	Short col = (Short) (rowCol & 63);
+	Long  row = (Long)  (rowCol >> 6);
+	bitMatrix[row & destMask] |= (1ULL << col); // Set the bit.
+      }
     }
   }
 }
@@ -135,6 +147,7 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
     if (oldSketch->numCoupons == 0) { // if the accumulator is EMPTY, simply change its K.
       assert (oldSketch->surprisingValueTable == NULL);
       oldSketch->lgK = newLgK;
+      refreshUpdateMode (oldSketch);
       unioner->lgK = newLgK;
       return;
     }
@@ -166,9 +179,29 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
 
 /*******************************************************************************************/
 
+static void switchToBitMatrix (UG85 * unioner) {
+  if (unioner->accumulator != NULL) {
+    assert (unioner->bitMatrix == NULL);
+    enum flavorType destFlavor = determineSketchFlavor (unioner->accumulator);
+    assert (EMPTY == destFlavor || SPARSE == destFlavor);
+    unioner->bitMatrix = bitMatrixOfSketch (unioner->accumulator);
+    fm85Free (unioner->accumulator);
+    unioner->accumulator = NULL;
+  }
+  assert (unioner->bitMatrix != NULL);
+}
+
+/*******************************************************************************************/
+
 void ug85MergeInto (UG85 * unioner, FM85 * source) {
   if (NULL == unioner) { FATAL_ERROR ("unionerMergeInto(NULL)"); }
   if (NULL == source) return;
+  if (source->windowBlockOwned != NULL) { // its window is partly in a snapshot's, so merge a whole copy
+    FM85 * copy = fm85Copy (source);
+    ug85MergeInto (unioner, copy);
+    fm85Free (copy);
+    return;
+  }
   
   enum flavorType sourceFlavor = determineSketchFlavor(source);
   if (EMPTY == sourceFlavor) return;
@@ -211,15 +244,7 @@ void ug85MergeInto (UG85 * unioner, FM85 * source) {
   assert (HYBRID == sourceFlavor || PINNED == sourceFlavor || SLIDING == sourceFlavor);
 
  // source is past SPARSE mode, so make sure that dest is a bitMatrix.
-  if (unioner->accumulator != NULL) {
-    assert (unioner->bitMatrix == NULL);
-    enum flavorType destFlavor = determineSketchFlavor (unioner->accumulator);
-    assert (EMPTY == destFlavor || SPARSE == destFlavor);
-    unioner->bitMatrix = bitMatrixOfSketch (unioner->accumulator);
-    fm85Free (unioner->accumulator);
-    unioner->accumulator = NULL;
-  }
-  assert (unioner->bitMatrix != NULL);
+  switchToBitMatrix (unioner);
 
   if (HYBRID == sourceFlavor || PINNED == sourceFlavor) { // Case C
     orWindowIntoMatrix (unioner->bitMatrix, unioner->lgK, source->slidingWindow, source->windowOffset, source->lgK);
@@ -237,6 +262,118 @@ void ug85MergeInto (UG85 * unioner, FM85 * source) {
   return;
 }
 
+/*******************************************************************************************/
+// Since a union doesn't depend on the order of its sources, the threads are free to take
+// whichever source is next, which balances sources of very different sizes. Each thread
+// merges its sources into its own unioner, whose K is already the smallest one. Then the
+// first thread merges the partial unioners that are still sparse sketches, and all of the
+// threads OR the partial bit matrices into the unioner's, each doing its own range of rows.
+// The unioner ends up holding a bit matrix exactly when serial merging would have given it one,
+// because that happens when some source is beyond SPARSE, or when the union itself is.
+
+typedef struct ug85_merge_worker_type
+{
+  UG85 * unioner;
+  FM85 ** sources;
+  Long numSources;
+  Long * nextSource;  // Shared by the threads.
+  Long numThreads;
+  Long id;
+  pthread_barrier_t * barrier;
+  UG85 ** partials;   // One per thread.
+} UG85MW;
+
+static void mergeSourcesOfOneThread (UG85MW * worker) {
+  UG85 * partial = worker->partials[worker->id];
+  Long i;
+  while ((i = __atomic_fetch_add (worker->nextSource, 1, __ATOMIC_RELAXED)) < worker->numSources) {
+    ug85MergeInto (partial, worker->sources[i]);
+  }
+}
+
+static void orRowsOfOneThread (UG85MW * worker) {
+  UG85 * unioner = worker->unioner;
+  if (unioner->bitMatrix == NULL) return; // every partial was sparse
+  Long k = (1LL << unioner->lgK);
+  Long rowLo = (k * worker->id) / worker->numThreads;
+  Long rowHi = (k * (worker->id + 1)) / worker->numThreads;
+  Long t, i;
+  for (t = 0; t < worker->numThreads; t++) {
+    U64 * matrix = worker->partials[t]->bitMatrix;
+    if (matrix == NULL) continue;
+    for (i = rowLo; i < rowHi; i++) { unioner->bitMatrix[i] |= matrix[i]; }
+  }
+}
+
+static void * mergeWorkerMain (void * arg) {
+  UG85MW * worker = (UG85MW *) arg;
+  mergeSourcesOfOneThread (worker);
+  pthread_barrier_wait (worker->barrier);
+  pthread_barrier_wait (worker->barrier); // meanwhile, the first thread merges the sparse partials
+  orRowsOfOneThread (worker);
+  return (NULL);
+}
+
+void ug85MergeMany (UG85 * unioner, FM85 ** sources, Long numSources, Long numThreads) {
+  if (NULL == unioner) { FATAL_ERROR ("ug85MergeMany(NULL)"); }
+  assert (numSources >= 0 && numThreads >= 1);
+  Long i, t;
+
+  // reduce to the smallest K first, so that the partial results can simply be OR'ed
+  Short lgK = unioner->lgK;
+  for (i = 0; i < numSources; i++) {
+    if (sources[i] != NULL && determineSketchFlavor (sources[i]) != EMPTY && sources[i]->lgK < lgK) { lgK = sources[i]->lgK; }
+  }
+  if (lgK < unioner->lgK) { ug85ReduceK (unioner, lgK); }
+
+  if (numThreads > numSources) { numThreads = numSources; }
+  if (numThreads <= 1) {
+    for (i = 0; i < numSources; i++) { ug85MergeInto (unioner, sources[i]); }
+    return;
+  }
+
+  UG85MW * workers = (UG85MW *) malloc (((size_t) numThreads) * sizeof(UG85MW));
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numThreads) * sizeof(pthread_t));
+  UG85 ** partials = (UG85 **) malloc (((size_t) numThreads) * sizeof(UG85 *));
+  assert (workers != NULL && threads != NULL && partials != NULL);
+  pthread_barrier_t barrier;
+  pthread_barrier_init (&barrier, NULL, (unsigned) numThreads);
+  Long nextSource = 0;
+  for (t = 0; t < numThreads; t++) {
+    partials[t] = ug85Make (lgK);
+    workers[t].unioner = unioner;
+    workers[t].sources = sources;
+    workers[t].numSources = numSources;
+    workers[t].nextSource = &nextSource;
+    workers[t].numThreads = numThreads;
+    workers[t].id = t;
+    workers[t].barrier = &barrier;
+    workers[t].partials = partials;
+  }
+  for (t = 1; t < numThreads; t++) {
+    if (pthread_create (&threads[t], NULL, mergeWorkerMain, (void *) &workers[t]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+
+  mergeSourcesOfOneThread (&workers[0]);
+  pthread_barrier_wait (&barrier);
+  for (t = 0; t < numThreads; t++) {
+    if (partials[t]->accumulator != NULL) { ug85MergeInto (unioner, partials[t]->accumulator); }
+  }
+  for (t = 0; t < numThreads; t++) {
+    if (partials[t]->bitMatrix != NULL) { switchToBitMatrix (unioner); }
+  }
+  pthread_barrier_wait (&barrier);
+
+  orRowsOfOneThread (&workers[0]);
+  for (t = 1; t < numThreads; t++) { pthread_join (threads[t], NULL); }
+  pthread_barrier_destroy (&barrier);
+
+  for (t = 0; t < numThreads; t++) { ug85Free (partials[t]); }
+  free (partials);
+  free (workers);
+  free (threads);
+}
+
 /*******************************************************************************************/
 
 FM85 * ug85GetResult (UG85 * unioner) {
@@ -260,9 +397,16 @@ FM85 * ug85GetResult (UG85 * unioner) {
   // start of case where unioner contains a bitMatrix
   assert (unioner->bitMatrix != NULL);
   assert (unioner->accumulator == NULL);
-  U64 * matrix = unioner->bitMatrix;
-  Short lgK = unioner->lgK;
-  FM85 * result = fm85Make (unioner->lgK); 
+  return (sketchOfBitMatrix (unioner->bitMatrix, unioner->lgK));
+  // end of case where unioner contains a bitMatrix
+}
+
+/*******************************************************************************************/
+// This builds a sketch of a bit matrix whose flavor is HYBRID or beyond. Since the
+// order in which the coupons arrived is unknown, the result has no HIP estimate.
+
+FM85 * sketchOfBitMatrix (U64 * matrix, Short lgK) {
+  FM85 * result = fm85Make (lgK); 
 
   Long k = (1LL << lgK);
   Long numCoupons = countBitsSetInMatrix (matrix, k);
@@ -303,7 +447,7 @@ FM85 * ug85GetResult (UG85 * unioner) {
     pattern ^= maskForFlippingEarlyZone; // This flipping converts surprising 0's to 1's.
     allSurprisesORed |= pattern;
     while (pattern != 0) {
-      Short col = countTrailingZerosInUnsignedLong (pattern);
+      Short col = fastCountTrailingZeros64 (pattern);
       pattern = pattern ^ (1ULL << col); // erase the 1.
       U32 rowCol = (i << 6) | col;
       Boolean isNovel = u32TableMaybeInsert (table, rowCol);
@@ -313,13 +457,193 @@ FM85 * ug85GetResult (UG85 * unioner) {
 
   // At this point we could shrink an oversize hash table, but the relative waste isn't very big.
 
-  result->firstInterestingColumn = countTrailingZerosInUnsignedLong (allSurprisesORed);
+  result->firstInterestingColumn = fastCountTrailingZeros64 (allSurprisesORed);
   if (result->firstInterestingColumn > offset) result->firstInterestingColumn = offset; // corner case
 
   // NB: the HIP-related fields will contain bogus values, but that is okay.
 
   result->mergeFlag = 1;
+  refreshUpdateMode (result);
   return result;
-  // end of case where unioner contains a bitMatrix
+}
+
+/*******************************************************************************************/
+// The parallel version of sketchOfBitMatrix. Each thread owns a power-of-2 range of rows,
+// and it works in three phases, between which the first thread does the serial work:
+//   1) count the coupons in its rows  (then the offset is determined, and the window is allocated)
+//   2) fill in its part of the window, and list its surprising values, which come out sorted
+//   3) lay out its surprising values in its range of slots of the new table (since the table's
+//      lgSize is at least lgK - 4, the home slots of a range of rows are a range of slots).
+// Finally, the values that didn't fit in their thread's range of slots are inserted serially.
+
+typedef struct ug85_result_worker_type
+{
+  U64 * matrix;
+  Short lgK;
+  Short lgNumThreads;
+  Long id;
+  pthread_barrier_t * barrier;
+  Long numCoupons;      // In this thread's rows.
+  FM85 * result;        // Its window and offset are set between phases 1 and 2,
+  u32Table * newTable;  // and this is made between phases 2 and 3.
+  U32 * items;          // The surprising values of this thread's rows, in order.
+  Long numItems;
+  U64 allSurprisesORed;
+  Long firstSpilled;    // The items from here on didn't fit in this thread's range of the new table.
+} UG85RW;
+
+static void countCouponsOfOneThread (UG85RW * worker) {
+  Short lgRows = worker->lgK - worker->lgNumThreads;
+  worker->numCoupons = countBitsSetInMatrix (worker->matrix + (worker->id << lgRows), 1LL << lgRows);
+}
+
+static void extractRowsOfOneThread (UG85RW * worker) {
+  Short lgRows = worker->lgK - worker->lgNumThreads;
+  Long rowLo = worker->id << lgRows;
+  Long rowHi = rowLo + (1LL << lgRows);
+  U64 * matrix = worker->matrix;
+  U8 * window = worker->result->slidingWindow;
+  Short offset = worker->result->windowOffset;
+  U64 maskForClearingWindow = (0xffULL << offset) ^ ALL64BITS;
+  U64 maskForFlippingEarlyZone = (1ULL << offset) - 1;
+  U64 allSurprisesORed = 0;
+  Long numItems = 0;
+  Long i;
+
+  for (i = rowLo; i < rowHi; i++) {
+    U64 pattern = matrix[i];
+    window[i] = (U8) ((pattern >> offset) & 0xff);
+    pattern &= maskForClearingWindow;
+    pattern ^= maskForFlippingEarlyZone; // This flipping converts surprising 0's to 1's.
+    allSurprisesORed |= pattern;
+    while (pattern != 0) { pattern &= pattern - 1; numItems++; }
+  }
+
+  U32 * items = (U32 *) malloc ((size_t) ((numItems + 1) * sizeof(U32)));
+  assert (items != NULL);
+  numItems = 0;
+  for (i = rowLo; i < rowHi; i++) {
+    U64 pattern = ((matrix[i] & maskForClearingWindow) ^ maskForFlippingEarlyZone);
+    while (pattern != 0) {
+      Short col = fastCountTrailingZeros64 (pattern);
+      pattern = pattern ^ (1ULL << col); // erase the 1.
+      items[numItems++] = (U32) ((i << 6) | col);
+    }
+  }
+  worker->items = items;
+  worker->numItems = numItems;
+  worker->allSurprisesORed = allSurprisesORed;
+}
+
+static void layOutRowsOfOneThread (UG85RW * worker) {
+  Short lgSlots = worker->newTable->lgSize - worker->lgNumThreads;
+  Long slotLo = worker->id << lgSlots;
+  worker->firstSpilled = u32TableLayOutSortedItems (worker->newTable, slotLo, slotLo + (1LL << lgSlots),
+						   worker->items, worker->numItems);
+}
+
+static void * resultWorkerMain (void * arg) {
+  UG85RW * worker = (UG85RW *) arg;
+  countCouponsOfOneThread (worker);
+  pthread_barrier_wait (worker->barrier);
+  pthread_barrier_wait (worker->barrier); // meanwhile, the first thread sets up the window
+  extractRowsOfOneThread (worker);
+  pthread_barrier_wait (worker->barrier);
+  pthread_barrier_wait (worker->barrier); // meanwhile, the first thread makes the table
+  layOutRowsOfOneThread (worker);
+  return (NULL);
+}
+
+FM85 * sketchOfBitMatrixWithThreads (U64 * matrix, Short lgK, Long numThreads) {
+  assert (numThreads >= 1);
+  Short lgNumThreads = 0;
+  while ((2LL << lgNumThreads) <= numThreads && lgK - (lgNumThreads + 1) >= FM85_LG_ROWS_PER_BLOCK) { lgNumThreads++; }
+  if (lgNumThreads == 0) { return (sketchOfBitMatrix (matrix, lgK)); }
+  numThreads = (1LL << lgNumThreads);
+
+  FM85 * result = fm85Make (lgK);
+  Long k = (1LL << lgK);
+  UG85RW * workers = (UG85RW *) malloc (((size_t) numThreads) * sizeof(UG85RW));
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numThreads) * sizeof(pthread_t));
+  assert (workers != NULL && threads != NULL);
+  pthread_barrier_t barrier;
+  pthread_barrier_init (&barrier, NULL, (unsigned) numThreads);
+  Long t, j;
+  for (t = 0; t < numThreads; t++) {
+    workers[t].matrix = matrix;
+    workers[t].lgK = lgK;
+    workers[t].lgNumThreads = lgNumThreads;
+    workers[t].id = t;
+    workers[t].barrier = &barrier;
+    workers[t].result = result;
+  }
+  for (t = 1; t < numThreads; t++) {
+    if (pthread_create (&threads[t], NULL, resultWorkerMain, (void *) &workers[t]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
 
+  countCouponsOfOneThread (&workers[0]);
+  pthread_barrier_wait (&barrier);
+  Long numCoupons = 0;
+  for (t = 0; t < numThreads; t++) { numCoupons += workers[t].numCoupons; }
+  result->numCoupons = numCoupons;
+  enum flavorType flavor = determineFlavor (lgK, numCoupons);
+  assert (flavor == HYBRID || flavor == PINNED || flavor == SLIDING);
+  Short offset = determineCorrectOffset (lgK, numCoupons);
+  result->windowOffset = offset;
+  U8 * window = (U8 *) malloc ((size_t) (k * sizeof(U8)));
+  assert (window != NULL);
+  assert (result->slidingWindow == NULL);
+  result->slidingWindow = window;
+  pthread_barrier_wait (&barrier);
+
+  extractRowsOfOneThread (&workers[0]);
+  pthread_barrier_wait (&barrier);
+  // the table has the size that the serial version's table ends up with
+  Long numItems = 0;
+  U64 allSurprisesORed = 0;
+  for (t = 0; t < numThreads; t++) {
+    numItems += workers[t].numItems;
+    allSurprisesORed |= workers[t].allSurprisesORed;
+  }
+  Short newTableSize = lgK - 4;
+  if (newTableSize < 2) newTableSize = 2;
+  if (newTableSize < u32TableLgSizeForNumItems (numItems)) newTableSize = u32TableLgSizeForNumItems (numItems);
+  assert (newTableSize >= lgNumThreads);
+  u32Table * table = u32TableMake (newTableSize, 6 + lgK);
+  assert (result->surprisingValueTable == NULL);
+  result->surprisingValueTable = table;
+  for (t = 0; t < numThreads; t++) { workers[t].newTable = table; }
+  pthread_barrier_wait (&barrier);
+
+  layOutRowsOfOneThread (&workers[0]);
+  for (t = 1; t < numThreads; t++) { pthread_join (threads[t], NULL); }
+  pthread_barrier_destroy (&barrier);
+
+  for (t = 0; t < numThreads; t++) { table->numItems += workers[t].firstSpilled; }
+  for (t = 0; t < numThreads; t++) {
+    for (j = workers[t].firstSpilled; j < workers[t].numItems; j++) {
+      Boolean isNovel = u32TableMaybeInsert (table, workers[t].items[j]);
+      assert (isNovel == 1);
+    }
+    free (workers[t].items);
+  }
+  assert (table->numItems == numItems && table->lgSize == newTableSize);
+  free (workers);
+  free (threads);
+
+  result->firstInterestingColumn = fastCountTrailingZeros64 (allSurprisesORed);
+  if (result->firstInterestingColumn > offset) result->firstInterestingColumn = offset; // corner case
+
+  result->mergeFlag = 1;
+  refreshUpdateMode (result);
+  return result;
+}
+
+/*******************************************************************************************/
+
+FM85 * ug85GetResultWithThreads (UG85 * unioner, Long numThreads) {
+  assert (unioner != NULL);
+  if (unioner->bitMatrix == NULL) { return (ug85GetResult (unioner)); } // a sparse accumulator is cheap to copy
+  assert (unioner->accumulator == NULL);
+  return (sketchOfBitMatrixWithThreads (unioner->bitMatrix, unioner->lgK, numThreads));
 }
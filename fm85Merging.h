@@ -29,8 +29,21 @@ void ug85Free (UG85 * unioner);
 
 void ug85MergeInto (UG85 * unioner, FM85 * sourceSketch);
 
+// Merges all of the sources, leaving the unioner as a series of ug85MergeInto calls would.
+// Up to numThreads threads (the calling thread is one of them) each take sources one at a time
+// and merge them into their own unioner, and then the partial results are OR'ed together.
+void ug85MergeMany (UG85 * unioner, FM85 ** sources, Long numSources, Long numThreads);
+
 FM85 * ug85GetResult (UG85 * unioner);
 
+FM85 * sketchOfBitMatrix (U64 * matrix, Short lgK); // the flavor must be HYBRID or beyond
+
+// These produce the same sketch as the previous two, but split the work on a bit matrix
+// into ranges of rows that are handled by up to numThreads threads (the calling thread is one of them).
+// The number of threads is rounded down to a power of 2, and each one gets at least 64 rows.
+FM85 * ug85GetResultWithThreads (UG85 * unioner, Long numThreads);
+FM85 * sketchOfBitMatrixWithThreads (U64 * matrix, Short lgK, Long numThreads);
+
 /****************************************/
 
 U64 * bitMatrixOfUG85 (UG85 * self, Boolean * needToFreePtr); // used for testing
@@ -0,0 +1,223 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+#include "common.h"
+#include "fm85Util.h"
+#include "u32Table.h"
+#include "fm85.h"
+#include "fm85Merging.h"
+#include "fm85Partitioned.h"
+
+/*******************************************************/
+// Partition p owns global rows [p * kl, (p+1) * kl), which are its local rows [0, kl).
+// Since the partition index is the top bits of the row, a global rowCol is
+// the partition index followed by the local rowCol.
+
+static void updatePartition (FM85P * self, Long p) {
+  FM85 * part = self->partitions[p];
+  Short lgK = self->lgK;
+  Short lgKl = part->lgK;
+  Long k = (1LL << lgK);
+  U32 localMask = (U32) ((1LL << (lgKl + 6)) - 1);
+
+  // first catch up with the offset of the whole sketch
+  if (part->slidingWindow != NULL && part->windowOffset < self->windowOffset) {
+    moveWindowTo (part, self->windowOffset);
+  }
+
+  U64 * hash0 = self->batchHash0;
+  U64 * hash1 = self->batchHash1;
+  Long n = self->batchLength;
+  Long i;
+  for (i = 0; i < n; i++) {
+    if ((Long) ((hash0[i] & (k - 1)) >> lgKl) != p) continue; // another thread's row
+    U32 rowCol = rowColFromTwoHashes (hash0[i], hash1[i], lgK);
+    fm85RowColUpdate (part, rowCol & localMask);
+  }
+}
+
+/*******************************************************/
+
+static void * workerMain (void * arg) {
+  FM85PW * worker = (FM85PW *) arg;
+  FM85P * self = worker->engine;
+  while (1) {
+    pthread_barrier_wait (&self->batchStart);
+    if (self->stopping) break;
+    updatePartition (self, worker->partition);
+    pthread_barrier_wait (&self->batchEnd);
+  }
+  return (NULL);
+}
+
+/*******************************************************/
+
+FM85P * fm85PartitionedMake (Short lgK, Short lgNumPartitions) {
+  assert (lgNumPartitions >= 0);
+  assert (lgK - lgNumPartitions >= 4 && lgK <= 26);
+  FM85P * self = (FM85P *) malloc (sizeof(FM85P));
+  assert (self != NULL);
+  Long numPartitions = (1LL << lgNumPartitions);
+  self->lgK = lgK;
+  self->lgNumPartitions = lgNumPartitions;
+  self->numCoupons = 0;
+  self->windowOffset = 0;
+  self->partitions = (FM85 **) malloc (((size_t) numPartitions) * sizeof(FM85 *));
+  assert (self->partitions != NULL);
+  Long p;
+  for (p = 0; p < numPartitions; p++) {
+    self->partitions[p] = fm85Make (lgK - lgNumPartitions);
+    fm85DeferOffsets (self->partitions[p], 1);
+  }
+
+  self->batchHash0 = (U64 *) NULL;
+  self->batchHash1 = (U64 *) NULL;
+  self->batchLength = 0;
+  self->stopping = 0;
+  pthread_barrier_init (&self->batchStart, NULL, (unsigned) numPartitions);
+  pthread_barrier_init (&self->batchEnd, NULL, (unsigned) numPartitions);
+  self->workers = (pthread_t *) malloc (((size_t) numPartitions) * sizeof(pthread_t));
+  self->workerArgs = (FM85PW *) malloc (((size_t) numPartitions) * sizeof(FM85PW));
+  assert (self->workers != NULL && self->workerArgs != NULL);
+  for (p = 1; p < numPartitions; p++) {
+    self->workerArgs[p].engine = self;
+    self->workerArgs[p].partition = p;
+    if (pthread_create (&self->workers[p], NULL, workerMain, (void *) &self->workerArgs[p]) != 0) {
+      FATAL_ERROR ("pthread_create failed");
+    }
+  }
+  return (self);
+}
+
+/*******************************************************/
+
+void fm85PartitionedFree (FM85P * self) {
+  if (self == NULL) return;
+  Long numPartitions = (1LL << self->lgNumPartitions);
+  Long p;
+  self->stopping = 1;
+  pthread_barrier_wait (&self->batchStart);
+  for (p = 1; p < numPartitions; p++) { pthread_join (self->workers[p], NULL); }
+  pthread_barrier_destroy (&self->batchStart);
+  pthread_barrier_destroy (&self->batchEnd);
+  for (p = 0; p < numPartitions; p++) { fm85Free (self->partitions[p]); }
+  free (self->partitions);
+  free (self->workers);
+  free (self->workerArgs);
+  free (self);
+}
+
+/*******************************************************/
+// The barriers order the caller's writes before the workers' reads, and vice versa.
+
+void fm85PartitionedUpdateBatch (FM85P * self, U64 * hash0, U64 * hash1, Long n) {
+  Long numPartitions = (1LL << self->lgNumPartitions);
+  self->batchHash0 = hash0;
+  self->batchHash1 = hash1;
+  self->batchLength = n;
+  pthread_barrier_wait (&self->batchStart);
+  updatePartition (self, 0);
+  pthread_barrier_wait (&self->batchEnd);
+
+  Long c = 0;
+  Long p;
+  for (p = 0; p < numPartitions; p++) { c += self->partitions[p]->numCoupons; }
+  self->numCoupons = c;
+  self->windowOffset = determineCorrectOffset (self->lgK, c);
+}
+
+/*******************************************************/
+
+Long fm85PartitionedNumCoupons (FM85P * self) {
+  return (self->numCoupons);
+}
+
+/*******************************************************/
+// When the whole sketch is windowed, so is nearly every partition, and the result
+// can be stitched together from their windows and tables. Otherwise, and in the
+// rare case of a partition that is still SPARSE, it is rebuilt from the bit matrix.
+
+static FM85 * resultOfBitMatrices (FM85P * self) {
+  Short lgK = self->lgK;
+  Long k = (1LL << lgK);
+  Long numPartitions = (1LL << self->lgNumPartitions);
+  Long kl = k / numPartitions;
+  U64 * matrix = (U64 *) malloc ((size_t) (k * sizeof(U64)));
+  assert (matrix != NULL);
+  Long p;
+  for (p = 0; p < numPartitions; p++) {
+    U64 * partMatrix = bitMatrixOfSketch (self->partitions[p]);
+    memcpy ((void *) (matrix + p * kl), (void *) partMatrix, (size_t) (kl * sizeof(U64)));
+    free (partMatrix);
+  }
+
+  FM85 * result;
+  if (determineFlavor (lgK, self->numCoupons) >= HYBRID) {
+    result = sketchOfBitMatrix (matrix, lgK);
+  }
+  else { // there are few enough coupons to simply replay them
+    result = fm85Make (lgK);
+    Long i;
+    for (i = 0; i < k; i++) {
+      U64 pattern = matrix[i];
+      while (pattern != 0) {
+	Short col = fastCountTrailingZeros64 (pattern);
+	pattern = pattern ^ (1ULL << col);
+	fm85RowColUpdate (result, (U32) ((i << 6) | col));
+      }
+    }
+    result->mergeFlag = 1;
+  }
+  free (matrix);
+  assert (result->numCoupons == self->numCoupons);
+  return (result);
+}
+
+FM85 * fm85PartitionedGetResult (FM85P * self) {
+  Short lgK = self->lgK;
+  Long k = (1LL << lgK);
+  Long numPartitions = (1LL << self->lgNumPartitions);
+  Long kl = k / numPartitions;
+  Short offset = self->windowOffset;
+  Long p;
+
+  if (determineFlavor (lgK, self->numCoupons) < HYBRID) { return (resultOfBitMatrices (self)); }
+  Long numItems = 0;
+  for (p = 0; p < numPartitions; p++) {
+    FM85 * part = self->partitions[p];
+    if (part->slidingWindow == NULL) { return (resultOfBitMatrices (self)); }
+    if (part->windowOffset < offset) { moveWindowTo (part, offset); }
+    numItems += part->surprisingValueTable->numItems;
+  }
+
+  FM85 * result = fm85Make (lgK);
+  result->numCoupons = self->numCoupons;
+  result->windowOffset = offset;
+  U8 * window = (U8 *) malloc ((size_t) (k * sizeof(U8)));
+  assert (window != NULL);
+  result->slidingWindow = window;
+  u32Table * table = u32TableMake (u32TableLgSizeForNumItems (numItems), 6 + lgK);
+  result->surprisingValueTable = table;
+
+  for (p = 0; p < numPartitions; p++) {
+    FM85 * part = self->partitions[p];
+    memcpy ((void *) (window + p * kl), (void *) part->slidingWindow, (size_t) kl);
+    U32 prefix = (U32) (p << (part->lgK + 6));
+    int half;
+    for (half = 0; half < 2; half++) {
+      Long numSlots;
+      U32 * slots = u32TableSlotsOfPart (part->surprisingValueTable, half, &numSlots);
+      Long i;
+      for (i = 0; i < numSlots; i++) {
+	if (slots[i] != ALL32BITS) {
+	  Boolean isNovel = u32TableMaybeInsert (table, prefix | slots[i]);
+	  assert (isNovel == 1);
+	}
+      }
+    }
+  }
+
+  result->firstInterestingColumn = calculateFirstInterestingColumnOfTable (table, offset);
+  result->mergeFlag = 1;
+  refreshUpdateMode (result);
+  return (result);
+}
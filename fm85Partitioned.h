@@ -0,0 +1,72 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+// A row-partitioned update engine. The k rows of the bit matrix are split into
+// P = 2^lgNumPartitions equal ranges, and each range is an ordinary FM85 sketch
+// of k/P rows that is only ever touched by its own thread, so the updates need
+// no atomics or locks. The input arrives in batches, which every thread scans
+// for the items whose rows it owns.
+//
+// Only numCoupons and windowOffset are global. The partitions defer their own
+// offsets, and between batches each one moves its window to the offset that is
+// correct for the whole sketch. So at the end of a batch the partitions can be
+// laid end to end to form the sketch that a single thread would have built.
+//
+// The caller's thread serves as partition 0, and the other P - 1 threads wait
+// at a barrier between batches.
+
+#ifndef GOT_FM85_PARTITIONED_H
+#include <pthread.h>
+
+#include "common.h"
+#include "fm85.h"
+
+/*******************************************************/
+
+struct fm85_partitioned_sketch_type;
+
+typedef struct fm85_partition_worker_type
+{
+  struct fm85_partitioned_sketch_type * engine;
+  Long partition;
+} FM85PW;
+
+typedef struct fm85_partitioned_sketch_type
+{
+  Short lgK;
+  Short lgNumPartitions;
+  FM85 ** partitions;    // Each one has lgK - lgNumPartitions.
+  Long numCoupons;       // The total, as of the end of the latest batch.
+  Short windowOffset;    // The correct offset for that total.
+
+  pthread_t * workers;   // Threads for partitions 1 through P - 1.
+  FM85PW * workerArgs;
+  pthread_barrier_t batchStart;
+  pthread_barrier_t batchEnd;
+  U64 * batchHash0;      // The current batch, which every thread reads.
+  U64 * batchHash1;
+  Long batchLength;
+  Boolean stopping;
+} FM85P;
+
+/*******************************************************/
+
+// Requires lgK - lgNumPartitions >= 4.
+FM85P * fm85PartitionedMake (Short lgK, Short lgNumPartitions);
+
+void fm85PartitionedFree (FM85P * self); // Also stops the threads.
+
+// Same result as calling fm85Update() n times. Only one thread may call this at a time.
+// Since the partitions only catch up with the global offset between batches, a batch
+// shouldn't add more than a few K coupons (see fm85DeferOffsets).
+void fm85PartitionedUpdateBatch (FM85P * self, U64 * hash0, U64 * hash1, Long n);
+
+Long fm85PartitionedNumCoupons (FM85P * self);
+
+// Assembles an ordinary sketch from the partitions. It has mergeFlag set,
+// because the partitions can't maintain a HIP estimate for the whole sketch.
+FM85 * fm85PartitionedGetResult (FM85P * self);
+
+/*******************************************************/
+
+#define GOT_FM85_PARTITIONED_H
+#endif
@@ -0,0 +1,157 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+#include "common.h"
+#include "fm85.h"
+#include "fm85Merging.h"
+#include "fm85Sharded.h"
+
+/*******************************************************/
+
+FM85S * fm85ShardedMake (Short lgK, Long numShards) {
+  assert (lgK >= 4 && lgK <= 26);
+  assert (numShards >= 1);
+  FM85S * self = (FM85S *) malloc (sizeof(FM85S));
+  assert (self != NULL);
+  FM85Shard * shards = (FM85Shard *) malloc (((size_t) numShards) * sizeof(FM85Shard));
+  assert (shards != NULL);
+  Long i;
+  for (i = 0; i < numShards; i++) {
+    shards[i].sketch = fm85Make (lgK);
+    shards[i].handOffWanted = 0;
+    shards[i].handedOff = (FM85HO *) NULL;
+  }
+  self->lgK = lgK;
+  self->numShards = numShards;
+  self->shards = shards;
+
+  pthread_mutex_init (&self->foldLock, NULL);
+  self->unioner = ug85Make (lgK);
+  self->numFolds = 0;
+
+  pthread_mutex_init (&self->resultLock, NULL);
+  self->result = fm85Make (lgK);
+  self->result->mergeFlag = 1;
+
+  self->folderRunning = 0;
+  self->folderStop = 0;
+  self->foldIntervalMillis = 0;
+  return (self);
+}
+
+/*******************************************************/
+
+void fm85ShardedFree (FM85S * self) {
+  if (self == NULL) return;
+  fm85ShardedStopFolding (self);
+  Long i;
+  for (i = 0; i < self->numShards; i++) {
+    fm85Free (self->shards[i].sketch);
+    FM85HO * node = self->shards[i].handedOff;
+    while (node != NULL) {
+      FM85HO * next = node->next;
+      fm85Free (node->sketch);
+      free (node);
+      node = next;
+    }
+  }
+  free (self->shards);
+  ug85Free (self->unioner);
+  fm85Free (self->result);
+  pthread_mutex_destroy (&self->foldLock);
+  pthread_mutex_destroy (&self->resultLock);
+  free (self);
+}
+
+/*******************************************************/
+// The owner pushes onto the stack, and a fold takes the whole stack at once,
+// so the only race is between a push and a take, which the CAS resolves.
+
+void fm85ShardedFlush (FM85S * self, Long shardId) {
+  assert (shardId >= 0 && shardId < self->numShards);
+  FM85Shard * shard = &(self->shards[shardId]);
+  __atomic_store_n (&shard->handOffWanted, 0, __ATOMIC_RELAXED);
+  if (shard->sketch->numCoupons == 0) return; // there is nothing to hand off
+  FM85HO * node = (FM85HO *) malloc (sizeof(FM85HO));
+  assert (node != NULL);
+  node->sketch = shard->sketch;
+  node->next = __atomic_load_n (&shard->handedOff, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&shard->handedOff, &node->next, node, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+  shard->sketch = fm85Make (self->lgK);
+}
+
+/*******************************************************/
+
+void fm85ShardedUpdate (FM85S * self, Long shardId, U64 hash0, U64 hash1) {
+  assert (shardId >= 0 && shardId < self->numShards);
+  FM85Shard * shard = &(self->shards[shardId]);
+  if (__atomic_load_n (&shard->handOffWanted, __ATOMIC_RELAXED)) { fm85ShardedFlush (self, shardId); }
+  fm85Update (shard->sketch, hash0, hash1);
+}
+
+/*******************************************************/
+
+void fm85ShardedFold (FM85S * self) {
+  pthread_mutex_lock (&self->foldLock);
+  Long i;
+  for (i = 0; i < self->numShards; i++) {
+    FM85Shard * shard = &(self->shards[i]);
+    FM85HO * node = __atomic_exchange_n (&shard->handedOff, (FM85HO *) NULL, __ATOMIC_ACQUIRE);
+    while (node != NULL) {
+      FM85HO * next = node->next;
+      ug85MergeInto (self->unioner, node->sketch);
+      fm85Free (node->sketch);
+      free (node);
+      node = next;
+    }
+    __atomic_store_n (&shard->handOffWanted, 1, __ATOMIC_RELAXED); // for the next fold
+  }
+  FM85 * newResult = ug85GetResult (self->unioner);
+  self->numFolds += 1;
+
+  // This is still under foldLock, so that the folds publish their results in order.
+  pthread_mutex_lock (&self->resultLock);
+  FM85 * oldResult = self->result;
+  self->result = newResult;
+  pthread_mutex_unlock (&self->resultLock);
+  pthread_mutex_unlock (&self->foldLock);
+  fm85Free (oldResult);
+}
+
+/*******************************************************/
+
+FM85 * fm85ShardedGetResult (FM85S * self) {
+  pthread_mutex_lock (&self->resultLock);
+  FM85 * copy = fm85Copy (self->result);
+  pthread_mutex_unlock (&self->resultLock);
+  return (copy);
+}
+
+/*******************************************************/
+
+static void * folderMain (void * arg) {
+  FM85S * self = (FM85S *) arg;
+  struct timespec interval;
+  interval.tv_sec = self->foldIntervalMillis / 1000;
+  interval.tv_nsec = (self->foldIntervalMillis % 1000) * 1000000;
+  while (!__atomic_load_n (&self->folderStop, __ATOMIC_ACQUIRE)) {
+    nanosleep (&interval, NULL);
+    fm85ShardedFold (self);
+  }
+  return (NULL);
+}
+
+void fm85ShardedStartFolding (FM85S * self, Long intervalMillis) {
+  assert (intervalMillis >= 0);
+  if (self->folderRunning) { FATAL_ERROR ("the sharded sketch is already being folded"); }
+  self->foldIntervalMillis = intervalMillis;
+  self->folderStop = 0;
+  if (pthread_create (&self->folder, NULL, folderMain, (void *) self) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  self->folderRunning = 1;
+}
+
+void fm85ShardedStopFolding (FM85S * self) {
+  if (!self->folderRunning) return;
+  __atomic_store_n (&self->folderStop, 1, __ATOMIC_RELEASE);
+  pthread_join (self->folder, NULL);
+  self->folderRunning = 0;
+}
@@ -0,0 +1,82 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+// A sharded sketch holds one ordinary FM85 per worker thread, which that
+// thread updates without any synchronization. The shards are folded into
+// a UG85 with ug85MergeInto(), either on demand or periodically by a
+// background thread, and queries read the result of the latest fold.
+//
+// A fold can't read a shard while its owner is updating it. Instead, each
+// fold asks every worker to hand off its current sketch, which the worker
+// does at its next update (or when it calls fm85ShardedFlush) by starting
+// a fresh sketch, and the following fold merges whatever has been handed
+// off. So a fold includes everything up to each worker's latest hand-off.
+
+#ifndef GOT_FM85_SHARDED_H
+#include <pthread.h>
+
+#include "common.h"
+#include "fm85.h"
+#include "fm85Merging.h"
+
+/*******************************************************/
+
+typedef struct fm85_handed_off_type
+{
+  FM85 * sketch;
+  struct fm85_handed_off_type * next;
+} FM85HO;
+
+// Each shard is on its own cache lines.
+typedef struct fm85_shard_type
+{
+  FM85 * sketch;         // Only touched by the shard's own thread.
+  Long handOffWanted;    // Set by each fold.
+  FM85HO * handedOff;    // A stack of sketches that are waiting for the next fold.
+  Long unused[5];
+} FM85Shard;
+
+typedef struct fm85_sharded_sketch_type
+{
+  Short lgK;
+  Long numShards;
+  FM85Shard * shards;
+
+  pthread_mutex_t foldLock;   // Protects the unioner.
+  UG85 * unioner;             // Everything that has been folded so far.
+  Long numFolds;
+
+  pthread_mutex_t resultLock; // Protects the result. It is taken inside foldLock to replace it.
+  FM85 * result;              // The result of the latest fold.
+
+  pthread_t folder;           // The background thread, if folderRunning.
+  Boolean folderRunning;
+  Long folderStop;
+  Long foldIntervalMillis;
+} FM85S;
+
+/*******************************************************/
+
+FM85S * fm85ShardedMake (Short lgK, Long numShards);
+
+void fm85ShardedFree (FM85S * self); // Also stops the background thread.
+
+// Each shard must only be updated (and flushed) by one thread at a time.
+void fm85ShardedUpdate (FM85S * self, Long shardId, U64 hash0, U64 hash1);
+
+// Hands off the shard's sketch now, for example when its thread is about to go idle.
+void fm85ShardedFlush (FM85S * self, Long shardId);
+
+// The following can be called by any thread.
+
+void fm85ShardedFold (FM85S * self);
+
+void fm85ShardedStartFolding (FM85S * self, Long intervalMillis);
+void fm85ShardedStopFolding (FM85S * self);
+
+// Returns a copy of the latest fold's result, which has mergeFlag set.
+FM85 * fm85ShardedGetResult (FM85S * self);
+
+/*******************************************************/
+
+#define GOT_FM85_SHARDED_H
+#endif
@@ -113,20 +113,44 @@ Short calculateFirstInterestingColumn (FM85 * self) {
   if (offset == 0) return 0;
   u32Table * table = self->surprisingValueTable;
   assert (table != NULL);
-  U32 * slots = table->slots;
-  Long numSlots = (1LL << table->lgSize); 
   Long i;
   Short result = offset;
-  for (i = 0; i < numSlots; i++) { 
-    U32 rowCol = slots[i];
-    if (rowCol != ALL32BITS) {
-      Short col = (Short) (rowCol & 63);
-      if (col < result) { result = col; }
+  int part;
+  for (part = 0; part < 2; part++) {
+    Long numSlots;
+    U32 * slots = u32TableSlotsOfPart (table, part, &numSlots);
+    for (i = 0; i < numSlots; i++) { 
+      U32 rowCol = slots[i];
+      if (rowCol != ALL32BITS) {
+	Short col = (Short) (rowCol & 63);
+	if (col < result) { result = col; }
+      }
     }
   }
   return(result);
 }
 
+/*******************************************************/
+// This calculates the exact value of the KXP register from scratch,
+// in the same 128-bit fixed-point format that the sketch uses.
+
+void calculateKXPOfMatrix (U64 * matrix, Long k, U64 * kxpHi, U64 * kxpLo) {
+  U64 hi = 0;
+  U64 lo = 0;
+  Long i;
+  Short col;
+  for (i = 0; i < k; i++) {
+    U64 rowSum = 0; // at most 2^64 - 1 units of 2^-64
+    for (col = 0; col < 64; col++) {
+      if (((matrix[i] >> col) & 1) == 0) { rowSum |= (1ULL << (63 - col)); } // note the inverted logic
+    }
+    lo += rowSum;
+    if (lo < rowSum) { hi += 1; } // carry
+  }
+  *kxpHi = hi;
+  *kxpLo = lo;
+}
+
 /*******************************************************/
 /*******************************************************/
 // This is used for testing, especially of the merging code.
@@ -158,17 +182,21 @@ void assertSketchesEqual (FM85 * sk1, FM85 * sk2, Boolean sk2WasMerged) {
 
   if (sk1->slidingWindow != NULL || sk2->slidingWindow != NULL) {
     assert (sk1->slidingWindow != NULL && sk2->slidingWindow != NULL);
-    compareByteArrays (sk1->slidingWindow, sk2->slidingWindow, k);
+    Long row; // either window might still be partly in a snapshot's
+    for (row = 0; row < k; row++) {
+      if (windowOfRow (sk1, row)[row] != windowOfRow (sk2, row)[row]) { FATAL_ERROR ("The U8 arrays don't match"); }
+    }
   }
 
+  assert (sk1->lgCompressedSegments == sk2->lgCompressedSegments);
   if (sk1->compressedWindow != NULL || sk2->compressedWindow != NULL) {
     assert (sk1->compressedWindow != NULL && sk2->compressedWindow != NULL);
-    compareU32Arrays (sk1->compressedWindow, sk2->compressedWindow, k);
+    compareU32Arrays (sk1->compressedWindow, sk2->compressedWindow, sk1->cwLength);
   }
 
   if (sk1->compressedSurprisingValues != NULL || sk2->compressedSurprisingValues != NULL) {
     assert (sk1->compressedSurprisingValues != NULL && sk2->compressedSurprisingValues != NULL);
-    compareU32Arrays (sk1->compressedSurprisingValues, sk2->compressedSurprisingValues, k);
+    compareU32Arrays (sk1->compressedSurprisingValues, sk2->compressedSurprisingValues, sk1->csvLength);
   }
 
   if (sk2WasMerged) {
@@ -180,9 +208,10 @@ void assertSketchesEqual (FM85 * sk1, FM85 * sk2, Boolean sk2WasMerged) {
   else {
     assert (sk1->mergeFlag == sk2->mergeFlag);
     assert (sk1->firstInterestingColumn == sk2->firstInterestingColumn);
-    assert (sk1->kxp == sk2->kxp);                 // TODO: deal with the 
-    assert (sk1->hipEstAccum == sk2->hipEstAccum); // floating point issues
-    assert (sk1->hipErrAccum == sk2->hipErrAccum); // involving these three.
+    assert (sk1->kxpHi == sk2->kxpHi);
+    assert (sk1->kxpLo == sk2->kxpLo);
+    assert (sk1->hipEstAccum == sk2->hipEstAccum);
+    assert (sk1->hipErrAccum == sk2->hipErrAccum);
   }
 
 }
@@ -22,6 +22,8 @@ void simple85Free (SIMPLE85 * self);
 
 void simple85Update (SIMPLE85 * self, U64 hash0, U64 hash1);
 
+void simple85RowColUpdate (SIMPLE85 * self, U32 rowCol);
+
 /*******************************************************/
 
 void getTwoRandomHashes (U64 twoHashes[]);
@@ -35,6 +37,12 @@ void compareByteArrays(U8 * arr1, U8 * arr2, Long arrlen);
 void compareU32Arrays(U32 * arr1, U32 * arr2, Long arrlen);
 void compareU64Arrays(U64 * arr1, U64 * arr2, Long arrlen);
 
+// the exact value of a bit matrix's KXP register
+void calculateKXPOfMatrix (U64 * matrix, Long k, U64 * kxpHi, U64 * kxpLo);
+
+// the exact value, which the sketch's firstInterestingColumn must never exceed
+Short calculateFirstInterestingColumn (FM85 * self);
+
 // for testing, especially of the merging code
 void assertSketchesEqual (FM85 * sk1, FM85 * sk2, Boolean sk2WasMerged);
 
@@ -9,10 +9,6 @@ extern double invPow2Tab[];
 
 void fillInvPow2Tab (void);
 
-extern double kxpByteLookup[];
-
-void fillKxpByteLookup(void);
-
 extern U8 byteTrailingZerosTable[];
 
 void fillByteLeadingZerosTable(void);
@@ -21,6 +17,40 @@ void fillByteTrailingZerosTable(void);
 Short countLeadingZerosInUnsignedLong  (U64 theInput);
 Short countTrailingZerosInUnsignedLong (U64 theInput);
 
+/******************************************/
+// These are the fast versions of the bit-scan and population-count primitives.
+// With GCC or Clang they compile to single instructions (LZCNT, TZCNT, POPCNT when
+// the target allows it, otherwise BSR, BSF, and short instruction sequences).
+// Other compilers get the portable table-driven versions above.
+// Unlike the builtins, these are well-defined for a zero input.
+
+static inline Short fastCountLeadingZeros64 (U64 x) { // returns 64 when x == 0
+#ifdef __GNUC__
+  return ((x == 0) ? 64 : (Short) __builtin_clzll (x));
+#else
+  return (countLeadingZerosInUnsignedLong (x));
+#endif
+}
+
+static inline Short fastCountTrailingZeros64 (U64 x) { // returns 64 when x == 0
+#ifdef __GNUC__
+  return ((x == 0) ? 64 : (Short) __builtin_ctzll (x));
+#else
+  return (countTrailingZerosInUnsignedLong (x));
+#endif
+}
+
+static inline Short fastCountTrailingZeros8 (U8 x) { // returns 8 when x == 0
+#ifdef __GNUC__
+  return ((Short) __builtin_ctz (((unsigned int) x) | 0x100));
+#else
+  return ((Short) byteTrailingZerosTable[x]);
+#endif
+}
+
+// Call this once at startup (fm85Init does) to select the best bulk bit-counting routine.
+void selectBitCountingRoutines (void);
+
 Long divideLongsRoundingUp (Long x, Long y);
 
 // for delta-encoding an instance of (n choose m)
@@ -28,6 +58,10 @@ Long golombChooseNumberOfBaseBits (Long n, Long m);
 
 Long countBitsSetInMatrix (U64 * array, Long length);
 
+// These are exported so that the alternatives can be timed against each other.
+Long csaCountBitsSetInMatrix (U64 * array, Long length);
+Long popcntCountBitsSetInMatrix (U64 * array, Long length);
+
 /******************************************/
 
 #define GOT_FM85_UTIL_H
@@ -0,0 +1,85 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+/* This is a manually inlined version of MurmurHash3_x64_128(), which was
+   written by Austin Appleby and placed in the public domain. The only
+   change is that the seed is 64 bits wide, so that both halves of the
+   hash state can be seeded. With a seed below 2^32 the output is
+   identical to the original. The input is read in little-endian order. */
+
+#include <string.h>
+
+/* do not use MURMUR_ROTL64 with shift = 0 or shift = 64 */
+#define MURMUR_ROTL64(val,shift) (((val) << (shift)) | ((val) >> (64 - (shift))))
+
+static inline u_int64_t murmurFmix64 (u_int64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline void MurmurHash3_x64_128 (const void * key, size_t len, u_int64_t seed, u_int64_t out[2])
+{
+  const u_int8_t * data = (const u_int8_t *) key;
+  const size_t nblocks = len / 16;
+  const u_int64_t c1 = 0x87c37b91114253d5ULL;
+  const u_int64_t c2 = 0x4cf5ad432745937fULL;
+  u_int64_t h1 = seed;
+  u_int64_t h2 = seed;
+  u_int64_t k1, k2;
+  size_t i;
+
+  for (i = 0; i < nblocks; i++) {
+    memcpy (&k1, data + 16*i, 8);     // memcpy avoids unaligned loads
+    memcpy (&k2, data + 16*i + 8, 8);
+
+    k1 *= c1; k1 = MURMUR_ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+    h1 = MURMUR_ROTL64(h1,27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+    k2 *= c2; k2 = MURMUR_ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+    h2 = MURMUR_ROTL64(h2,31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  const u_int8_t * tail = data + 16*nblocks;
+  k1 = 0;
+  k2 = 0;
+
+  switch (len & 15) {
+  case 15: k2 ^= ((u_int64_t) tail[14]) << 48; /* fall through */
+  case 14: k2 ^= ((u_int64_t) tail[13]) << 40; /* fall through */
+  case 13: k2 ^= ((u_int64_t) tail[12]) << 32; /* fall through */
+  case 12: k2 ^= ((u_int64_t) tail[11]) << 24; /* fall through */
+  case 11: k2 ^= ((u_int64_t) tail[10]) << 16; /* fall through */
+  case 10: k2 ^= ((u_int64_t) tail[ 9]) << 8;  /* fall through */
+  case  9: k2 ^= ((u_int64_t) tail[ 8]) << 0;
+    k2 *= c2; k2 = MURMUR_ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+    /* fall through */
+  case  8: k1 ^= ((u_int64_t) tail[ 7]) << 56; /* fall through */
+  case  7: k1 ^= ((u_int64_t) tail[ 6]) << 48; /* fall through */
+  case  6: k1 ^= ((u_int64_t) tail[ 5]) << 40; /* fall through */
+  case  5: k1 ^= ((u_int64_t) tail[ 4]) << 32; /* fall through */
+  case  4: k1 ^= ((u_int64_t) tail[ 3]) << 24; /* fall through */
+  case  3: k1 ^= ((u_int64_t) tail[ 2]) << 16; /* fall through */
+  case  2: k1 ^= ((u_int64_t) tail[ 1]) << 8;  /* fall through */
+  case  1: k1 ^= ((u_int64_t) tail[ 0]) << 0;
+    k1 *= c1; k1 = MURMUR_ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= (u_int64_t) len;
+  h2 ^= (u_int64_t) len;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = murmurFmix64(h1);
+  h2 = murmurFmix64(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  out[0] = h1;
+  out[1] = h2;
+}
@@ -2,9 +2,9 @@
 
 /*
 
-  gcc -O3 -Wall -pedantic -o testAll u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testAll.c
+  gcc -O3 -Wall -pedantic -o testAll u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testAll.c -lpthread
 
-  gcc --coverage -g -O0 -Wall -pedantic -o coverAll u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testAll.c
+  gcc --coverage -g -O0 -Wall -pedantic -o coverAll u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testAll.c -lpthread
 
 */
 
@@ -60,6 +60,29 @@ void streamingDoAStreamLength (Short lgK, Long n) {
     compareU64Arrays (matrix, simple->bitMatrix, k);
     free (matrix);
 
+    U64 kxpHi, kxpLo;
+    calculateKXPOfMatrix (simple->bitMatrix, k, &kxpHi, &kxpLo);
+    assert (sketch->kxpHi == kxpHi && sketch->kxpLo == kxpLo);
+
+    // the next threshold is exactly where the flavor or the offset changes
+    Long t = sketch->nextThreshold;
+    if (flavor == EMPTY) { assert (sketch->updateMode == UPDATE_EMPTY); }
+    else if (flavor == SPARSE) {
+      assert (sketch->updateMode == UPDATE_SPARSE);
+      assert (determineFlavor (lgK, t - 1) == SPARSE && determineFlavor (lgK, t) == HYBRID);
+    }
+    else {
+      assert (sketch->updateMode == UPDATE_WINDOWED);
+      assert (determineCorrectOffset (lgK, t - 1) == offset && determineCorrectOffset (lgK, t) == offset + 1);
+    }
+
+    if (sketch->blockFirstInterestingColumn != NULL) { // each block's bound must not exceed any of its rows' first 0
+      for (i = 0; i < k; i++) {
+	Short firstZero = fastCountTrailingZeros64 (~(simple->bitMatrix[i]));
+	assert (sketch->blockFirstInterestingColumn[i >> FM85_LG_ROWS_PER_BLOCK] <= firstZero);
+      }
+    }
+
     fm85Free (sketch);
     simple85Free (simple);
   }
@@ -191,6 +214,738 @@ void compressionMain (int argc, char ** argv) {
 
 }
 
+/***************************************************************/
+/***************************************************************/
+// Batch Updates
+
+void batchDoAStreamLength (Short lgK, Long n) {
+  U64 * hash0 = (U64 *) malloc (((size_t) (n + 1)) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) (n + 1)) * sizeof(U64));
+  assert (hash0 != NULL && hash1 != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+  }
+
+  FM85 * sketchS = fm85Make (lgK); // sequential
+  FM85 * sketchB = fm85Make (lgK); // batch
+  for (i = 0; i < n; i++) { fm85Update (sketchS, hash0[i], hash1[i]); }
+  fm85UpdateBatch (sketchB, hash0, hash1, n);
+
+  printf ("%d %lld (%lld %d)", lgK, n, sketchS->numCoupons, (int) determineSketchFlavor (sketchS));
+  assertSketchesEqual (sketchS, sketchB, (Boolean) 0);
+  printf (" okay\n"); fflush (stdout);
+
+  fm85Free (sketchS);
+  fm85Free (sketchB);
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+
+void batchMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    batchDoAStreamLength (lgK, num_items);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+}
+
+/***************************************************************/
+/***************************************************************/
+// Single-Hash and Raw-Item Updates
+
+void itemsDoAStreamLength (Short lgK, Long n) {
+  Long k = (1ULL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch1 = fm85Make (lgK);
+  SIMPLE85 * simple = simple85Make (lgK);
+  FM85 * sketchU = fm85Make (lgK);
+  FM85 * sketchB = fm85Make (lgK);
+  Long i;
+
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85UpdateOneHash    (sketch1, twoHashes[0]);
+    simple85RowColUpdate (simple, rowColFromOneHash (twoHashes[0], lgK));
+    U64 item = (U64) i;
+    fm85UpdateU64   (sketchU, item);
+    fm85UpdateBytes (sketchB, (void *) &item, sizeof(U64));
+  }
+
+  assert (sketch1->numCoupons == simple->numCoupons);
+  U64 * matrix = bitMatrixOfSketch (sketch1);
+  compareU64Arrays (matrix, simple->bitMatrix, k);
+  free (matrix);
+
+  assertSketchesEqual (sketchU, sketchB, (Boolean) 0);
+  Long c = sketchU->numCoupons;
+  for (i = 0; i < n; i++) { fm85UpdateU64 (sketchU, (U64) i); } // duplicates change nothing
+  assert (sketchU->numCoupons == c);
+
+  printf ("%d %lld (%lld %lld %.3f) okay\n", lgK, n, sketch1->numCoupons, c, getHIPEstimate (sketchU));
+  fflush (stdout);
+
+  fm85Free (sketch1);
+  simple85Free (simple);
+  fm85Free (sketchU);
+  fm85Free (sketchB);
+}
+
+/***************************************************************/
+
+void itemsMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    itemsDoAStreamLength (lgK, num_items);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+}
+
+/***************************************************************/
+/***************************************************************/
+// Amortized Window Shifts
+
+void amortizedDoAStreamLength (Short lgK, Long n, Long budget) {
+  Long k = (1ULL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketchS = fm85Make (lgK); // shifts all at once
+  FM85 * sketchA = fm85Make (lgK); // amortized
+  SIMPLE85 * simple = simple85Make (lgK);
+  fm85SetShiftBudget (sketchA, budget);
+  Long i;
+
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update     (sketchS, twoHashes[0], twoHashes[1]);
+    fm85Update     (sketchA, twoHashes[0], twoHashes[1]);
+    simple85Update (simple,  twoHashes[0], twoHashes[1]);
+  }
+
+  // The amortized sketch may still be in the middle of a shift here.
+  Boolean inProgress = (sketchA->shiftCursor != FM85_NO_SHIFT_IN_PROGRESS);
+  printf ("%d %lld %lld (%lld %d)", lgK, n, budget, sketchA->numCoupons, (int) inProgress);
+  assert (sketchA->numCoupons == simple->numCoupons);
+  assert (sketchA->hipEstAccum == sketchS->hipEstAccum);
+  U64 * matrix = bitMatrixOfSketch (sketchA);
+  compareU64Arrays (matrix, simple->bitMatrix, k);
+  free (matrix);
+
+  fm85FinishShift (sketchA);
+  // The two sketches may have computed their lower bounds at different times,
+  // so their values of firstInterestingColumn can legitimately differ.
+  assert (sketchA->firstInterestingColumn <= calculateFirstInterestingColumn (sketchA));
+  assert (sketchS->firstInterestingColumn <= calculateFirstInterestingColumn (sketchS));
+  sketchA->firstInterestingColumn = sketchS->firstInterestingColumn;
+  assertSketchesEqual (sketchS, sketchA, (Boolean) 0);
+  printf (" okay\n"); fflush (stdout);
+
+  fm85Free (sketchS);
+  fm85Free (sketchA);
+  simple85Free (simple);
+}
+
+/***************************************************************/
+// With the smallest budget, the scan for firstInterestingColumn takes many updates,
+// and the updates can move the table's items while it is going on. So this checks the
+// sketch against the simple one after every update, in many short streams.
+
+void amortizedCheckEveryUpdate (Short lgK, Long numStreams, Long n) {
+  U64 twoHashes[2]; // allocated on the stack
+  Long stream, i;
+  for (stream = 0; stream < numStreams; stream++) {
+    FM85 * sketch = fm85Make (lgK);
+    SIMPLE85 * simple = simple85Make (lgK);
+    fm85SetShiftBudget (sketch, 1);
+    for (i = 0; i < n; i++) {
+      getTwoRandomHashes (twoHashes);
+      fm85Update     (sketch, twoHashes[0], twoHashes[1]);
+      simple85Update (simple, twoHashes[0], twoHashes[1]);
+      if (sketch->numCoupons != simple->numCoupons) { FATAL_ERROR ("amortized shift lost a coupon"); }
+      if (sketch->surprisingValueTable != NULL &&
+	  sketch->firstInterestingColumn > calculateFirstInterestingColumn (sketch)) {
+	FATAL_ERROR ("firstInterestingColumn is too high");
+      }
+    }
+    fm85Free (sketch);
+    simple85Free (simple);
+  }
+  printf ("%d %lld streams of %lld okay\n", lgK, numStreams, n); fflush (stdout);
+}
+
+// The firstInterestingColumn scan must see every early-zone surprise that is still in the
+// table when it finishes, even while the table is being resized and surprises are being
+// deleted under it. This follows the scan from the outside. Before each update, it notes the
+// slots that the scan is about to visit (those of the old slots of a resize come first), and
+// when the scan finishes, it checks that it noted all of the early-zone surprises. Meanwhile,
+// it feeds the sketch new surprises past the window, so that the table keeps growing,
+// and it collects early-zone surprises, which deletes them.
+
+Long insertionsUntilGrowth (u32Table * table) {
+  return ((u32TableUpsizeNumer << table->lgSize) / u32TableUpsizeDenom + 1 - table->numItems);
+}
+
+U32 slotOfFicScan (u32Table * table, Long position) {
+  Long numOldSlots;
+  U32 * oldSlots = u32TableSlotsOfPart (table, 1, &numOldSlots);
+  if (position < numOldSlots) { return (oldSlots[position]); }
+  return (table->slots[position - numOldSlots]);
+}
+
+void amortizedScanDuringResize (Short lgK, Long budget, Long numScans) {
+  Long k = (1LL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  fm85SetShiftBudget (sketch, budget);
+  while (sketch->windowOffset < 2) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketch, twoHashes[0], twoHashes[1]);
+  }
+  u32Table * seen = u32TableMake (10, 6 + lgK);
+  U32 * visiting = (U32 *) malloc ((size_t) (budget * sizeof(U32)));
+  assert (visiting != NULL);
+  U32 * early = (U32 *) NULL;
+  Long numEarly = 0;
+  Long nextEarly = 0;
+  Long numDone = 0;
+  Long numOverlaps = 0;
+  U32 lateRowCol = 0;
+  Short result = 0; // what the scan should come up with, going by the slots noted so far
+  Long shiftGrowth = -1; // how many more items the next shift will leave in the table (-1 if unknown)
+  Boolean growing = 0;
+  Long i, j, part;
+  for (i = 0; numDone < numScans; i++) {
+    u32Table * table = sketch->surprisingValueTable;
+    Short offset = sketch->windowOffset;
+    Long cursor = sketch->ficScanCursor;
+    Long numVisiting = 0;
+    Long cursorHi = cursor;
+    if (cursor >= 0) {
+      Long numOldSlots;
+      u32TableSlotsOfPart (table, 1, &numOldSlots);
+      cursorHi = cursor + budget;
+      if (cursorHi > numOldSlots + (1LL << table->lgSize)) { cursorHi = numOldSlots + (1LL << table->lgSize); }
+      for (j = cursor; j < cursorHi; j++) { visiting[numVisiting++] = slotOfFicScan (table, j); }
+      if (table->nextSlots != NULL || table->oldSlots != NULL) { numOverlaps++; }
+    }
+
+    // Between a scan and the next shift, every update adds a surprise, to get to that shift.
+    // Collecting an early-zone one instead of adding a new one past the window steers the
+    // table to within a few items of growing when the shift finishes. (A resize that starts
+    // during the shift would also finish during it, because every row that the shift moves
+    // does a piece of it.) If the table is that close, every update from the start of the
+    // scan until the table does grow adds a new surprise. Otherwise, one in 16 does. Most of the others repeat the last one, which changes
+    // nothing, but still does a piece of any resize in progress.
+    assert (offset + 8 + 3 <= 63);
+    if (table->nextSlots != NULL) { growing = 0; }
+    Boolean idle = (sketch->shiftCursor == FM85_NO_SHIFT_IN_PROGRESS && cursor < 0);
+    Long numToShift = k * (offset + 1) + 19 * k / 8 - sketch->numCoupons;
+    Long closeness = insertionsUntilGrowth (table) - shiftGrowth;
+    Boolean steer = idle && shiftGrowth >= 0 && closeness - numToShift < 32 && nextEarly < numEarly;
+    if ((idle && !steer) || (growing && cursor >= 0) || (i & 15) == 0) {
+      getTwoRandomHashes (twoHashes);
+      lateRowCol = (U32) (((twoHashes[0] & (k - 1)) << 6) | (offset + 8 + (twoHashes[1] & 3)));
+    }
+    U32 rowCol = lateRowCol;
+    if ((steer || (cursor >= 0 && (i & 3) == 3)) && nextEarly < numEarly) { rowCol = early[nextEarly++]; }
+    Long numCoupons = sketch->numCoupons;
+    fm85RowColUpdate (sketch, rowCol);
+    if (sketch->numCoupons > numCoupons && (Short) (rowCol & 63) == offset + 8) { shiftGrowth--; }
+
+    Long newCursor = sketch->ficScanCursor;
+    if (newCursor == cursorHi || (newCursor < 0 && cursor >= 0)) { // the scan visited those slots
+      for (j = 0; j < numVisiting; j++) {
+	if (visiting[j] != ALL32BITS) { u32TableMaybeInsert (seen, visiting[j]); }
+	if (visiting[j] != ALL32BITS && (Short) (visiting[j] & 63) < result) { result = (Short) (visiting[j] & 63); }
+      }
+    }
+    if (sketch->windowOffset != offset) { // a new shift abandons the scan
+      u32TableClear (seen);
+      growing = (table->lgSize >= U32_TABLE_INCREMENTAL_LG_SIZE && shiftGrowth >= 0 && closeness < k / 4);
+      shiftGrowth = -1;
+    }
+    else if (newCursor == 0) { // the scan started over
+      u32TableClear (seen);
+      result = offset;
+      if (cursor < 0) { // a new one
+	free (early);
+	early = u32TableGetSortedItems (sketch->surprisingValueTable, &numEarly);
+	nextEarly = 0;
+	while (numEarly > 0 && (Short) (early[numEarly - 1] & 63) >= offset) { numEarly--; } // skip the late ones
+      }
+    }
+    else if (newCursor < 0 && cursor >= 0) { // the scan finished
+      table = sketch->surprisingValueTable;
+      for (part = 0; part < 2; part++) {
+	Long numSlots;
+	U32 * slots = u32TableSlotsOfPart (table, (int) part, &numSlots);
+	for (j = 0; j < numSlots; j++) {
+	  if (slots[j] != ALL32BITS && (Short) (slots[j] & 63) < offset && !u32TableContains (seen, slots[j])) {
+	    FATAL_ERROR ("the firstInterestingColumn scan missed an item");
+	  }
+	}
+      }
+      if (sketch->firstInterestingColumn > calculateFirstInterestingColumn (sketch)) {
+	FATAL_ERROR ("firstInterestingColumn is too high");
+      }
+      if (sketch->firstInterestingColumn != result) { FATAL_ERROR ("the firstInterestingColumn scan visited other slots"); }
+      u32TableClear (seen);
+      numDone++;
+      shiftGrowth = 0; // the zeros of column offset go in, and the surprises of column offset+8 come out
+      for (j = 0; j < k; j++) { if ((sketch->slidingWindow[j] & 1) == 0) { shiftGrowth++; } }
+      for (part = 0; part < 2; part++) {
+	Long numSlots;
+	U32 * slots = u32TableSlotsOfPart (table, (int) part, &numSlots);
+	for (j = 0; j < numSlots; j++) {
+	  if (slots[j] != ALL32BITS && (Short) (slots[j] & 63) == offset + 8) { shiftGrowth--; }
+	}
+      }
+    }
+    else if (newCursor != cursor && newCursor != cursorHi) { FATAL_ERROR ("unexpected firstInterestingColumn scan"); }
+    if (newCursor > 0 && sketch->windowOffset == offset && sketch->ficScanResult != result) {
+      FATAL_ERROR ("the firstInterestingColumn scan visited other slots");
+    }
+  }
+  printf ("%d %lld %lld scans with %lld updates during a resize okay\n", lgK, budget, numScans, numOverlaps); fflush (stdout);
+  free (early);
+  free (visiting);
+  u32TableFree (seen);
+  fm85Free (sketch);
+}
+
+/***************************************************************/
+
+void amortizedMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    amortizedDoAStreamLength (lgK, num_items, 1);
+    amortizedDoAStreamLength (lgK, num_items, 1 + k / 16);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+  amortizedCheckEveryUpdate (6, 300, 10000);
+  amortizedScanDuringResize (14, 1, 8);
+  amortizedScanDuringResize (14, 64, 16);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Deferred Offsets
+
+void deferredDoAStreamLength (Short lgK, Long n, Long catchUpInterval) {
+  Long k = (1ULL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketchS = fm85Make (lgK); // shifts as it goes
+  FM85 * sketchD = fm85Make (lgK); // deferred
+  SIMPLE85 * simple = simple85Make (lgK);
+  fm85DeferOffsets (sketchD, (Boolean) 1);
+  Long i;
+
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update     (sketchS, twoHashes[0], twoHashes[1]);
+    fm85Update     (sketchD, twoHashes[0], twoHashes[1]);
+    simple85Update (simple,  twoHashes[0], twoHashes[1]);
+    if (catchUpInterval > 0 && (i + 1) % catchUpInterval == 0) { fm85CatchUpOffset (sketchD); }
+  }
+
+  // The deferred sketch's window may still be several columns behind here.
+  printf ("%d %lld %lld (%lld %d %d)", lgK, n, catchUpInterval, sketchD->numCoupons, 
+	  (int) sketchD->windowOffset, (int) sketchS->windowOffset);
+  assert (sketchD->numCoupons == simple->numCoupons);
+  U64 * matrix = bitMatrixOfSketch (sketchD);
+  compareU64Arrays (matrix, simple->bitMatrix, k);
+  free (matrix);
+
+  // Compressing the sketch while it is behind must leave it where it is.
+  Short offsetBefore = sketchD->windowOffset;
+  FM85 * compressedD = fm85Compress (sketchD);
+  assert (sketchD->windowOffset == offsetBefore);
+  FM85 * uncompressedD = fm85Uncompress (compressedD);
+  fm85Free (compressedD);
+
+  fm85DeferOffsets (sketchD, (Boolean) 0);
+  assert (sketchD->windowOffset == sketchS->windowOffset);
+  // The two sketches may have computed their lower bounds at different times,
+  // so their values of firstInterestingColumn can legitimately differ.
+  assert (sketchD->firstInterestingColumn <= calculateFirstInterestingColumn (sketchD));
+  assert (sketchS->firstInterestingColumn <= calculateFirstInterestingColumn (sketchS));
+  sketchD->firstInterestingColumn = sketchS->firstInterestingColumn;
+  assertSketchesEqual (sketchS, sketchD, (Boolean) 0);
+  uncompressedD->firstInterestingColumn = sketchS->firstInterestingColumn;
+  assertSketchesEqual (sketchS, uncompressedD, (Boolean) 0);
+  printf (" okay\n"); fflush (stdout);
+
+  fm85Free (sketchS);
+  fm85Free (sketchD);
+  fm85Free (uncompressedD);
+  simple85Free (simple);
+}
+
+/***************************************************************/
+
+void deferredMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    deferredDoAStreamLength (lgK, num_items, 0);
+    deferredDoAStreamLength (lgK, num_items, 2 * k);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+}
+
+/***************************************************************/
+/***************************************************************/
+// Construction with a Cardinality Hint
+
+void hintDoAStreamLength (Short lgK, Long n) {
+  U64 twoHashes[2]; // allocated on the stack
+  Long hints[3] = {n, 4 * n, n / 4}; // accurate, too high, too low
+  FM85 * sketchP = fm85Make (lgK); // plain
+  FM85 * sketchH[3];
+  Long h, i;
+  for (h = 0; h < 3; h++) { sketchH[h] = fm85MakeWithHint (lgK, hints[h]); }
+
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketchP, twoHashes[0], twoHashes[1]);
+    for (h = 0; h < 3; h++) { fm85Update (sketchH[h], twoHashes[0], twoHashes[1]); }
+  }
+
+  printf ("%d %lld (%lld %d)", lgK, n, sketchP->numCoupons, (int) determineSketchFlavor (sketchP));
+  FM85 * compressedP = fm85Compress (sketchP);
+  for (h = 0; h < 3; h++) {
+    assertSketchesEqual (sketchP, sketchH[h], (Boolean) 0);
+    FM85 * compressedH = fm85Compress (sketchH[h]);
+    assertSketchesEqual (compressedP, compressedH, (Boolean) 0);
+    fm85Free (compressedH);
+    fm85Free (sketchH[h]);
+  }
+  printf (" okay\n"); fflush (stdout);
+
+  fm85Free (compressedP);
+  fm85Free (sketchP);
+}
+
+/***************************************************************/
+
+void hintMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    hintDoAStreamLength (lgK, num_items);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+}
+
+/***************************************************************/
+/***************************************************************/
+// Copy-on-write Snapshots
+
+// Every few updates, this takes a snapshot of the sketch, along with an ordinary
+// copy, and frees the oldest snapshot once several are alive. Each snapshot must
+// still match its copy when it is freed. Some snapshots are updated themselves.
+
+#define NUM_LIVE_SNAPSHOTS 3
+
+void snapshotsDoAStreamLength (Short lgK, Long n, Long budget) {
+  Long k = (1ULL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  SIMPLE85 * simple = simple85Make (lgK);
+  fm85SetShiftBudget (sketch, budget);
+  FM85 * snapshots [NUM_LIVE_SNAPSHOTS];
+  FM85 * copies [NUM_LIVE_SNAPSHOTS];
+  Long interval = 1 + n / 16;
+  Long numTaken = 0;
+  Long i, j;
+
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update     (sketch, twoHashes[0], twoHashes[1]);
+    simple85Update (simple, twoHashes[0], twoHashes[1]);
+    if (i % interval == 0) {
+      j = numTaken % NUM_LIVE_SNAPSHOTS;
+      if (numTaken >= NUM_LIVE_SNAPSHOTS) {
+	assertSketchesEqual (copies[j], snapshots[j], (Boolean) 0);
+	fm85Free (snapshots[j]);
+	fm85Free (copies[j]);
+      }
+      snapshots[j] = fm85Snapshot (sketch);
+      copies[j] = fm85Copy (sketch);
+      if (numTaken % 2 == 1) { // updating the snapshot must not disturb the sketch
+	getTwoRandomHashes (twoHashes);
+	fm85Update (snapshots[j], twoHashes[0], twoHashes[1]);
+	fm85Update (copies[j], twoHashes[0], twoHashes[1]);
+      }
+      numTaken++;
+    }
+  }
+
+  assert (sketch->numCoupons == simple->numCoupons);
+  U64 * matrix = bitMatrixOfSketch (sketch);
+  compareU64Arrays (matrix, simple->bitMatrix, k);
+  free (matrix);
+
+  // a snapshot of the final sketch can be compressed while the sketch is still shared
+  FM85 * last = fm85Snapshot (sketch);
+  FM85 * compressed = fm85Compress (last);
+  FM85 * uncompressed = fm85Uncompress (compressed);
+  fm85FinishShift (sketch);
+  assertSketchesEqual (sketch, uncompressed, (Boolean) 0);
+
+  printf ("%d %lld %lld (%lld %lld)", lgK, n, budget, sketch->numCoupons, numTaken);
+  for (j = 0; j < NUM_LIVE_SNAPSHOTS && j < numTaken; j++) {
+    assertSketchesEqual (copies[j], snapshots[j], (Boolean) 0);
+    fm85Free (snapshots[j]);
+    fm85Free (copies[j]);
+  }
+  printf (" okay\n"); fflush (stdout);
+
+  fm85Free (uncompressed);
+  fm85Free (compressed);
+  fm85Free (last);
+  fm85Free (sketch);
+  simple85Free (simple);
+}
+
+/***************************************************************/
+// After a snapshot, the first sketch to write to the window copies just that block of it,
+// and the rest a few blocks per update, while a table that is being resized is shared as
+// it is. This takes snapshots while the table is resizing, then updates both the sketch
+// and the snapshots, and checks each of them against a copy that was never shared.
+// Half of the updates land in the window and half just past it, to make the table grow.
+
+U32 rowColNearWindow (FM85 * sketch) {
+  U64 twoHashes[2]; // allocated on the stack
+  getTwoRandomHashes (twoHashes);
+  Long k = (1LL << sketch->lgK);
+  return ((U32) (((twoHashes[0] & (k - 1)) << 6) | (sketch->windowOffset + (twoHashes[1] & 15))));
+}
+
+void snapshotsWhileCopying (Short lgK, Long numSnapshots) {
+  FM85 * sketch = fm85Make (lgK);
+  FM85 * sketchCopy = fm85Make (lgK);
+  Long numPartlyCopied = 0;
+  Long numTaken = 0;
+  Long i;
+  while (numTaken < numSnapshots) {
+    U32 rowCol = rowColNearWindow (sketch);
+    fm85RowColUpdate (sketch, rowCol);
+    fm85RowColUpdate (sketchCopy, rowCol);
+    u32Table * table = sketch->surprisingValueTable;
+    if (sketch->slidingWindow == NULL || (table->nextSlots == NULL && table->oldSlots == NULL)) { continue; }
+
+    FM85 * snapshot = fm85Snapshot (sketch);
+    FM85 * copy = fm85Copy (sketch);
+    assert (snapshot->surprisingValueTable == table); // still resizing
+    for (i = 0; sketch->windowRefCount != NULL || snapshot->windowRefCount != NULL; i++) {
+      rowCol = rowColNearWindow (sketch);
+      fm85RowColUpdate (sketch, rowCol);
+      fm85RowColUpdate (sketchCopy, rowCol);
+      if (i % 2 == 1) {
+	rowCol = rowColNearWindow (snapshot);
+	fm85RowColUpdate (snapshot, rowCol);
+	fm85RowColUpdate (copy, rowCol);
+      }
+      if (sketch->windowBlockOwned != NULL && snapshot->windowBlockOwned != NULL) { numPartlyCopied++; }
+      if (i % 16 == 0) {
+	assertSketchesEqual (sketchCopy, sketch, (Boolean) 0);
+	assertSketchesEqual (copy, snapshot, (Boolean) 0);
+      }
+    }
+    assertSketchesEqual (sketchCopy, sketch, (Boolean) 0);
+    assertSketchesEqual (copy, snapshot, (Boolean) 0);
+    fm85Free (snapshot);
+    fm85Free (copy);
+    numTaken++;
+  }
+  assert (numPartlyCopied > 0);
+  printf ("%d %lld snapshots of a resizing table with %lld updates to two partly copied windows okay\n",
+	  lgK, numTaken, numPartlyCopied);
+  fflush (stdout);
+  fm85Free (sketch);
+  fm85Free (sketchCopy);
+}
+
+/***************************************************************/
+
+void snapshotsMain (int argc, char ** argv) {
+  Short lgK;
+  Long num_items;
+  lgK = atoi(argv[1]);
+  Long k = (1ULL << lgK);
+  num_items = 0;
+  while (num_items < 120 * k) {
+    snapshotsDoAStreamLength (lgK, num_items, 0);
+    snapshotsDoAStreamLength (lgK, num_items, 1 + k / 16);
+    Long prev = num_items;
+    num_items = 5 * num_items / 4;
+    if (num_items == prev) num_items += 1;
+  }
+  snapshotsWhileCopying (14, 8);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Hash Table Deletions
+
+// This inserts and deletes random items in a u32Table, and checks every possible item,
+// as well as the sorted items and the order of the slots, against a byte array after each phase. The middle phase keeps the number of items
+// roughly constant, which must not keep rebuilding the table. The items are also bulk loaded into another table.
+
+void checkTableAgainstFlags (u32Table * table, U8 * flags, Long domainSize, Long numFlagged) {
+  assert (table->numItems == numFlagged);
+  Long i;
+  for (i = 0; i < domainSize; i++) {
+    if (u32TableContains (table, (U32) i) != (Boolean) flags[i]) { FATAL_ERROR ("u32Table lookup mismatch"); }
+  }
+  Long numItems;
+  Long migrateLeft = table->migrateLeft;
+  U32 * items = u32TableGetSortedItems (table, &numItems);
+  assert (table->migrateLeft == migrateLeft); // reading doesn't move a resize along
+  Long j = 0;
+  for (i = 0; i < domainSize; i++) {
+    if (flags[i]) { if (items[j++] != (U32) i) { FATAL_ERROR ("u32Table sorted items mismatch"); } }
+  }
+  assert (j == numItems);
+  if (items != NULL) { free (items); }
+#ifdef U32_TABLE_ORDERED
+  // Starting just after an empty slot, the items only decrease where they wrap around.
+  Long tableSize = (1LL << table->lgSize);
+  Long start = 0;
+  while (table->slots[start] != ALL32BITS) { start++; }
+  Long numDescents = 0;
+  U32 prev = 0;
+  for (i = 1; i <= tableSize; i++) {
+    U32 item = table->slots[(start + i) & (tableSize - 1)];
+    if (item != ALL32BITS) {
+      if (item < prev) { numDescents++; }
+      prev = item;
+    }
+  }
+  if (numDescents > 1) { FATAL_ERROR ("u32Table is not in order"); }
+#endif
+}
+
+// This loads the table's sorted items into a new table that is just big enough for them,
+// which is when the most of them wrap around the end.
+
+void bulkLoadCheck (u32Table * table, U8 * flags, Long domainSize, Long numFlagged) {
+  Long numItems;
+  U32 * items = u32TableGetSortedItems (table, &numItems);
+  Short lgSize = u32TableLgSizeForNumItems (numItems);
+  u32Table * loaded = u32TableMake (lgSize, table->validBits);
+  u32TableLoadSortedItems (loaded, items, numItems);
+  checkTableAgainstFlags (loaded, flags, domainSize, numFlagged);
+#ifdef U32_TABLE_ORDERED
+  u32Table * inserted = u32TableMake (lgSize, table->validBits);
+  Long i;
+  for (i = 0; i < numItems; i++) { u32TableMaybeInsert (inserted, items[i]); }
+  assert (inserted->lgSize == lgSize);
+  compareU32Arrays (loaded->slots, inserted->slots, 1LL << lgSize);
+  u32TableFree (inserted);
+#endif
+  u32TableFree (loaded);
+  if (items != NULL) { free (items); }
+}
+
+void deletionsDoOneSize (Short validBits, Long n) {
+  Long domainSize = (1LL << validBits);
+  U8 * flags = (U8 *) calloc ((size_t) domainSize, sizeof(U8));
+  assert (flags != NULL);
+  u32Table * table = u32TableMake (2, validBits);
+  U64 twoHashes[2]; // allocated on the stack
+  Long numFlagged = 0;
+  Long i;
+
+  while (numFlagged < n) { // grow
+    getTwoRandomHashes (twoHashes);
+    U32 item = (U32) (twoHashes[0] & (domainSize - 1));
+    if (u32TableMaybeInsert (table, item) != (Boolean) (1 - flags[item])) { FATAL_ERROR ("u32Table insert mismatch"); }
+    if (flags[item] == 0) { flags[item] = 1; numFlagged++; }
+  }
+  checkTableAgainstFlags (table, flags, domainSize, numFlagged);
+  bulkLoadCheck (table, flags, domainSize, numFlagged);
+
+  Long rebuildsBefore = table->numRebuilds;
+  for (i = 0; i < 8 * n; i++) { // churn
+    getTwoRandomHashes (twoHashes);
+    U32 item = (U32) (twoHashes[0] & (domainSize - 1));
+    if (numFlagged > n || (numFlagged == n && (twoHashes[1] & 1))) {
+      if (u32TableMaybeDelete (table, item) != (Boolean) flags[item]) { FATAL_ERROR ("u32Table delete mismatch"); }
+      if (flags[item] == 1) { flags[item] = 0; numFlagged--; }
+    }
+    else {
+      if (u32TableMaybeInsert (table, item) != (Boolean) (1 - flags[item])) { FATAL_ERROR ("u32Table insert mismatch"); }
+      if (flags[item] == 0) { flags[item] = 1; numFlagged++; }
+    }
+  }
+  checkTableAgainstFlags (table, flags, domainSize, numFlagged);
+  assert (table->numRebuilds <= rebuildsBefore + 1); // n might be right at the threshold
+  if (table->numRebuilds > rebuildsBefore + 1) { FATAL_ERROR ("steady churn kept rebuilding the table"); }
+
+  for (i = 0; i < domainSize && numFlagged > 0; i++) { // shrink
+    if (flags[i] == 1) {
+      if (!u32TableMaybeDelete (table, (U32) i)) { FATAL_ERROR ("u32Table delete mismatch"); }
+      flags[i] = 0; numFlagged--;
+      if (numFlagged == n / 2 || numFlagged == n / 16) { checkTableAgainstFlags (table, flags, domainSize, numFlagged); }
+    }
+  }
+  checkTableAgainstFlags (table, flags, domainSize, numFlagged);
+
+  printf ("%d %lld (%d %lld %lld %lld) okay\n", validBits, n, table->lgSize,
+	  table->numRebuilds, table->numRebuildMoves, table->numDeleteMoves);
+  fflush (stdout);
+  u32TableFree (table);
+  free (flags);
+}
+
+/***************************************************************/
+
+void deletionsMain (int argc, char ** argv) {
+  Short lgK = atoi(argv[1]);
+  Short validBits = lgK + 6;
+  if (validBits > 20) { validBits = 20; }
+  Long domainSize = (1LL << validBits);
+  Long n;
+  for (n = 1; n <= domainSize / 16; n *= 4) { // the table stays smaller than the domain
+    deletionsDoOneSize (validBits, n);
+    deletionsDoOneSize (validBits, 3 * n);
+  }
+}
+
 /***************************************************************/
 /***************************************************************/
 // Merging
@@ -326,6 +1081,27 @@ int main (int argc, char ** argv) {
   printf("\nTesting Compression\n");
   compressionMain (argc, argv);
 
+  printf("\nTesting Batch Updates\n");
+  batchMain (argc, argv);
+
+  printf("\nTesting Single-Hash and Raw-Item Updates\n");
+  itemsMain (argc, argv);
+
+  printf("\nTesting Amortized Window Shifts\n");
+  amortizedMain (argc, argv);
+
+  printf("\nTesting Deferred Offsets\n");
+  deferredMain (argc, argv);
+
+  printf("\nTesting Construction with a Cardinality Hint\n");
+  hintMain (argc, argv);
+
+  printf("\nTesting Copy-on-write Snapshots\n");
+  snapshotsMain (argc, argv);
+
+  printf("\nTesting Hash Table Deletions\n");
+  deletionsMain (argc, argv);
+
   printf("\nTesting Merging\n");
   mergingMain (argc, argv);
 }
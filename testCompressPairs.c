@@ -2,7 +2,7 @@
 
 /*
 
- gcc -DLOW_LEVEL_CRAP -O3 -Wall -pedantic -o testCompressPairs u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testCompressPairs.c
+ gcc -DLOW_LEVEL_CRAP -O3 -Wall -pedantic -o testCompressPairs u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c testCompressPairs.c -lpthread
 
 */
 
@@ -0,0 +1,1021 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+/*
+  This tests the concurrent sketch by letting several threads feed it the same
+  stream at once, each starting at a different place, while the main thread
+  takes snapshots. The final result must hold exactly the same coupons as a
+  sketch that processed the stream in a single thread. The sharded sketch
+  is tested in the same way, while it is being folded in the background,
+  and the row-partitioned engine's result must equal the single-threaded
+  sketch at the end of a batch. Finally, another thread reads the estimates
+  of an ordinary sketch while it is being updated, and compresses and frees
+  snapshots of it. Parallel window shifts, parallel union results, and
+  merging many sketches at once must give the same sketches as the
+  ordinary ones, and so must compressing and uncompressing many sketches
+  at once, and segmented compression.
+
+  gcc -O3 -Wall -pedantic -o testConcurrent u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c fm85Concurrent.c fm85Sharded.c fm85Partitioned.c testConcurrent.c -lm -lpthread
+
+*/
+
+/*******************************************************/
+
+#include <pthread.h>
+
+#include "common.h"
+#include "fm85Util.h"
+#include "u32Table.h"
+#include "fm85.h"
+#include "fm85Compression.h"
+#include "fm85Merging.h"
+#include "fm85Testing.h"
+#include "fm85Concurrent.h"
+#include "fm85Sharded.h"
+#include "fm85Partitioned.h"
+
+/***************************************************************/
+
+typedef struct writer_args_type {
+  FM85C * sketch;
+  Long writerId;
+  U64 * hash0;
+  U64 * hash1;
+  Long start;   // where this writer starts in the stream
+  Long n;       // the stream length
+  Long count;   // how many items this writer processes
+} WriterArgs;
+
+void * writerMain (void * arg) {
+  WriterArgs * args = (WriterArgs *) arg;
+  Long i;
+  Long j = args->start;
+  for (i = 0; i < args->count; i++) {
+    fm85ConcurrentUpdate (args->sketch, args->writerId, args->hash0[j], args->hash1[j]);
+    j += 1;
+    if (j == args->n) { j = 0; }
+  }
+  return (NULL);
+}
+
+/***************************************************************/
+// A snapshot must be a valid sketch whose coupons were all in the stream.
+
+void checkSnapshot (FM85 * snapshot, U64 * finalMatrix, Long k) {
+  assert (snapshot->mergeFlag == 1);
+  Long c = snapshot->numCoupons;
+  assert (determineSketchFlavor (snapshot) == determineFlavor (snapshot->lgK, c));
+  assert (snapshot->windowOffset == determineCorrectOffset (snapshot->lgK, c));
+  assert (snapshot->firstInterestingColumn <= calculateFirstInterestingColumn (snapshot));
+  U64 * matrix = bitMatrixOfSketch (snapshot);
+  assert (countBitsSetInMatrix (matrix, k) == c);
+  Long i;
+  for (i = 0; i < k; i++) { assert ((matrix[i] & ~finalMatrix[i]) == 0); }
+  free (matrix);
+}
+
+/***************************************************************/
+
+void testOneStream (Short lgK, Long n, Long numWriters, Long overlap) {
+  Long k = (1LL << lgK);
+  U64 * hash0 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  assert (hash0 != NULL && hash1 != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  SIMPLE85 * simple = simple85Make (lgK);
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+    simple85Update (simple, twoHashes[0], twoHashes[1]);
+  }
+
+  // Each writer covers its own share of the stream, plus (overlap - 1) other shares,
+  // so every item is processed by overlap different writers.
+  FM85C * sketch = fm85ConcurrentMake (lgK, numWriters);
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numWriters) * sizeof(pthread_t));
+  WriterArgs * args = (WriterArgs *) malloc (((size_t) numWriters) * sizeof(WriterArgs));
+  assert (threads != NULL && args != NULL);
+  Long share = (n + numWriters - 1) / numWriters;
+  for (i = 0; i < numWriters; i++) {
+    args[i].sketch = sketch;
+    args[i].writerId = i;
+    args[i].hash0 = hash0;
+    args[i].hash1 = hash1;
+    args[i].n = n;
+    args[i].start = (i * share) % n;
+    args[i].count = share * overlap;
+    if (args[i].count > n) { args[i].count = n; }
+    if (pthread_create (&threads[i], NULL, writerMain, (void *) &args[i]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+
+  Long numSnapshots = 0;
+  Long lastC = 0;
+  while (numSnapshots < 4) {
+    FM85 * snapshot = fm85ConcurrentGetResult (sketch);
+    assert (snapshot->numCoupons >= lastC);
+    lastC = snapshot->numCoupons;
+    checkSnapshot (snapshot, simple->bitMatrix, k);
+    fm85Free (snapshot);
+    numSnapshots++;
+  }
+
+  for (i = 0; i < numWriters; i++) { pthread_join (threads[i], NULL); }
+
+  FM85 * result = fm85ConcurrentGetResult (sketch);
+  assert (result->numCoupons == simple->numCoupons);
+  assert (fm85ConcurrentNumCoupons (sketch) == simple->numCoupons);
+  checkSnapshot (result, simple->bitMatrix, k);
+  U64 * matrix = bitMatrixOfSketch (result);
+  compareU64Arrays (matrix, simple->bitMatrix, k);
+  free (matrix);
+
+  // the result is an ordinary sketch
+  FM85 * compressed = fm85Compress (result);
+  FM85 * uncompressed = fm85Uncompress (compressed);
+  assertSketchesEqual (result, uncompressed, (Boolean) 0);
+
+  printf ("%d %lld %lld %lld (%lld %d %d %lld) okay\n", (int) lgK, n, numWriters, overlap,
+	  result->numCoupons, (int) determineSketchFlavor (result), (int) result->windowOffset, sketch->epoch);
+  fflush (stdout);
+
+  fm85Free (uncompressed);
+  fm85Free (compressed);
+  fm85Free (result);
+  fm85ConcurrentFree (sketch);
+  simple85Free (simple);
+  free (threads);
+  free (args);
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Sharded sketch
+
+typedef struct shard_args_type {
+  FM85S * sketch;
+  Long shardId;
+  U64 * hash0;
+  U64 * hash1;
+  Long start;
+  Long count;
+} ShardArgs;
+
+void * shardMain (void * arg) {
+  ShardArgs * args = (ShardArgs *) arg;
+  Long i;
+  for (i = args->start; i < args->start + args->count; i++) {
+    fm85ShardedUpdate (args->sketch, args->shardId, args->hash0[i], args->hash1[i]);
+  }
+  fm85ShardedFlush (args->sketch, args->shardId);
+  return (NULL);
+}
+
+void testOneShardedStream (Short lgK, Long n, Long numShards) {
+  Long k = (1LL << lgK);
+  U64 * hash0 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  assert (hash0 != NULL && hash1 != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * direct = fm85Make (lgK);
+  SIMPLE85 * simple = simple85Make (lgK);
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+    fm85Update (direct, twoHashes[0], twoHashes[1]);
+    simple85Update (simple, twoHashes[0], twoHashes[1]);
+  }
+
+  FM85S * sketch = fm85ShardedMake (lgK, numShards);
+  fm85ShardedStartFolding (sketch, 1);
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numShards) * sizeof(pthread_t));
+  ShardArgs * args = (ShardArgs *) malloc (((size_t) numShards) * sizeof(ShardArgs));
+  assert (threads != NULL && args != NULL);
+  Long share = (n + numShards - 1) / numShards;
+  for (i = 0; i < numShards; i++) {
+    args[i].sketch = sketch;
+    args[i].shardId = i;
+    args[i].hash0 = hash0;
+    args[i].hash1 = hash1;
+    args[i].start = (i * share < n) ? (i * share) : n;
+    args[i].count = (args[i].start + share < n) ? share : (n - args[i].start);
+    if (pthread_create (&threads[i], NULL, shardMain, (void *) &args[i]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+
+  Long numQueries = 0;
+  Long lastC = 0;
+  while (numQueries < 4) {
+    FM85 * snapshot = fm85ShardedGetResult (sketch);
+    assert (snapshot->numCoupons >= lastC);
+    lastC = snapshot->numCoupons;
+    checkSnapshot (snapshot, simple->bitMatrix, k);
+    fm85Free (snapshot);
+    numQueries++;
+  }
+
+  for (i = 0; i < numShards; i++) { pthread_join (threads[i], NULL); }
+  fm85ShardedStopFolding (sketch);
+  fm85ShardedFold (sketch); // picks up the final flushes
+
+  FM85 * result = fm85ShardedGetResult (sketch);
+  assertSketchesEqual (direct, result, (Boolean) 1);
+
+  printf ("%d %lld %lld (%lld %d %d %lld) okay\n", (int) lgK, n, numShards,
+	  result->numCoupons, (int) determineSketchFlavor (result), (int) result->windowOffset, sketch->numFolds);
+  fflush (stdout);
+
+  fm85Free (result);
+  fm85ShardedFree (sketch);
+  fm85Free (direct);
+  simple85Free (simple);
+  free (threads);
+  free (args);
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Estimate snapshots, read while another thread updates an ordinary sketch.
+// The HIP accumulators are a deterministic function of the stream, so each
+// snapshot's values must be the ones that a first pass saw for the same C.
+
+typedef struct estimate_reader_args_type {
+  FM85 * sketch;
+  double * hipEstOfC;
+  double * hipErrOfC;
+  Long finalC;
+  Long numReads;
+} EstimateReaderArgs;
+
+void * estimateReaderMain (void * arg) {
+  EstimateReaderArgs * args = (EstimateReaderArgs *) arg;
+  FM85E estimates;
+  Long lastC = 0;
+  do {
+    fm85GetEstimates (args->sketch, &estimates);
+    assert (estimates.numCoupons >= lastC && estimates.numCoupons <= args->finalC);
+    assert (estimates.mergeFlag == 0);
+    assert (getHIPEstimateOfEstimates (&estimates) == args->hipEstOfC[estimates.numCoupons]);
+    assert (estimates.hipErrAccum == args->hipErrOfC[estimates.numCoupons]);
+    lastC = estimates.numCoupons;
+    args->numReads++;
+  } while (lastC < args->finalC);
+  return (NULL);
+}
+
+void testEstimateSnapshots (Short lgK, Long n) {
+  U64 * hash0 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  double * hipEstOfC = (double *) malloc (((size_t) (n + 1)) * sizeof(double));
+  double * hipErrOfC = (double *) malloc (((size_t) (n + 1)) * sizeof(double));
+  assert (hash0 != NULL && hash1 != NULL && hipEstOfC != NULL && hipErrOfC != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * first = fm85Make (lgK);
+  hipEstOfC[0] = 0.0;
+  hipErrOfC[0] = 0.0;
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+    fm85Update (first, twoHashes[0], twoHashes[1]);
+    hipEstOfC[first->numCoupons] = first->hipEstAccum;
+    hipErrOfC[first->numCoupons] = first->hipErrAccum;
+  }
+
+  FM85 * sketch = fm85Make (lgK);
+  EstimateReaderArgs args;
+  args.sketch = sketch;
+  args.hipEstOfC = hipEstOfC;
+  args.hipErrOfC = hipErrOfC;
+  args.finalC = first->numCoupons;
+  args.numReads = 0;
+  pthread_t reader;
+  if (pthread_create (&reader, NULL, estimateReaderMain, (void *) &args) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  for (i = 0; i < n; i++) { fm85Update (sketch, hash0[i], hash1[i]); }
+  pthread_join (reader, NULL);
+  assertSketchesEqual (first, sketch, (Boolean) 0);
+
+  printf ("%d %lld (%lld %lld reads) okay\n", (int) lgK, n, sketch->numCoupons, args.numReads);
+  fflush (stdout);
+
+  fm85Free (sketch);
+  fm85Free (first);
+  free (hipEstOfC);
+  free (hipErrOfC);
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Copy-on-write snapshots, handed from the updating thread to a query thread,
+// which compresses and frees them while the sketch is still being updated.
+
+#define SNAPSHOT_QUEUE_SIZE 4
+
+typedef struct snapshot_queue_type {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  FM85 * snapshots [SNAPSHOT_QUEUE_SIZE];
+  FM85 * copies [SNAPSHOT_QUEUE_SIZE];
+  Long numPushed;
+  Long numPopped;
+  Boolean done;
+} SnapshotQueue;
+
+void * snapshotReaderMain (void * arg) {
+  SnapshotQueue * queue = (SnapshotQueue *) arg;
+  while (1) {
+    pthread_mutex_lock (&queue->lock);
+    while (queue->numPopped == queue->numPushed && !queue->done) { pthread_cond_wait (&queue->changed, &queue->lock); }
+    if (queue->numPopped == queue->numPushed) { pthread_mutex_unlock (&queue->lock); break; }
+    Long j = queue->numPopped % SNAPSHOT_QUEUE_SIZE;
+    FM85 * snapshot = queue->snapshots[j];
+    FM85 * copy = queue->copies[j];
+    pthread_mutex_unlock (&queue->lock);
+
+    FM85 * compressed = fm85Compress (snapshot);
+    FM85 * uncompressed = fm85Uncompress (compressed);
+    fm85FinishShift (copy);
+    assertSketchesEqual (copy, uncompressed, (Boolean) 0);
+    fm85Free (uncompressed);
+    fm85Free (compressed);
+    fm85Free (snapshot);
+    fm85Free (copy);
+
+    pthread_mutex_lock (&queue->lock);
+    queue->numPopped++;
+    pthread_cond_signal (&queue->changed);
+    pthread_mutex_unlock (&queue->lock);
+  }
+  return (NULL);
+}
+
+void testSnapshotHandOff (Short lgK, Long n, Long budget) {
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  fm85SetShiftBudget (sketch, budget);
+  SnapshotQueue queue;
+  pthread_mutex_init (&queue.lock, NULL);
+  pthread_cond_init (&queue.changed, NULL);
+  queue.numPushed = 0;
+  queue.numPopped = 0;
+  queue.done = 0;
+  pthread_t reader;
+  if (pthread_create (&reader, NULL, snapshotReaderMain, (void *) &queue) != 0) { FATAL_ERROR ("pthread_create failed"); }
+
+  Long interval = 1 + n / 64;
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketch, twoHashes[0], twoHashes[1]);
+    if (i % interval == 0) {
+      FM85 * snapshot = fm85Snapshot (sketch); // these two run on the updating thread
+      FM85 * copy = fm85Copy (sketch);
+      pthread_mutex_lock (&queue.lock);
+      while (queue.numPushed - queue.numPopped == SNAPSHOT_QUEUE_SIZE) { pthread_cond_wait (&queue.changed, &queue.lock); }
+      Long j = queue.numPushed % SNAPSHOT_QUEUE_SIZE;
+      queue.snapshots[j] = snapshot;
+      queue.copies[j] = copy;
+      queue.numPushed++;
+      pthread_cond_signal (&queue.changed);
+      pthread_mutex_unlock (&queue.lock);
+    }
+  }
+  pthread_mutex_lock (&queue.lock);
+  queue.done = 1;
+  pthread_cond_signal (&queue.changed);
+  pthread_mutex_unlock (&queue.lock);
+  pthread_join (reader, NULL);
+
+  printf ("%d %lld %lld (%lld %lld snapshots) okay\n", (int) lgK, n, budget, sketch->numCoupons, queue.numPushed);
+  fflush (stdout);
+
+  pthread_mutex_destroy (&queue.lock);
+  pthread_cond_destroy (&queue.changed);
+  fm85Free (sketch);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Row-partitioned engine
+
+void testOnePartitionedStream (Short lgK, Long n, Short lgNumPartitions, Long batchSize) {
+  U64 * hash0 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  assert (hash0 != NULL && hash1 != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * direct = fm85Make (lgK);
+  FM85P * sketch = fm85PartitionedMake (lgK, lgNumPartitions);
+  Long i, start;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+  }
+
+  for (start = 0; start < n; start += batchSize) {
+    Long len = (start + batchSize < n) ? batchSize : (n - start);
+    fm85PartitionedUpdateBatch (sketch, hash0 + start, hash1 + start, len);
+    for (i = start; i < start + len; i++) { fm85Update (direct, hash0[i], hash1[i]); }
+    assert (fm85PartitionedNumCoupons (sketch) == direct->numCoupons);
+    if (start == 0) { // also check a result taken in the middle of the stream
+      FM85 * early = fm85PartitionedGetResult (sketch);
+      assertSketchesEqual (direct, early, (Boolean) 1);
+      fm85Free (early);
+    }
+  }
+
+  FM85 * result = fm85PartitionedGetResult (sketch);
+  assertSketchesEqual (direct, result, (Boolean) 1);
+
+  // the result is an ordinary sketch
+  FM85 * compressed = fm85Compress (result);
+  FM85 * uncompressed = fm85Uncompress (compressed);
+  assertSketchesEqual (result, uncompressed, (Boolean) 0);
+
+  printf ("%d %lld %lld %lld (%lld %d %d) okay\n", (int) lgK, n, (1LL << lgNumPartitions), batchSize,
+	  result->numCoupons, (int) determineSketchFlavor (result), (int) result->windowOffset);
+  fflush (stdout);
+
+  fm85Free (uncompressed);
+  fm85Free (compressed);
+  fm85Free (result);
+  fm85PartitionedFree (sketch);
+  fm85Free (direct);
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Parallel window shifts. These must leave the sketch exactly as the ordinary
+// shift does, including both kinds of firstInterestingColumn. Deferring the
+// offsets exercises shifts of several columns at once.
+
+void testParallelShifts (Short lgK, Long n, Long numThreads, Boolean defer) {
+  Long k = (1LL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * plain = fm85Make (lgK);
+  FM85 * parallel = fm85Make (lgK);
+  fm85SetShiftThreads (parallel, numThreads);
+  if (defer) {
+    fm85DeferOffsets (plain, 1);
+    fm85DeferOffsets (parallel, 1);
+  }
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (plain, twoHashes[0], twoHashes[1]);
+    fm85Update (parallel, twoHashes[0], twoHashes[1]);
+    if (defer && (i + 1) % (4 * k) == 0) {
+      fm85CatchUpOffset (plain);
+      fm85CatchUpOffset (parallel);
+    }
+  }
+  fm85CatchUpOffset (plain);
+  fm85CatchUpOffset (parallel);
+
+  assertSketchesEqual (plain, parallel, (Boolean) 0);
+  assert (plain->firstInterestingColumn == parallel->firstInterestingColumn);
+  if (plain->blockFirstInterestingColumn != NULL || parallel->blockFirstInterestingColumn != NULL) {
+    assert (plain->blockFirstInterestingColumn != NULL && parallel->blockFirstInterestingColumn != NULL);
+    compareByteArrays (plain->blockFirstInterestingColumn, parallel->blockFirstInterestingColumn, k >> FM85_LG_ROWS_PER_BLOCK);
+  }
+  printf ("%d %lld %lld %d (%lld %d) okay\n", (int) lgK, n, (1LL << parallel->lgShiftThreads), (int) defer,
+	  parallel->numCoupons, (int) parallel->windowOffset);
+  fflush (stdout);
+  fm85Free (plain);
+  fm85Free (parallel);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Parallel union results. The union of several sketches is turned back into a
+// sketch both serially and by several threads, and the two must agree exactly.
+
+UG85 * makeUnionOfSketches (Short lgK, Long n, Long numSketches) {
+  U64 twoHashes[2]; // allocated on the stack
+  UG85 * unioner = ug85Make (lgK);
+  Long s, i;
+  for (s = 0; s < numSketches; s++) {
+    FM85 * sketch = fm85Make (lgK);
+    for (i = 0; i < n / numSketches; i++) {
+      getTwoRandomHashes (twoHashes);
+      fm85Update (sketch, twoHashes[0], twoHashes[1]);
+    }
+    ug85MergeInto (unioner, sketch);
+    fm85Free (sketch);
+  }
+  return (unioner);
+}
+
+void testParallelResults (Short lgK, Long n, Long numThreads) {
+  UG85 * unioner = makeUnionOfSketches (lgK, n, 4);
+  FM85 * serial = ug85GetResult (unioner);
+  FM85 * parallel = ug85GetResultWithThreads (unioner, numThreads);
+  assertSketchesEqual (serial, parallel, (Boolean) 0);
+  assert (serial->firstInterestingColumn == parallel->firstInterestingColumn);
+  assert (parallel->mergeFlag == 1);
+  if (serial->surprisingValueTable != NULL) {
+    assert (serial->surprisingValueTable->lgSize == parallel->surprisingValueTable->lgSize);
+  }
+  printf ("%d %lld %lld (%lld %d %d) okay\n", (int) lgK, n, numThreads,
+	  parallel->numCoupons, (int) determineSketchFlavor (parallel), (int) parallel->windowOffset);
+  fflush (stdout);
+  fm85Free (serial);
+  fm85Free (parallel);
+  ug85Free (unioner);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Merging many sketches at once. The sources have very different sizes, and
+// when mixed is set, three different K's. The unioner starts out holding one
+// sketch, and it must end up the same as after merging the sources one by one.
+
+FM85 ** makeManySketches (Short lgK, Long numSources, Long maxN, Boolean mixed) {
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 ** sources = (FM85 **) malloc (((size_t) numSources) * sizeof(FM85 *));
+  assert (sources != NULL);
+  Long s, i;
+  for (s = 0; s < numSources; s++) {
+    Short sourceLgK = lgK;
+    if (mixed && s % 3 == 1 && lgK > 4) { sourceLgK = lgK - 1; }
+    if (mixed && s % 3 == 2 && lgK < 26) { sourceLgK = lgK + 1; }
+    sources[s] = fm85Make (sourceLgK);
+    Long n = (maxN * (s % 17)) / 16 / (1 + s % 5);
+    for (i = 0; i < n; i++) {
+      getTwoRandomHashes (twoHashes);
+      fm85Update (sources[s], twoHashes[0], twoHashes[1]);
+    }
+  }
+  return (sources);
+}
+
+void testMergeMany (Short lgK, Long numSources, Long maxN, Long numThreads, Boolean mixed) {
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 ** sources = makeManySketches (lgK, numSources, maxN, mixed);
+  FM85 * first = fm85Make (lgK);
+  Long i;
+  for (i = 0; i < maxN / 64; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (first, twoHashes[0], twoHashes[1]);
+  }
+  UG85 * serial = ug85Make (lgK);
+  UG85 * parallel = ug85Make (lgK);
+  ug85MergeInto (serial, first);
+  ug85MergeInto (parallel, first);
+  for (i = 0; i < numSources; i++) { ug85MergeInto (serial, sources[i]); }
+  ug85MergeMany (parallel, sources, numSources, numThreads);
+
+  assert (serial->lgK == parallel->lgK);
+  assert ((serial->bitMatrix == NULL) == (parallel->bitMatrix == NULL));
+  Boolean needToFree1, needToFree2;
+  U64 * matrix1 = bitMatrixOfUG85 (serial, &needToFree1);
+  U64 * matrix2 = bitMatrixOfUG85 (parallel, &needToFree2);
+  compareU64Arrays (matrix1, matrix2, 1LL << serial->lgK);
+  if (needToFree1) { free (matrix1); }
+  if (needToFree2) { free (matrix2); }
+
+  FM85 * serialResult = ug85GetResult (serial);
+  FM85 * parallelResult = ug85GetResult (parallel);
+  if (serial->bitMatrix != NULL) { // otherwise the results are copies of sparse accumulators with different (unused) HIP fields
+    assertSketchesEqual (serialResult, parallelResult, (Boolean) 0);
+  }
+  assert (serialResult->numCoupons == parallelResult->numCoupons);
+  printf ("%d %lld %lld %lld %d (%d %lld %d) okay\n", (int) lgK, numSources, maxN, numThreads, (int) mixed,
+	  (int) parallelResult->lgK, parallelResult->numCoupons, (int) determineSketchFlavor (parallelResult));
+  fflush (stdout);
+
+  fm85Free (serialResult);
+  fm85Free (parallelResult);
+  ug85Free (serial);
+  ug85Free (parallel);
+  fm85Free (first);
+  for (i = 0; i < numSources; i++) { fm85Free (sources[i]); }
+  free (sources);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Batch compression. Every compressed sketch must equal the one that fm85Compress
+// makes by itself, and every uncompressed one must equal its original.
+
+void testCompressMany (Short lgK, Long numSketches, Long maxN, Long numThreads) {
+  FM85 ** sources = makeManySketches (lgK, numSketches, maxN, 0);
+  FM85 ** compressed = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
+  FM85 ** uncompressed = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
+  assert (compressed != NULL && uncompressed != NULL);
+  Long i;
+  fm85CompressMany (sources, compressed, numSketches, numThreads);
+  fm85UncompressMany (compressed, uncompressed, numSketches, numThreads);
+  for (i = 0; i < numSketches; i++) {
+    FM85 * single = fm85Compress (sources[i]);
+    assertSketchesEqual (single, compressed[i], (Boolean) 0);
+    assertSketchesEqual (sources[i], uncompressed[i], (Boolean) 0);
+    fm85Free (single);
+  }
+  printf ("%d %lld %lld %lld okay\n", (int) lgK, numSketches, maxN, numThreads);
+  fflush (stdout);
+  for (i = 0; i < numSketches; i++) {
+    fm85Free (sources[i]);
+    fm85Free (compressed[i]);
+    fm85Free (uncompressed[i]);
+  }
+  free (sources);
+  free (compressed);
+  free (uncompressed);
+}
+
+/***************************************************************/
+/***************************************************************/
+// Segmented compression. The result must not depend on the number of threads,
+// and both decompressors must restore the original sketch.
+
+void testSegmentedCompression (Short lgK, Long n, Short lgNumSegments, Long numThreads) {
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketch, twoHashes[0], twoHashes[1]);
+  }
+  FM85 * plain = fm85Compress (sketch);
+  FM85 * segmented = fm85CompressSegmented (sketch, lgNumSegments, numThreads);
+  FM85 * serial = fm85CompressSegmented (sketch, lgNumSegments, 1);
+  assertSketchesEqual (serial, segmented, (Boolean) 0);
+  Short maxLgNumSegments = lgK - FM85_LG_MIN_ROWS_PER_SEGMENT;
+  assert (segmented->lgCompressedSegments == ((lgNumSegments < maxLgNumSegments) ? lgNumSegments : maxLgNumSegments));
+  if (lgNumSegments == 0) { assertSketchesEqual (plain, segmented, (Boolean) 0); }
+
+  FM85 * uncompressed1 = fm85Uncompress (segmented);
+  FM85 * uncompressed2 = fm85UncompressWithThreads (segmented, numThreads);
+  FM85 * uncompressed3 = fm85UncompressWithThreads (plain, numThreads);
+  assertSketchesEqual (sketch, uncompressed1, (Boolean) 0);
+  assertSketchesEqual (sketch, uncompressed2, (Boolean) 0);
+  assertSketchesEqual (sketch, uncompressed3, (Boolean) 0);
+
+  printf ("%d %lld %d %lld (%d %lld %lld) okay\n", (int) lgK, n, (int) lgNumSegments, numThreads, (int) determineSketchFlavor (sketch),
+	  plain->cwLength + plain->csvLength, segmented->cwLength + segmented->csvLength);
+  fflush (stdout);
+  fm85Free (uncompressed1);
+  fm85Free (uncompressed2);
+  fm85Free (uncompressed3);
+  fm85Free (serial);
+  fm85Free (segmented);
+  fm85Free (plain);
+  fm85Free (sketch);
+}
+
+/***************************************************************/
+// Each thread updates the sketch with its own share of a long stream.
+
+double timeOneRun (Short lgK, U64 * hash0, U64 * hash1, Long n, Long numWriters) {
+  FM85C * sketch = fm85ConcurrentMake (lgK, numWriters);
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numWriters) * sizeof(pthread_t));
+  WriterArgs * args = (WriterArgs *) malloc (((size_t) numWriters) * sizeof(WriterArgs));
+  assert (threads != NULL && args != NULL);
+  Long share = n / numWriters;
+  Long i;
+  struct timeval before, after;
+  gettimeofday (&before, NULL);
+  for (i = 0; i < numWriters; i++) {
+    args[i].sketch = sketch;
+    args[i].writerId = i;
+    args[i].hash0 = hash0;
+    args[i].hash1 = hash1;
+    args[i].n = n;
+    args[i].start = i * share;
+    args[i].count = share;
+    if (pthread_create (&threads[i], NULL, writerMain, (void *) &args[i]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+  for (i = 0; i < numWriters; i++) { pthread_join (threads[i], NULL); }
+  gettimeofday (&after, NULL);
+  fm85ConcurrentFree (sketch);
+  free (threads);
+  free (args);
+  double seconds = ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+  return (((double) (share * numWriters)) / seconds / 1e6); // millions of updates per second
+}
+
+double timeOneShardedRun (Short lgK, U64 * hash0, U64 * hash1, Long n, Long numShards) {
+  FM85S * sketch = fm85ShardedMake (lgK, numShards);
+  pthread_t * threads = (pthread_t *) malloc (((size_t) numShards) * sizeof(pthread_t));
+  ShardArgs * args = (ShardArgs *) malloc (((size_t) numShards) * sizeof(ShardArgs));
+  assert (threads != NULL && args != NULL);
+  Long share = n / numShards;
+  Long i;
+  struct timeval before, after;
+  gettimeofday (&before, NULL);
+  fm85ShardedStartFolding (sketch, 10);
+  for (i = 0; i < numShards; i++) {
+    args[i].sketch = sketch;
+    args[i].shardId = i;
+    args[i].hash0 = hash0;
+    args[i].hash1 = hash1;
+    args[i].start = i * share;
+    args[i].count = share;
+    if (pthread_create (&threads[i], NULL, shardMain, (void *) &args[i]) != 0) { FATAL_ERROR ("pthread_create failed"); }
+  }
+  for (i = 0; i < numShards; i++) { pthread_join (threads[i], NULL); }
+  fm85ShardedStopFolding (sketch);
+  fm85ShardedFold (sketch);
+  gettimeofday (&after, NULL);
+  fm85ShardedFree (sketch);
+  free (threads);
+  free (args);
+  double seconds = ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+  return (((double) (share * numShards)) / seconds / 1e6); // millions of updates per second
+}
+
+// The partitioned engine, against a single thread calling fm85UpdateBatch().
+
+double timeOnePartitionedRun (Short lgK, U64 * hash0, U64 * hash1, Long n, Short lgNumPartitions) {
+  Long batchSize = (1LL << lgK);
+  Long start;
+  struct timeval before, after;
+  gettimeofday (&before, NULL);
+  if (lgNumPartitions < 0) {
+    FM85 * sketch = fm85Make (lgK);
+    for (start = 0; start < n; start += batchSize) {
+      fm85UpdateBatch (sketch, hash0 + start, hash1 + start, (start + batchSize < n) ? batchSize : (n - start));
+    }
+    fm85Free (sketch);
+  }
+  else {
+    FM85P * sketch = fm85PartitionedMake (lgK, lgNumPartitions);
+    for (start = 0; start < n; start += batchSize) {
+      fm85PartitionedUpdateBatch (sketch, hash0 + start, hash1 + start, (start + batchSize < n) ? batchSize : (n - start));
+    }
+    FM85 * result = fm85PartitionedGetResult (sketch);
+    fm85Free (result);
+    fm85PartitionedFree (sketch);
+  }
+  gettimeofday (&after, NULL);
+  double seconds = ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+  return (((double) n) / seconds / 1e6); // millions of updates per second
+}
+
+// A single whole-window shift of a sketch in the SLIDING flavor.
+
+void timeParallelShifts (Short lgK) {
+  Long k = (1LL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  Long i;
+  for (i = 0; i < 32 * k; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketch, twoHashes[0], twoHashes[1]);
+  }
+  Long numThreads;
+  for (numThreads = 1; numThreads <= 8; numThreads *= 2) {
+    Long numTrials = 0;
+    double seconds = 0.0;
+    while (numTrials < 5 || seconds < 0.5) {
+      FM85 * copy = fm85Copy (sketch);
+      fm85SetShiftThreads (copy, numThreads);
+      struct timeval before, after;
+      gettimeofday (&before, NULL);
+      moveWindowTo (copy, copy->windowOffset + 1);
+      gettimeofday (&after, NULL);
+      seconds += ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+      numTrials++;
+      fm85Free (copy);
+    }
+    printf ("lgK %d, one window shift, %lld threads: %.3f ms\n", (int) lgK, numThreads, 1e3 * seconds / ((double) numTrials));
+    fflush (stdout);
+  }
+  fm85Free (sketch);
+}
+
+// Getting the result of a union whose bit matrix is in the SLIDING flavor.
+
+void timeParallelResults (Short lgK) {
+  Long k = (1LL << lgK);
+  UG85 * unioner = makeUnionOfSketches (lgK, 32 * k, 4);
+  Long numThreads;
+  for (numThreads = 1; numThreads <= 8; numThreads *= 2) {
+    Long numTrials = 0;
+    double seconds = 0.0;
+    while (numTrials < 5 || seconds < 0.5) {
+      struct timeval before, after;
+      gettimeofday (&before, NULL);
+      FM85 * result = ug85GetResultWithThreads (unioner, numThreads);
+      gettimeofday (&after, NULL);
+      seconds += ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+      numTrials++;
+      fm85Free (result);
+    }
+    printf ("lgK %d, one union result, %lld threads: %.3f ms\n", (int) lgK, numThreads, 1e3 * seconds / ((double) numTrials));
+    fflush (stdout);
+  }
+  ug85Free (unioner);
+}
+
+// Merging many sketches of moderate size.
+
+void timeMergeMany (Short lgK, Long numSources) {
+  FM85 ** sources = makeManySketches (lgK, numSources, (1LL << lgK), 0);
+  Long numThreads, i;
+  for (numThreads = 1; numThreads <= 8; numThreads *= 2) {
+    struct timeval before, after;
+    gettimeofday (&before, NULL);
+    UG85 * unioner = ug85Make (lgK);
+    ug85MergeMany (unioner, sources, numSources, numThreads);
+    FM85 * result = ug85GetResultWithThreads (unioner, numThreads);
+    gettimeofday (&after, NULL);
+    double seconds = ((double) (after.tv_sec - before.tv_sec)) + 1e-6 * ((double) (after.tv_usec - before.tv_usec));
+    printf ("lgK %d, union of %lld sketches, %lld threads: %.3f ms\n", (int) lgK, numSources, numThreads, 1e3 * seconds);
+    fflush (stdout);
+    fm85Free (result);
+    ug85Free (unioner);
+  }
+  for (i = 0; i < numSources; i++) { fm85Free (sources[i]); }
+  free (sources);
+}
+
+// Compressing and uncompressing one big sketch in the SLIDING flavor.
+
+void timeSegmentedCompression (Short lgK) {
+  Long k = (1LL << lgK);
+  U64 twoHashes[2]; // allocated on the stack
+  FM85 * sketch = fm85Make (lgK);
+  Long i;
+  for (i = 0; i < 32 * k; i++) {
+    getTwoRandomHashes (twoHashes);
+    fm85Update (sketch, twoHashes[0], twoHashes[1]);
+  }
+  Short lgNumSegments = lgK - FM85_LG_MIN_ROWS_PER_SEGMENT;
+  if (lgNumSegments > 6) { lgNumSegments = 6; }
+  if (lgNumSegments < 0) { lgNumSegments = 0; }
+  FM85 * plain = fm85Compress (sketch);
+  Long numThreads;
+  for (numThreads = 1; numThreads <= 8; numThreads *= 2) {
+    Long numTrials = 0;
+    double cSeconds = 0.0;
+    double uSeconds = 0.0;
+    Long numWords = 0;
+    while (numTrials < 5 || cSeconds + uSeconds < 0.5) {
+      struct timeval before, middle, after;
+      gettimeofday (&before, NULL);
+      FM85 * compressed = fm85CompressSegmented (sketch, lgNumSegments, numThreads);
+      gettimeofday (&middle, NULL);
+      FM85 * uncompressed = fm85UncompressWithThreads (compressed, numThreads);
+      gettimeofday (&after, NULL);
+      cSeconds += ((double) (middle.tv_sec - before.tv_sec)) + 1e-6 * ((double) (middle.tv_usec - before.tv_usec));
+      uSeconds += ((double) (after.tv_sec - middle.tv_sec)) + 1e-6 * ((double) (after.tv_usec - middle.tv_usec));
+      numWords = compressed->cwLength + compressed->csvLength;
+      numTrials++;
+      fm85Free (compressed);
+      fm85Free (uncompressed);
+    }
+    printf ("lgK %d, %d segments, %lld threads: %.3f ms to compress, %.3f ms to uncompress, %.2f%% bigger\n",
+	    (int) lgK, 1 << lgNumSegments, numThreads, 1e3 * cSeconds / ((double) numTrials), 1e3 * uSeconds / ((double) numTrials),
+	    100.0 * ((double) (numWords - plain->cwLength - plain->csvLength)) / ((double) (plain->cwLength + plain->csvLength)));
+    fflush (stdout);
+  }
+  fm85Free (plain);
+  fm85Free (sketch);
+}
+
+void timeScaling (Short lgK, Long n) {
+  U64 * hash0 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  U64 * hash1 = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  assert (hash0 != NULL && hash1 != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hash0[i] = twoHashes[0];
+    hash1[i] = twoHashes[1];
+  }
+  Long numWriters;
+  for (numWriters = 1; numWriters <= 8; numWriters *= 2) {
+    printf ("lgK %d, N %lld, %lld writers: %.2f (concurrent) %.2f (sharded) million updates per second\n",
+	    (int) lgK, n, numWriters,
+	    timeOneRun (lgK, hash0, hash1, n, numWriters),
+	    timeOneShardedRun (lgK, hash0, hash1, n, numWriters));
+    fflush (stdout);
+  }
+  printf ("lgK %d, N %lld, batches of K: %.2f (fm85UpdateBatch) million updates per second\n",
+	  (int) lgK, n, timeOnePartitionedRun (lgK, hash0, hash1, n, -1));
+  Short lgNumPartitions;
+  for (lgNumPartitions = 0; lgNumPartitions <= 3 && lgK - lgNumPartitions >= 4; lgNumPartitions++) {
+    printf ("lgK %d, N %lld, %lld partitions: %.2f (partitioned) million updates per second\n",
+	    (int) lgK, n, (1LL << lgNumPartitions), timeOnePartitionedRun (lgK, hash0, hash1, n, lgNumPartitions));
+    fflush (stdout);
+  }
+  free (hash0);
+  free (hash1);
+}
+
+/***************************************************************/
+
+int main (int argc, char ** argv)
+{
+  if (argc != 2) {
+    fprintf (stderr, "Usage: %s log_k\n", argv[0]);
+    return(-1);
+  }
+  Short lgK = atoi(argv[1]);
+  assert (lgK >= 4 && lgK <= FM85_CONCURRENT_MAX_LG_K);
+  fm85Init ();
+  Long k = (1LL << lgK);
+
+  Long multiples [7] = {0, 1, 2, 8, 32, 128, 1024}; // in units of K/16
+  Long numWritersList [3] = {1, 3, 8};
+  int m, w;
+  for (m = 0; m < 7; m++) {
+    for (w = 0; w < 3; w++) {
+      Long n = (multiples[m] * k) / 16;
+      if (n < 1) { n = 1; }
+      testOneStream (lgK, n, numWritersList[w], 1);
+      testOneStream (lgK, n, numWritersList[w], 2);
+    }
+  }
+
+  for (m = 0; m < 7; m++) {
+    for (w = 0; w < 3; w++) {
+      Long n = (multiples[m] * k) / 16;
+      if (n < 1) { n = 1; }
+      testOneShardedStream (lgK, n, numWritersList[w]);
+    }
+  }
+
+  for (m = 0; m < 7; m++) {
+    Long n = (multiples[m] * k) / 16;
+    if (n < 1) { n = 1; }
+    testEstimateSnapshots (lgK, n);
+    testSnapshotHandOff (lgK, n, 0);
+    testSnapshotHandOff (lgK, n, 1 + k / 16);
+  }
+
+  Short lgP;
+  for (m = 0; m < 7; m++) {
+    for (lgP = 0; lgP <= 3 && lgK - lgP >= 4; lgP++) {
+      Long n = (multiples[m] * k) / 16;
+      if (n < 1) { n = 1; }
+      testOnePartitionedStream (lgK, n, lgP, k / 4);
+      testOnePartitionedStream (lgK, n, lgP, 4 * k);
+    }
+  }
+
+  Long numThreads;
+  for (m = 0; m < 7; m++) {
+    for (numThreads = 2; numThreads <= 8 && lgK >= 10; numThreads *= 2) {
+      Long n = (multiples[m] * k) / 16;
+      testParallelShifts (lgK, n, numThreads, 0);
+      testParallelShifts (lgK, n, numThreads, 1);
+    }
+  }
+
+  for (m = 0; m < 7; m++) {
+    for (numThreads = 2; numThreads <= 8; numThreads *= 2) {
+      Long n = (multiples[m] * k) / 16;
+      testParallelResults (lgK, n, numThreads);
+    }
+  }
+
+  Long numSourcesList [3] = {3, 20, 100};
+  for (m = 1; m < 7; m++) {
+    for (w = 0; w < 3; w++) {
+      Long maxN = (multiples[m] * k) / 16;
+      testMergeMany (lgK, numSourcesList[w], maxN, 4, 0);
+      testMergeMany (lgK, numSourcesList[w], maxN, 3, 1);
+    }
+  }
+
+  for (m = 1; m < 7; m++) {
+    for (numThreads = 1; numThreads <= 8; numThreads *= 2) {
+      Long maxN = (multiples[m] * k) / 16;
+      testCompressMany (lgK, 100, maxN, numThreads);
+    }
+  }
+
+  // The segments have at least 2^FM85_LG_MIN_ROWS_PER_SEGMENT rows, so a smaller
+  // lgK is raised until there can be a few of them. The last lgS is clamped.
+  Short lgKS = (lgK > FM85_LG_MIN_ROWS_PER_SEGMENT + 2) ? lgK : FM85_LG_MIN_ROWS_PER_SEGMENT + 2;
+  Long kS = (1LL << lgKS);
+  Short lgS;
+  for (m = 0; m < 7; m++) {
+    for (lgS = 0; lgS <= lgKS - FM85_LG_MIN_ROWS_PER_SEGMENT + 1; lgS++) {
+      Long n = (multiples[m] * kS) / 16;
+      testSegmentedCompression (lgKS, n, lgS, 4);
+      testSegmentedCompression (lgKS, 2 * n + 7, lgS, 3);
+    }
+  }
+
+  timeScaling (lgK, 64 * k);
+  timeParallelShifts (lgK);
+  timeParallelResults (lgK);
+  timeMergeMany (lgK, 256);
+  timeSegmentedCompression (lgK);
+  return (0);
+}
@@ -0,0 +1,148 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+/*
+  This compares the table-driven bit-scan and bit-counting routines with
+  the fast versions in fm85Util.h, using the same patterns of work that
+  occur at the call sites in the library.
+
+  gcc -O3 -DNDEBUG -Wall -pedantic -o timingBitOps u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c timingBitOps.c -lm -lpthread
+
+  Add -mlzcnt -mbmi -mpopcnt (or -march=native) to let the compiler use LZCNT and TZCNT.
+*/
+
+/*******************************************************/
+
+#include "common.h"
+#include "fm85Util.h"
+#include "fm85.h"
+#include "fm85Testing.h"
+
+/***************************************************************/
+
+double nanosPerItem (clock_t before, clock_t after, Long numItems) {
+  return (1e9 * ((double) (after - before)) / ((double) CLOCKS_PER_SEC) / ((double) numItems));
+}
+
+void reportTiming (char * callSite, double oldNanos, double newNanos) {
+  printf ("%-40s old %7.3f  new %7.3f  (nsec per item, speedup %.2f)\n",
+	  callSite, oldNanos, newNanos, oldNanos / newNanos);
+  fflush (stdout);
+}
+
+/***************************************************************/
+// rowColFromTwoHashes(): the column is the number of leading zeros in a random hash.
+
+void timeLeadingZeros (U64 * hashes, Long n) {
+  Long i;
+  Long sumOld = 0, sumNew = 0;
+  clock_t t0, t1, t2;
+  t0 = clock ();
+  for (i = 0; i < n; i++) { sumOld += countLeadingZerosInUnsignedLong (hashes[i]); }
+  t1 = clock ();
+  for (i = 0; i < n; i++) { sumNew += fastCountLeadingZeros64 (hashes[i]); }
+  t2 = clock ();
+  if (sumOld != sumNew) { FATAL_ERROR ("leading zeros mismatch"); }
+  reportTiming ("rowColFromTwoHashes (clz64)", nanosPerItem (t0, t1, n), nanosPerItem (t1, t2, n));
+}
+
+/***************************************************************/
+// modifyOffset() and ug85GetResult(): extract the positions of the few 1-bits in each row.
+
+void timeTrailingZeros (U64 * hashes, Long n) {
+  Long i;
+  Long sumOld = 0, sumNew = 0, numBits = 0;
+  clock_t t0, t1, t2;
+  t0 = clock ();
+  for (i = 0; i < n; i++) {
+    U64 pattern = hashes[i] & (hashes[i] >> 17) & (hashes[i] >> 31); // about 1 bit in 8 is set
+    while (pattern != 0) {
+      Short col = countTrailingZerosInUnsignedLong (pattern);
+      pattern ^= (1ULL << col);
+      sumOld += col;
+      numBits++;
+    }
+  }
+  t1 = clock ();
+  for (i = 0; i < n; i++) {
+    U64 pattern = hashes[i] & (hashes[i] >> 17) & (hashes[i] >> 31);
+    while (pattern != 0) {
+      Short col = fastCountTrailingZeros64 (pattern);
+      pattern ^= (1ULL << col);
+      sumNew += col;
+    }
+  }
+  t2 = clock ();
+  if (sumOld != sumNew) { FATAL_ERROR ("trailing zeros mismatch"); }
+  reportTiming ("modifyOffset/ug85GetResult (ctz64)", nanosPerItem (t0, t1, numBits), nanosPerItem (t1, t2, numBits));
+}
+
+/***************************************************************/
+// readUnary() and trickyGetPairsFromWindow(): trailing zeros of a byte.
+
+void timeByteTrailingZeros (U64 * hashes, Long n) {
+  Long i;
+  Long sumOld = 0, sumNew = 0;
+  clock_t t0, t1, t2;
+  U8 * bytes = (U8 *) hashes;
+  Long numBytes = 8 * n;
+  t0 = clock ();
+  for (i = 0; i < numBytes; i++) { sumOld += byteTrailingZerosTable[bytes[i]]; }
+  t1 = clock ();
+  for (i = 0; i < numBytes; i++) { sumNew += fastCountTrailingZeros8 (bytes[i]); }
+  t2 = clock ();
+  if (sumOld != sumNew) { FATAL_ERROR ("byte trailing zeros mismatch"); }
+  reportTiming ("readUnary/trickyGetPairs (ctz8)", nanosPerItem (t0, t1, numBytes), nanosPerItem (t1, t2, numBytes));
+}
+
+/***************************************************************/
+// ug85GetResult(): count the coupons in a bit matrix.
+// Both routines need a multiple of 8 words, which a real matrix always is (k >= 16 rows).
+
+void timeBitCounting (U64 * hashes, Long n) {
+  clock_t t0, t1, t2;
+  Long reps = 20;
+  Long r;
+  Long sumOld = 0, sumNew = 0;
+  Long length = n & ~7LL;
+  if (length == 0) {
+    printf ("%-40s skipped (fewer than 8 words)\n", "ug85GetResult (countBitsSetInMatrix)");
+    fflush (stdout);
+    return;
+  }
+  t0 = clock ();
+  for (r = 0; r < reps; r++) { sumOld += csaCountBitsSetInMatrix (hashes, length); }
+  t1 = clock ();
+  for (r = 0; r < reps; r++) { sumNew += countBitsSetInMatrix (hashes, length); }
+  t2 = clock ();
+  if (sumOld != sumNew) { FATAL_ERROR ("bit counting mismatch"); }
+  reportTiming ("ug85GetResult (countBitsSetInMatrix)", nanosPerItem (t0, t1, reps * length), nanosPerItem (t1, t2, reps * length));
+}
+
+/***************************************************************/
+
+int main (int argc, char ** argv)
+{
+  if (argc != 2) {
+    fprintf (stderr, "Usage: %s log_num_items\n", argv[0]);
+    return(-1);
+  }
+  fm85Init ();
+
+  Long n = (1LL << atoi(argv[1]));
+  U64 * hashes = (U64 *) malloc (((size_t) n) * sizeof(U64));
+  assert (hashes != NULL);
+  U64 twoHashes[2]; // allocated on the stack
+  Long i;
+  for (i = 0; i < n; i++) {
+    getTwoRandomHashes (twoHashes);
+    hashes[i] = twoHashes[0];
+  }
+
+  timeLeadingZeros (hashes, n);
+  timeTrailingZeros (hashes, n);
+  timeByteTrailingZeros (hashes, n);
+  timeBitCounting (hashes, n);
+
+  free (hashes);
+  return (0);
+}
@@ -3,12 +3,19 @@
 
 -DNDEBUG
 
-gcc -O3 -Wall -pedantic -o timingTest u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c timingTest.c
+gcc -O3 -Wall -pedantic -o timingTest u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c timingTest.c -lpthread
+
+The last two columns time fm85CompressMany and fm85UncompressMany with the given
+number of threads (by default, one per core). Since clock() adds up the time of
+all of the threads, these are per core, so they match the single-threaded columns
+when the batch routines scale linearly.
 
 */
 
 /*******************************************************/
 
+#include <unistd.h>
+
 #include "common.h"
 #include "fm85Util.h"
 #include "u32Table.h"
@@ -20,7 +27,7 @@ gcc -O3 -Wall -pedantic -o timingTest u32Table.c fm85Util.c fm85.c iconEstimator
 
 /***************************************************************/
 
-void do_a_stream_length (Short lgK, Long n) {
+void do_a_stream_length (Short lgK, Long n, Long numThreads) {
   Long k = (1ULL << lgK);
   Long minKN = (k < n ? k : n);
   Long numSketches = 20000000 / minKN; // was 20 million
@@ -28,13 +35,17 @@ void do_a_stream_length (Short lgK, Long n) {
   FM85 ** streamSketches       = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
   FM85 ** compressedSketches   = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
   FM85 ** unCompressedSketches = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
+  FM85 ** batchCompressedSketches   = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
+  FM85 ** batchUnCompressedSketches = (FM85 **) malloc (((size_t) numSketches) * sizeof(FM85 *));
   assert (streamSketches != NULL);
   assert (compressedSketches != NULL);
   assert (unCompressedSketches != NULL);
+  assert (batchCompressedSketches != NULL);
+  assert (batchUnCompressedSketches != NULL);
   Long sketchIndex, i;
   U64 twoHashes[2]; // allocated on the stack
 
-  clock_t before0, after0, before1, after1, before2, after2, before3, after3;
+  clock_t before0, after0, before1, after1, before2, after2, before3, after3, before4, after4, before5, after5;
 
   before0 = clock ();
   for (sketchIndex = 0; sketchIndex < numSketches; sketchIndex++) {
@@ -64,6 +75,14 @@ void do_a_stream_length (Short lgK, Long n) {
   }
   after3 = clock ();
 
+  before4 = clock ();
+  fm85CompressMany (streamSketches, batchCompressedSketches, numSketches, numThreads);
+  after4 = clock ();
+
+  before5 = clock ();
+  fm85UncompressMany (compressedSketches, batchUnCompressedSketches, numSketches, numThreads);
+  after5 = clock ();
+
   double totalC = 0.0;
   double totalW = 0.0;
   for (sketchIndex = 0; sketchIndex < numSketches; sketchIndex++) {
@@ -75,10 +94,14 @@ void do_a_stream_length (Short lgK, Long n) {
     fm85Free (streamSketches[sketchIndex]); streamSketches[sketchIndex] = NULL;
     fm85Free (compressedSketches[sketchIndex]); compressedSketches[sketchIndex] = NULL;
     fm85Free (unCompressedSketches[sketchIndex]); unCompressedSketches[sketchIndex] = NULL;
+    fm85Free (batchCompressedSketches[sketchIndex]); batchCompressedSketches[sketchIndex] = NULL;
+    fm85Free (batchUnCompressedSketches[sketchIndex]); batchUnCompressedSketches[sketchIndex] = NULL;
   }
   free (streamSketches);
   free (compressedSketches);
   free (unCompressedSketches);
+  free (batchCompressedSketches);
+  free (batchUnCompressedSketches);
 
   double avgC     = totalC / ((double) numSketches);
   double avgBytes = 4.0 * totalW / ((double) numSketches);
@@ -86,11 +109,13 @@ void do_a_stream_length (Short lgK, Long n) {
   fprintf (stdout, "(K_N_minKN_avgCoK_avgBytes %lld %lld %lld %.9f %.3f)",
 	   k, n, minKN, avgC / ((double) k), avgBytes);
 
-  fprintf (stdout, " %.6f %.6f %.6f %.6f\n", 
+  fprintf (stdout, " %.6f %.6f %.6f %.6f %.6f %.6f\n", 
 	   1e3 * ((double) (after0 - before0)) / ((double) (n * numSketches)),
 	   1e3 * ((double) (after1 - before1)) / ((double) (n * numSketches)),
 	   1e3 * ((double) (after2 - before2)) / ((double) (minKN * numSketches)),
-	   1e3 * ((double) (after3 - before3)) / ((double) (minKN * numSketches)) );
+	   1e3 * ((double) (after3 - before3)) / ((double) (minKN * numSketches)),
+	   1e3 * ((double) (after4 - before4)) / ((double) (minKN * numSketches)),
+	   1e3 * ((double) (after5 - before5)) / ((double) (minKN * numSketches)) );
 
   fflush (stdout);
 
@@ -106,21 +131,23 @@ int main (int argc, char ** argv)
   Short lgK;
   Long num_items;
 
-  if (argc != 2) {
-    fprintf (stderr, "Usage: %s log_k\n", argv[0]);
+  if (argc != 2 && argc != 3) {
+    fprintf (stderr, "Usage: %s log_k [num_threads]\n", argv[0]);
     return(-1);
   }
 
   fm85Init ();
 
   lgK = atoi(argv[1]);
+  Long numThreads = (argc == 3) ? atoll(argv[2]) : (Long) sysconf (_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1) numThreads = 1;
 
   Long k = (1ULL << lgK);
 
 
   num_items = 10;
   while (num_items < 1200 * k) {
-    do_a_stream_length (lgK, num_items);
+    do_a_stream_length (lgK, num_items, numThreads);
     Long prev = num_items;
     num_items = 17 * num_items / 16;
     if (num_items == prev) num_items += 1;
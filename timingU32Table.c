@@ -0,0 +1,132 @@
+// Copyright 2018, Kevin Lang, Oath Research
+
+/*
+  This times the lookups of u32Table at load factors up to the 3/4 at which
+  the table grows, for hits, for misses, and for an insertion that is
+  immediately deleted again. Build it three ways to compare the probes:
+
+  gcc -O3 -DNDEBUG -Wall -pedantic -o timingU32Table u32Table.c fm85Util.c fm85.c iconEstimator.c fm85Compression.c fm85Merging.c fm85Testing.c timingU32Table.c -lm -lpthread
+
+  Add -DU32_TABLE_SCALAR_PROBE for the one-slot-at-a-time probe, or -mavx2 for the 8-slot groups
+  (the default is 4-slot groups with SSE2).
+
+  Then it grows a table up to that size, one insertion at a time, and reports the slowest
+  insertion at each size, which is the one that resized the table unless that was done
+  incrementally.
+*/
+
+/*******************************************************/
+
+#include "common.h"
+#include "u32Table.h"
+#include "fm85Util.h"
+#include "fm85.h"
+#include "fm85Testing.h"
+
+/***************************************************************/
+
+double nanosPerItem (clock_t before, clock_t after, Long numItems) {
+  return (1e9 * ((double) (after - before)) / ((double) CLOCKS_PER_SEC) / ((double) numItems));
+}
+
+U32 randomItem (void) {
+  U64 twoHashes[2]; // allocated on the stack
+  U32 item;
+  do {
+    getTwoRandomHashes (twoHashes);
+    item = (U32) (twoHashes[0] >> 32);
+  } while (item == ALL32BITS);
+  return (item);
+}
+
+/***************************************************************/
+
+void timeOneLoadFactor (Short lgSize, Long numerator, Long denominator) {
+  Long numItems = (numerator << lgSize) / denominator;
+  u32Table * table = u32TableMake (lgSize, 32);
+  U32 * present = (U32 *) malloc (((size_t) numItems) * sizeof(U32));
+  U32 * absent  = (U32 *) malloc (((size_t) numItems) * sizeof(U32));
+  assert (present != NULL && absent != NULL);
+  Long i, rep;
+  for (i = 0; i < numItems; ) {
+    U32 item = randomItem ();
+    if (u32TableMaybeInsert (table, item)) { present[i++] = item; }
+  }
+  for (i = 0; i < numItems; ) {
+    U32 item = randomItem ();
+    if (!u32TableContains (table, item)) { absent[i++] = item; }
+  }
+  assert (table->lgSize == lgSize); // the table didn't grow
+
+  Long numReps = (1LL << 24) / numItems;
+  if (numReps < 1) numReps = 1;
+  Long numFound = 0;
+  clock_t t0, t1, t2, t3;
+  t0 = clock ();
+  for (rep = 0; rep < numReps; rep++) {
+    for (i = 0; i < numItems; i++) { numFound += u32TableContains (table, present[i]); }
+  }
+  t1 = clock ();
+  for (rep = 0; rep < numReps; rep++) {
+    for (i = 0; i < numItems; i++) { numFound += u32TableContains (table, absent[i]); }
+  }
+  t2 = clock ();
+  Long numChurned = (numItems < (1LL << 20)) ? numItems : (1LL << 20);
+  for (i = 0; i < numChurned; i++) { // this one stays under the threshold, so the table never resizes
+    u32TableMaybeInsert (table, absent[i]);
+    u32TableMaybeDelete (table, absent[i]);
+  }
+  t3 = clock ();
+  assert (numFound == numReps * numItems);
+  if (numFound != numReps * numItems) { FATAL_ERROR ("lookup mismatch"); }
+
+  printf ("lgSize %2d, load %.3f:  hit %7.3f  miss %7.3f  insert+delete %8.3f  (nsec per item)\n",
+	  (int) lgSize, ((double) numItems) / ((double) (1LL << lgSize)),
+	  nanosPerItem (t0, t1, numReps * numItems),
+	  nanosPerItem (t1, t2, numReps * numItems),
+	  nanosPerItem (t2, t3, numChurned));
+  fflush (stdout);
+  u32TableFree (table);
+  free (present);
+  free (absent);
+}
+
+/***************************************************************/
+
+void timeGrowth (Short lgSize) {
+  u32Table * table = u32TableMake (8, 32);
+  double worst [32];
+  Short size;
+  for (size = 0; size < 32; size++) { worst[size] = 0.0; }
+  while (table->lgSize <= lgSize) {
+    U32 item = randomItem ();
+    clock_t t0 = clock ();
+    u32TableMaybeInsert (table, item);
+    clock_t t1 = clock ();
+    double micros = 1e6 * ((double) (t1 - t0)) / ((double) CLOCKS_PER_SEC);
+    if (micros > worst[table->lgSize]) { worst[table->lgSize] = micros; }
+  }
+  for (size = 9; size <= lgSize; size++) {
+    printf ("lgSize %2d: slowest insertion %9.1f usec\n", (int) size, worst[size]);
+  }
+  fflush (stdout);
+  u32TableFree (table);
+}
+
+/***************************************************************/
+
+int main (int argc, char ** argv)
+{
+  if (argc != 2) {
+    fprintf (stderr, "Usage: %s log_size\n", argv[0]);
+    return(-1);
+  }
+  Short lgSize = atoi(argv[1]);
+  assert (lgSize >= 4 && lgSize <= 28);
+  fm85Init ();
+  Long numerators [5] = {8, 16, 20, 22, 24}; // in units of 1/32, up to the 3/4 at which the table grows
+  int j;
+  for (j = 0; j < 5; j++) { timeOneLoadFactor (lgSize, numerators[j], 32); }
+  timeGrowth (lgSize);
+  return (0);
+}
@@ -1,5 +1,17 @@
 // Copyright 2018, Kevin Lang, Oath Research
 
+// The lookups compare groups of slots with SSE2 (which every x86-64 processor has),
+// or with AVX2 when the compiler is allowed to use it (for example, with -mavx2 or
+// -march=native). Define U32_TABLE_SCALAR_PROBE to examine the slots one at a time.
+
+#if !defined(U32_TABLE_SCALAR_PROBE) && defined(__AVX2__)
+#include <immintrin.h>
+#define U32_TABLE_GROUP_PROBE_AVX2
+#elif !defined(U32_TABLE_SCALAR_PROBE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define U32_TABLE_GROUP_PROBE_SSE2
+#endif
+
 #include "common.h"
 #include "u32Table.h"
 #include "fm85Util.h"
@@ -20,6 +32,16 @@ u32Table * u32TableMake (Short lgSize, Short numValidBits) {
   self->lgSize = lgSize;
   self->numItems = 0;
   self->slots = arr;
+  self->nextSlots = (U32 *) NULL;
+  self->nextLgSize = 0;
+  self->fillCursor = 0;
+  self->oldSlots = (U32 *) NULL;
+  self->oldLgSize = 0;
+  self->migrateCursor = 0;
+  self->migrateLeft = 0;
+  self->numRebuilds = 0;
+  self->numRebuildMoves = 0;
+  self->numDeleteMoves = 0;
   return (self);
 }
 
@@ -30,6 +52,14 @@ u32Table * u32TableCopy (u32Table * self) {
   Long numSlots = (1LL << self->lgSize);
   u32Table * newObj = (u32Table *) shallowCopy ((void *) self, sizeof(u32Table));
   newObj->slots = (U32 *) shallowCopy ((void *) self->slots, ((size_t) numSlots) * sizeof(U32));
+  if (self->nextSlots != NULL) { // the copy carries on with the same resize
+    newObj->nextSlots = (U32 *) malloc (((size_t) (1LL << self->nextLgSize)) * sizeof(U32));
+    assert (newObj->nextSlots != NULL);
+    memcpy ((void *) newObj->nextSlots, (void *) self->nextSlots, ((size_t) self->fillCursor) * sizeof(U32));
+  }
+  if (self->oldSlots != NULL) {
+    newObj->oldSlots = (U32 *) shallowCopy ((void *) self->oldSlots, ((size_t) (1LL << self->oldLgSize)) * sizeof(U32));
+  }
   return (newObj);
 }
 
@@ -42,6 +72,8 @@ u32Table * u32TableCopy (u32Table * self) {
 void u32TableFree (u32Table * self) {
   if (self != NULL) {
     if (self->slots != NULL) free (self->slots);
+    if (self->nextSlots != NULL) free (self->nextSlots);
+    if (self->oldSlots != NULL) free (self->oldSlots);
     free (self);
   }
 }
@@ -58,6 +90,8 @@ void u32TableShow (u32Table * self) {
   //    if (arr[i] == ALL32BITS) printf ("%d:\tempty\n", (int) i);
   //    else printf ("%d:\t%8X\n", (int) i, arr[i]);
   //  }
+  printf ("%lld rebuilds moved %lld items; deletions moved %lld items\n",
+	  self->numRebuilds, self->numRebuildMoves, self->numDeleteMoves);
   fflush (stdout);
 }
 
@@ -69,6 +103,11 @@ void u32TableClear (u32Table * self) { // clear the table without resizing it
   Long i;
   for (i = 0; i < tableSize; i++) { arr[i] = ALL32BITS; }
   self->numItems = 0;
+  if (self->nextSlots != NULL) { free (self->nextSlots); } // abandon the resize
+  if (self->oldSlots != NULL) { free (self->oldSlots); }
+  self->nextSlots = (U32 *) NULL;
+  self->oldSlots = (U32 *) NULL;
+  self->migrateLeft = 0;
 }
 
 /*******************************************************/
@@ -84,6 +123,54 @@ void printU32Array (U32 * array, Long arrayLength) {
 
 /*******************************************************/
 
+// Returns the first slot at or after the probe (wrapping around) that holds either the item
+// or ALL32BITS. Where the instruction set allows it, a whole group of slots is compared
+// against both values at once. A group never wraps around the end of the table, so the
+// last few slots (and tables that are smaller than a group) are examined one at a time.
+// Since the slots are still examined in order, the result is the same in every case.
+
+static inline Long u32TableFindSlot (U32 * arr, Long probe, Long mask, U32 item) {
+  if (arr[probe] == item || arr[probe] == ALL32BITS) { return probe; } // the usual case
+#if defined(U32_TABLE_GROUP_PROBE_AVX2)
+  __m256i itemVec = _mm256_set1_epi32 ((int) item);
+  __m256i emptyVec = _mm256_set1_epi32 (-1);
+  probe = (probe + 1) & mask;
+  while (1) {
+    if (probe + 8 <= mask + 1) {
+      __m256i group = _mm256_loadu_si256 ((const __m256i *) (arr + probe));
+      __m256i found = _mm256_or_si256 (_mm256_cmpeq_epi32 (group, itemVec), _mm256_cmpeq_epi32 (group, emptyVec));
+      int bits = _mm256_movemask_ps (_mm256_castsi256_ps (found));
+      if (bits != 0) { return (probe + __builtin_ctz ((unsigned) bits)); }
+      probe = (probe + 8) & mask;
+    }
+    else {
+      if (arr[probe] == item || arr[probe] == ALL32BITS) { return probe; }
+      probe = (probe + 1) & mask;
+    }
+  }
+#elif defined(U32_TABLE_GROUP_PROBE_SSE2)
+  __m128i itemVec = _mm_set1_epi32 ((int) item);
+  __m128i emptyVec = _mm_set1_epi32 (-1);
+  probe = (probe + 1) & mask;
+  while (1) {
+    if (probe + 4 <= mask + 1) {
+      __m128i group = _mm_loadu_si128 ((const __m128i *) (arr + probe));
+      __m128i found = _mm_or_si128 (_mm_cmpeq_epi32 (group, itemVec), _mm_cmpeq_epi32 (group, emptyVec));
+      int bits = _mm_movemask_ps (_mm_castsi128_ps (found));
+      if (bits != 0) { return (probe + __builtin_ctz ((unsigned) bits)); }
+      probe = (probe + 4) & mask;
+    }
+    else {
+      if (arr[probe] == item || arr[probe] == ALL32BITS) { return probe; }
+      probe = (probe + 1) & mask;
+    }
+  }
+#else
+  do { probe = (probe + 1) & mask; } while (arr[probe] != item && arr[probe] != ALL32BITS);
+  return probe;
+#endif
+}
+
 #define U32_TABLE_LOOKUP_SHARED_CODE_SECTION \
   Long tableSize = 1LL << self->lgSize; \
   Long mask = tableSize - 1LL; \
@@ -91,39 +178,106 @@ void printU32Array (U32 * array, Long arrayLength) {
   Long probe = ((Long) item) >> shift; \
   assert (probe >= 0 && probe <= mask); \
   U32 * arr = self->slots; \
-  U32 fetched = arr[probe]; \
-  while (fetched != item && fetched != ALL32BITS) { \
-    probe = (probe + 1) & mask; \
-    fetched = arr[probe]; \
-  }
+  probe = u32TableFindSlot (arr, probe, mask, item); \
+  U32 fetched = arr[probe];
 
 /*******************************************************/
 
+// Puts a new item into the table, given the empty slot at which the lookup stopped.
+// With U32_TABLE_ORDERED, the items between the item's home slot and that empty slot
+// that follow the item are shifted over by one, working backwards from the empty slot
+// as in insertion sort. There are seldom more than a few of them. Items are compared after
+// rotating them so that the empty slot comes first, since the cluster can wrap around.
+
+static inline void u32TablePlaceItem (u32Table * self, Long emptySlot, U32 item) {
+  U32 * arr = self->slots;
+#ifdef U32_TABLE_ORDERED
+  Short shift = self->validBits - self->lgSize;
+  Long mask = (1LL << self->lgSize) - 1LL;
+  Long home = ((Long) item) >> shift;
+  U32 validMask = (U32) ((1ULL << self->validBits) - 1ULL);
+  U32 origin = (U32) (emptySlot << shift);
+  U32 rotated = (item - origin) & validMask;
+  while (emptySlot != home) {
+    Long prev = (emptySlot - 1) & mask;
+    U32 other = arr[prev];
+    if (((other - origin) & validMask) < rotated) break;
+    arr[emptySlot] = other;
+    emptySlot = prev;
+  }
+#endif
+  arr[emptySlot] = item;
+}
+
 void u32TableMustInsert (u32Table * self, U32 item) {
   U32_TABLE_LOOKUP_SHARED_CODE_SECTION;
   if (fetched == item) { FATAL_ERROR("u32TableMustInsert"); }
   else {
     assert (fetched == ALL32BITS);
-    arr[probe] = item;
+    u32TablePlaceItem (self, probe, item);
     // counts and resizing must be handled by the caller.
   }
 }
 
 /*******************************************************/
 
+Long u32TableLayOutSortedItems (u32Table * self, Long slotLo, Long slotHi, U32 * items, Long numItems) {
+  assert (self->nextSlots == NULL && self->oldSlots == NULL);
+  Short shift = self->validBits - self->lgSize;
+  U32 * arr = self->slots;
+  Long probe = slotLo;
+  Long i;
+  for (i = 0; i < numItems; i++) {
+    Long home = ((Long) items[i]) >> shift;
+    assert (i == 0 || items[i-1] < items[i]);
+    assert (home >= slotLo && home < slotHi);
+    if (probe < home) { probe = home; }
+    if (probe >= slotHi) { break; } // this one and the rest spill past the range
+    assert (arr[probe] == ALL32BITS);
+    arr[probe++] = items[i];
+  }
+  return (i);
+}
+
+/*******************************************************/
+
+// The first sweep is u32TableLayOutSortedItems() over the whole table. The items that
+// would go past the end wrap around to the start of the table, ahead of the items whose
+// homes are there, which is where inserting the items in order would have put them with
+// U32_TABLE_ORDERED. So the second sweep lays out the leading items again after the
+// wrapped ones, filling in the slots that they skip over. It stops as soon as an item
+// ends up where the first sweep put it, since the rest of them do too.
+
+void u32TableLoadSortedItems (u32Table * self, U32 * items, Long numItems) {
+  assert (self->numItems == 0);
+  Long numSlots = (1LL << self->lgSize);
+  assert (u32TableUpsizeDenom * numItems <= u32TableUpsizeNumer * numSlots);
+  Short shift = self->validBits - self->lgSize;
+  U32 * arr = self->slots;
+  Long numLaidOut = u32TableLayOutSortedItems (self, 0, numSlots, items, numItems);
+  Long slot, oldSlot, i;
+  for (slot = 0; slot < numItems - numLaidOut; slot++) { arr[slot] = items[numLaidOut + slot]; }
+  oldSlot = 0;
+  for (i = 0; i < numLaidOut && slot > oldSlot; i++) {
+    Long home = ((Long) items[i]) >> shift;
+    if (oldSlot < home) { oldSlot = home; }
+    while (slot < home) { arr[slot++] = ALL32BITS; }
+    assert (slot < numSlots);
+    arr[slot++] = items[i];
+    oldSlot++;
+  }
+  self->numItems = numItems;
+}
+
+/*******************************************************/
+
 // This one is specifically tailored to be part of our fm85 decompression scheme.
+// The pairs must be sorted.
 
 u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchLgK) {
-  Short lgNumSlots = 2;
-  while (u32TableUpsizeDenom * numPairs > u32TableUpsizeNumer * (1LL << lgNumSlots)) { lgNumSlots++; }
+  Short lgNumSlots = u32TableLgSizeForNumItems (numPairs);
   u32Table * table = u32TableMake (lgNumSlots, 6 + sketchLgK); // Already filled with the "Empty" value which is ALL32BITS.
-  Long i = 0;
-  // Note: there is a possible "snowplow effect" here because the caller is passing in a sorted pairs array.
-  // However, we are starting out with the correct final table size, so the problem might not occur.
-  for (i = 0; i < numPairs; i++) {
-    u32TableMustInsert (table, pairs[i]);
-  }
-  table->numItems = numPairs;
+  u32TableLoadSortedItems (table, pairs, numPairs);
   return (table);
 }
 
@@ -131,6 +285,7 @@ u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchL
 
 void privateU32TableRebuild (u32Table * self, Short newLgSize) {
   assert (newLgSize >= 2);
+  assert (self->nextSlots == NULL && self->oldSlots == NULL);
   Long newSize = (1LL << newLgSize);
   Long oldSize = (1LL << self->lgSize);
   //  printf ("rebuilding: %lld -> %lld; %lld items in table\n", oldSize, newSize, self->numItems); fflush (stdout);
@@ -148,25 +303,156 @@ void privateU32TableRebuild (u32Table * self, Short newLgSize) {
     U32 item = oldSlots[i];
     if (item != ALL32BITS) {
       u32TableMustInsert (self, item);
+      self->numRebuildMoves += 1;
     }
   }
+  self->numRebuilds += 1;
   free (oldSlots);
   return;
 }
 
+/*******************************************************/
+// An incremental resize moves the old slots over in order, starting from an empty one,
+// and it only ever stops just after an empty slot. So the old slots that are left hold
+// whole clusters, and they are still a valid table (with their own size) in which
+// lookups and deletions work as usual. Insertions always go into the new slots.
+
+static void privateU32TableMigrate (u32Table * self, Long budget) {
+  U32 * old = self->oldSlots;
+  Long oldMask = (1LL << self->oldLgSize) - 1LL;
+  Long cursor = self->migrateCursor;
+  Long left = self->migrateLeft;
+  while (left > 0) {
+    U32 item = old[cursor];
+    if (item != ALL32BITS) {
+      old[cursor] = ALL32BITS;
+      u32TableMustInsert (self, item);
+      self->numRebuildMoves += 1;
+    }
+    cursor = (cursor + 1) & oldMask;
+    left -= 1;
+    budget -= 1;
+    if (item == ALL32BITS && budget <= 0) break; // this is between two clusters
+  }
+  self->migrateCursor = cursor;
+  self->migrateLeft = left;
+  if (left == 0) {
+    free (old);
+    self->oldSlots = (U32 *) NULL;
+  }
+}
+
+// Once the new slots have all been filled, they take over, and the items start moving.
+
+static void privateU32TableFill (u32Table * self, Long budget) {
+  Long newSize = (1LL << self->nextLgSize);
+  Long fillHi = self->fillCursor + budget;
+  if (fillHi > newSize) { fillHi = newSize; }
+  memset ((void *) (self->nextSlots + self->fillCursor), 0xff, ((size_t) (fillHi - self->fillCursor)) * sizeof(U32)); // ALL32BITS
+  self->fillCursor = fillHi;
+  if (fillHi < newSize) { return; }
+  U32 * oldSlots = self->slots;
+  Long start = 0;
+  while (oldSlots[start] != ALL32BITS) { start++; } // the table is never full
+  self->oldSlots = oldSlots;
+  self->oldLgSize = self->lgSize;
+  self->migrateCursor = start;
+  self->migrateLeft = (1LL << self->lgSize);
+  self->slots = self->nextSlots;
+  self->lgSize = self->nextLgSize;
+  self->nextSlots = (U32 *) NULL;
+}
+
+static inline Boolean privateU32TableIsResizing (u32Table * self) {
+  return (self->nextSlots != NULL || self->oldSlots != NULL);
+}
+
+static inline void privateU32TableContinueResize (u32Table * self) {
+  if (self->nextSlots != NULL) { privateU32TableFill (self, U32_TABLE_FILL_BUDGET); }
+  else if (self->oldSlots != NULL) { privateU32TableMigrate (self, U32_TABLE_MIGRATION_BUDGET); }
+}
+
+void u32TableFinishResize (u32Table * self) {
+  if (self->nextSlots != NULL) { privateU32TableFill (self, 1LL << self->nextLgSize); }
+  if (self->oldSlots != NULL) { privateU32TableMigrate (self, self->migrateLeft); }
+}
+
+// The callers don't start a resize while another one is in progress.
+
+static void privateU32TableResize (u32Table * self, Short newLgSize) {
+  assert (!privateU32TableIsResizing (self));
+  if (self->lgSize < U32_TABLE_INCREMENTAL_LG_SIZE) {
+    privateU32TableRebuild (self, newLgSize);
+    return;
+  }
+  Long newSize = (1LL << newLgSize);
+  assert (newSize > self->numItems);
+  self->nextSlots = (U32 *) malloc ((size_t) (newSize * sizeof(U32)));
+  assert (self->nextSlots != NULL);
+  self->nextLgSize = newLgSize;
+  self->fillCursor = 0;
+  self->numRebuilds += 1;
+}
+
+// Returns the old slot that holds the item, or -1.
+
+static inline Long u32TableFindInOldSlots (u32Table * self, U32 item) {
+  Long mask = (1LL << self->oldLgSize) - 1LL;
+  Long probe = ((Long) item) >> (self->validBits - self->oldLgSize);
+  probe = u32TableFindSlot (self->oldSlots, probe, mask, item);
+  return ((self->oldSlots[probe] == item) ? probe : -1);
+}
+
+/*******************************************************/
+
+// Grows the table (if necessary) so that it can hold numItems items without
+// any further rebuilds. Callers use this before a known burst of insertions.
+
+Short u32TableLgSizeForNumItems (Long numItems) {
+  Short lgSize = 2;
+  while (u32TableUpsizeDenom * numItems > u32TableUpsizeNumer * (1LL << lgSize)) { lgSize++; }
+  return (lgSize);
+}
+
+// Both directions aim for the same load, somewhere in the middle of the band between the
+// thresholds, rather than for the nearest size on the right side of the threshold.
+
+Short u32TableLgSizeForResize (Short lgSize, Long numItems) {
+  if (u32TableUpsizeDenom * numItems > u32TableUpsizeNumer * (1LL << lgSize)) {
+    return (u32TableLgSizeForNumItems (numItems));
+  }
+  if (u32TableDownsizeDenom * numItems < u32TableDownsizeNumer * (1LL << lgSize) && lgSize > 2) {
+    return (u32TableLgSizeForNumItems (2 * numItems)); // at most 3/8 full
+  }
+  return (lgSize);
+}
+
+// This one does stall to finish a resize in progress. Growing rebuilds the table all at
+// once anyway, and the burst could outrun the resize and overfill the old slots.
+
+void u32TableReserve (u32Table * self, Long numItems) {
+  u32TableFinishResize (self);
+  Short newLgSize = u32TableLgSizeForNumItems (numItems);
+  if (newLgSize > self->lgSize) { privateU32TableRebuild (self, newLgSize); }
+}
+
 /*******************************************************/
 
 // Returns true iff the item was new and was therefore added to the table.
 
 Boolean u32TableMaybeInsert (u32Table * self, U32 item) {
+  Boolean resizing = privateU32TableIsResizing (self);
+  if (resizing) { privateU32TableContinueResize (self); }
   U32_TABLE_LOOKUP_SHARED_CODE_SECTION;
   if (fetched == item) { return 0; }
+  if (self->oldSlots != NULL && u32TableFindInOldSlots (self, item) >= 0) { return 0; }
   else {
     assert (fetched == ALL32BITS);
-    arr[probe] = item;
+    u32TablePlaceItem (self, probe, item);
     self->numItems += 1;
-    while (u32TableUpsizeDenom * self->numItems > u32TableUpsizeNumer * (1LL << self->lgSize)) {
-      privateU32TableRebuild(self, self->lgSize + 1);
+    assert (!resizing || 8 * self->numItems <= 7 * tableSize); // the resize is finished well before the table fills up
+    if (!resizing && u32TableUpsizeDenom * self->numItems > u32TableUpsizeNumer * tableSize) {
+      privateU32TableResize (self, u32TableLgSizeForResize (self->lgSize, self->numItems));
     }
     return 1;
   }
@@ -174,31 +460,125 @@ Boolean u32TableMaybeInsert (u32Table * self, U32 item) {
 
 /*******************************************************/
 
+// This is backward-shift deletion. Walking along the cluster after the hole, an item
+// has to be moved into the hole only if its home slot is not between the hole and
+// the item, because otherwise a lookup would stop at the hole before reaching it.
+// Each move leaves a new hole behind, and the walk ends at the next empty slot.
+
+static void privateU32TableCloseHole (u32Table * self, U32 * arr, Short lgSize, Long hole) {
+  Long mask = (1LL << lgSize) - 1LL;
+  Short shift = self->validBits - lgSize;
+  Long probe = (hole + 1) & mask;
+  U32 fetched = arr[probe];
+  while (fetched != ALL32BITS) {
+    Long home = ((Long) fetched) >> shift;
+    if (((probe - home) & mask) >= ((probe - hole) & mask)) {
+      arr[hole] = fetched;
+      hole = probe;
+      self->numDeleteMoves += 1;
+    }
+    probe = (probe + 1) & mask; fetched = arr[probe];
+  }
+  arr[hole] = ALL32BITS;
+}
+
 // Returns true iff the item was present and was therefore removed from the table.
 
 Boolean u32TableMaybeDelete (u32Table * self, U32 item) {
+  Boolean resizing = privateU32TableIsResizing (self);
+  if (resizing) { privateU32TableContinueResize (self); }
   U32_TABLE_LOOKUP_SHARED_CODE_SECTION;
-  if (fetched == ALL32BITS) { return 0; }
+  if (fetched == item) {
+    privateU32TableCloseHole (self, arr, self->lgSize, probe);
+  }
   else {
-    assert (fetched == item);
-    // delete the item
-    arr[probe] = ALL32BITS;
-    self->numItems -= 1; assert (self->numItems >= 0);
+    assert (fetched == ALL32BITS);
+    Long oldProbe = (self->oldSlots != NULL) ? u32TableFindInOldSlots (self, item) : -1;
+    if (oldProbe < 0) { return 0; }
+    privateU32TableCloseHole (self, self->oldSlots, self->oldLgSize, oldProbe);
+  }
+  self->numItems -= 1; assert (self->numItems >= 0);
+  if (!resizing && u32TableDownsizeDenom * self->numItems < u32TableDownsizeNumer * (1LL << self->lgSize) && self->lgSize > 2) {
+    privateU32TableResize (self, u32TableLgSizeForResize (self->lgSize, self->numItems));
+  }
+  return 1;
+}
 
-    // re-insert all items between the freed slot and the next empty slot
-    probe = (probe + 1) & mask; fetched = arr[probe];
-    while (fetched != ALL32BITS) {
-      arr[probe] = ALL32BITS;
-      u32TableMustInsert (self, fetched);
-      probe = (probe + 1) & mask; fetched = arr[probe];      
+/*******************************************************/
+
+Boolean u32TableContains (u32Table * self, U32 item) {
+  U32_TABLE_LOOKUP_SHARED_CODE_SECTION;
+  if (fetched == item) { return 1; }
+  return (self->oldSlots != NULL && u32TableFindInOldSlots (self, item) >= 0);
+}
+
+/*******************************************************/
+// Within one of the periods during which these are used, a slot only changes
+// from empty to an item, or from an item to a tombstone, and an item is either
+// inserted or deleted but not both. So every thread that looks for an item
+// sees the same sequence of slots in front of it, and at most one of them can
+// win the race to fill an empty slot with it, or to replace it with a tombstone.
+
+Short u32TableConcurrentMaybeInsert (u32Table * self, U32 item) {
+  assert (self->validBits <= 31);
+  assert (self->nextSlots == NULL && self->oldSlots == NULL);
+  Long tableSize = 1LL << self->lgSize;
+  Long mask = tableSize - 1LL;
+  Long probe = ((Long) item) >> (self->validBits - self->lgSize);
+  U32 * arr = self->slots;
+  Long numProbes;
+  for (numProbes = 0; numProbes < tableSize; numProbes++) {
+    U32 fetched = __atomic_load_n (&arr[probe], __ATOMIC_ACQUIRE);
+    if (fetched == ALL32BITS) {
+      if (__atomic_compare_exchange_n (&arr[probe], &fetched, item, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	__atomic_add_fetch (&self->numItems, 1, __ATOMIC_RELAXED);
+	return 1;
+      }
+      // another thread filled the slot first, and fetched now holds what it wrote
     }
+    if (fetched == item) { return 0; }
+    probe = (probe + 1) & mask;
+  }
+  return -1;
+}
 
-    // shrink if necessary
-    while (u32TableDownsizeDenom * self->numItems < u32TableDownsizeNumer * (1LL << self->lgSize) && self->lgSize > 2) {
-      privateU32TableRebuild(self, self->lgSize - 1);
+/*******************************************************/
+
+Boolean u32TableConcurrentMaybeDelete (u32Table * self, U32 item) {
+  assert (self->validBits <= 31);
+  assert (self->nextSlots == NULL && self->oldSlots == NULL);
+  Long tableSize = 1LL << self->lgSize;
+  Long mask = tableSize - 1LL;
+  Long probe = ((Long) item) >> (self->validBits - self->lgSize);
+  U32 * arr = self->slots;
+  Long numProbes;
+  for (numProbes = 0; numProbes < tableSize; numProbes++) {
+    U32 fetched = __atomic_load_n (&arr[probe], __ATOMIC_ACQUIRE);
+    if (fetched == ALL32BITS) { return 0; }
+    if (fetched == item) {
+      if (__atomic_compare_exchange_n (&arr[probe], &fetched, (U32) U32_TABLE_TOMBSTONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	__atomic_sub_fetch (&self->numItems, 1, __ATOMIC_RELAXED);
+	return 1;
+      }
+      return 0; // another thread deleted it first
     }
-    return 1;
+    probe = (probe + 1) & mask;
+  }
+  return 0;
+}
+
+/*******************************************************/
+// This is single-threaded. The tombstones are simply dropped while rebuilding.
+
+void u32TableRemoveTombstones (u32Table * self, Short newLgSize) {
+  assert (self->nextSlots == NULL && self->oldSlots == NULL);
+  Long tableSize = 1LL << self->lgSize;
+  U32 * arr = self->slots;
+  Long i;
+  for (i = 0; i < tableSize; i++) {
+    if (arr[i] == U32_TABLE_TOMBSTONE) { arr[i] = ALL32BITS; }
   }
+  privateU32TableRebuild (self, newLgSize);
 }
 
 /*******************************************************/
@@ -208,20 +588,15 @@ Boolean u32TableMaybeDelete (u32Table * self, U32 item) {
 // isn't too full. Experiments suggest that for sufficiently large tables 
 // the load factor would have to be over 90 percent before this would fail frequently, 
 // and even then the subsequent sort would fix things up.
+// This does it for one array of slots, which holds numItems items.
 
-U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems) {
-  *returnNumItems = self->numItems;
-  if (self->numItems < 1) { return (NULL); }
-  U32 * slots = self->slots;
-  Long tableSize = (1LL << self->lgSize);
-  U32 * result = (U32 *) malloc ((size_t) (self->numItems * sizeof(U32)));  
-  assert (result != NULL);
+static void privateU32TableUnwrapSlots (U32 * slots, Long tableSize, Short validBits, U32 * result, Long numItems) {
   Long i = 0;
   Long l = 0;
-  Long r = self->numItems - 1;
+  Long r = numItems - 1;
 
   // Special rules for the region before the first empty slot.
-  U32 hiBit = 1 << (self->validBits - 1);
+  U32 hiBit = 1 << (validBits - 1);
   while (i < tableSize && slots[i] != ALL32BITS) {
     U32 item = slots[i++];
     if (item & hiBit) { result[r--] = item; } // This item was probably wrapped, so move to end.
@@ -234,9 +609,87 @@ U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems) {
     if (look != ALL32BITS) { result[l++] = look; }
   }
   assert (l == r + 1);
+}
+
+// While a resize is in progress, the items in the old slots come after the others,
+// and this returns how many of them there are.
+
+static U32 * privateU32TableUnwrapBothParts (u32Table * self, Long * returnNumOld) {
+  Long numOld = 0;
+  Long i;
+  if (self->oldSlots != NULL) {
+    Long oldSize = (1LL << self->oldLgSize);
+    for (i = 0; i < oldSize; i++) { numOld += (self->oldSlots[i] != ALL32BITS); }
+  }
+  *returnNumOld = numOld;
+  Long numNew = self->numItems - numOld;
+  U32 * result = (U32 *) malloc ((size_t) (self->numItems * sizeof(U32)));  
+  assert (result != NULL);
+  privateU32TableUnwrapSlots (self->slots, 1LL << self->lgSize, self->validBits, result, numNew);
+  if (numOld > 0) {
+    privateU32TableUnwrapSlots (self->oldSlots, 1LL << self->oldLgSize, self->validBits, result + numNew, numOld);
+  }
   return (result);
 }
 
+U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems) {
+  *returnNumItems = self->numItems;
+  if (self->numItems < 1) { return (NULL); }
+  Long numOld;
+  return (privateU32TableUnwrapBothParts (self, &numOld));
+}
+
+
+/*******************************************************/
+
+U32 * u32TableGetSortedItems (u32Table * self, Long * returnNumItems) {
+  *returnNumItems = self->numItems;
+  if (self->numItems < 1) { return (NULL); }
+  Long n = self->numItems;
+#ifdef U32_TABLE_ORDERED
+  if (self->oldSlots == NULL) {
+    U32 * slots = self->slots;
+    Long tableSize = (1LL << self->lgSize);
+    Short shift = self->validBits - self->lgSize;
+    U32 * result = (U32 *) malloc ((size_t) (n * sizeof(U32)));
+    assert (result != NULL);
+
+    // The items that wrapped around the end come first in the slots, but last in the order.
+    Long numWrapped = 0;
+    while (numWrapped < tableSize && slots[numWrapped] != ALL32BITS && (((Long) slots[numWrapped]) >> shift) > numWrapped) { numWrapped++; }
+
+    Long numSwept = 0;
+    Long numDescents = 0;
+    Long i;
+    for (i = numWrapped; i < tableSize; i++) {
+      U32 item = slots[i];
+      if (item != ALL32BITS) {
+	if (numSwept > 0 && item < result[numSwept-1]) { numDescents++; }
+	result[numSwept++] = item;
+      }
+    }
+    for (i = 0; i < numWrapped; i++) {
+      if (numSwept > 0 && slots[i] < result[numSwept-1]) { numDescents++; }
+      result[numSwept++] = slots[i];
+    }
+    assert (numSwept == n);
+    if (numDescents > 0) { introspectiveInsertionSort (result, 0, n - 1); } // only after concurrent insertions
+    return (result);
+  }
+#endif
+  // The two parts of a table that is being resized are sorted separately and then merged.
+  Long numOld;
+  U32 * items = privateU32TableUnwrapBothParts (self, &numOld);
+  Long numNew = n - numOld;
+  if (numNew > 1) { introspectiveInsertionSort (items, 0, numNew - 1); }
+  if (numOld == 0) { return (items); }
+  if (numOld > 1) { introspectiveInsertionSort (items, numNew, n - 1); }
+  U32 * result = (U32 *) malloc ((size_t) (n * sizeof(U32)));
+  assert (result != NULL);
+  u32Merge (items, 0, numNew, items, numNew, numOld, result, 0);
+  free (items);
+  return (result);
+}
 
 /*******************************************************/
 // The Java version won't need this, because it provides a good array sort.
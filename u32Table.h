@@ -3,14 +3,44 @@
 // This is a highly specialized hash table that was designed
 // to be part of the library's FM85 implementation.
 
+// Since an item's home slot is its top bits, the table can keep the items of each
+// cluster in increasing order (which is a form of Robin Hood hashing), and then the
+// slots hold all of the items in sorted order, apart from the cluster that wraps around
+// the end. Define U32_TABLE_ORDERED to do that. An insertion then shifts the items of
+// its cluster that follow it over by one, which makes updating a sparse sketch about
+// a quarter slower, in return for extracting the items without sorting them.
+// By default, each item simply goes into the first empty slot.
+
 #ifndef GOT_U32_TABLE_H
 #include "common.h"
 
 #define u32TableUpsizeNumer 3LL
 #define u32TableUpsizeDenom 4LL
 
+// A table shrinks when it is less than 1/8 full, and both growing and shrinking pick the
+// size that leaves it about 3/8 full, so it takes a lot of insertions or deletions
+// before the next resize. Otherwise a mix of the two could keep rebuilding the table.
+
 #define u32TableDownsizeNumer 1LL
-#define u32TableDownsizeDenom 4LL
+#define u32TableDownsizeDenom 8LL
+
+// A table with at least this many slots is resized incrementally. The new slots are
+// allocated right away, and then each of the following insertions and deletions does
+// a bounded amount of the work. First they fill the new slots with the empty value a
+// piece at a time, while the table carries on in the old slots. Then they move the
+// items over from the old slots a few at a time, while the lookups check both.
+// Smaller tables are still rebuilt all at once, since that is cheap.
+
+#define U32_TABLE_INCREMENTAL_LG_SIZE 12
+#define U32_TABLE_FILL_BUDGET 256    // the new slots that each operation fills (see below)
+#define U32_TABLE_MIGRATION_BUDGET 8 // the old slots that each operation moves over
+
+// The table doesn't resize again until a resize is finished. By then, it is nowhere near
+// the thresholds, because the new size leaves it about 3/8 full, and it takes a lot more
+// operations to reach either threshold from there than it takes to finish a resize.
+// The one exception is a shrink that comes due during a shrink, which is harmless.
+// The new slots are at most twice as many as the old ones, so while they are being filled,
+// the old slots take in at most 2/U32_TABLE_FILL_BUDGET of their size in new items.
 
 typedef struct u32_table_type
 {
@@ -18,6 +48,20 @@ typedef struct u32_table_type
   Short lgSize; // log2 of number of slots
   Long  numItems;
   U32 * slots;
+  // While the new slots are being filled, they hold no items yet.
+  U32 * nextSlots;      // NULL unless the new slots are being filled
+  Short nextLgSize;
+  Long  fillCursor;     // the next one of them to fill
+  // While the items are being moved over, the items in the old slots that haven't been moved
+  // yet are still there. Those slots always form whole clusters, so they remain a valid table.
+  U32 * oldSlots;       // NULL unless the items are being moved over
+  Short oldLgSize;
+  Long  migrateCursor;  // the next old slot to move over
+  Long  migrateLeft;    // how many old slots haven't been moved over yet
+  // These only count work, so that the cost of the resizing policy can be measured.
+  Long numRebuilds;     // how many times the slots have been reallocated
+  Long numRebuildMoves; // the items that were reinserted by those rebuilds
+  Long numDeleteMoves;  // the items that deletions shifted back to fill the hole
 } u32Table;
 
 /*******************************************************/
@@ -32,12 +76,61 @@ void u32TableFree (u32Table * self);
 
 void u32TableShow (u32Table * self); // for debugging
 
+// Moves the rest of the items over if a resize is in progress, all at once, which takes time
+// in proportion to the size of the table. Code that changes the slots directly must call this first.
+void u32TableFinishResize (u32Table * self);
+
+// Code that only reads the slots directly visits both arrays instead, so that reading never
+// changes the table, and several threads can read it at once. Part 0 is the slots, and part 1
+// is the old slots, which are NULL (with no slots) unless the items are being moved over.
+static inline U32 * u32TableSlotsOfPart (u32Table * self, int part, Long * returnNumSlots) {
+  if (part == 0) { *returnNumSlots = (1LL << self->lgSize); return (self->slots); }
+  *returnNumSlots = (self->oldSlots == NULL) ? 0 : (1LL << self->oldLgSize);
+  return (self->oldSlots);
+}
+
 /*******************************************************/
 
 Boolean u32TableMaybeInsert (u32Table * self, U32 item);
 
 Boolean u32TableMaybeDelete (u32Table * self, U32 item);
 
+Boolean u32TableContains (u32Table * self, U32 item);
+
+void u32TableReserve (u32Table * self, Long numItems); // grows the table to fit numItems
+
+Short u32TableLgSizeForNumItems (Long numItems); // the smallest size that holds them without growing
+
+// The size that the resizing policy would give a table of this size holding numItems items.
+Short u32TableLgSizeForResize (Short lgSize, Long numItems);
+
+// For building a table in parallel. The items must be sorted, and their home slots must
+// be in the range [slotLo, slotHi), whose slots must be empty. This puts as many of them as
+// will fit in that range exactly where inserting them in order would, and returns that number.
+// Several threads can do this for disjoint ranges at once. Afterwards, the caller adds the
+// numbers that fit to numItems, and then inserts the rest with u32TableMaybeInsert().
+Long u32TableLayOutSortedItems (u32Table * self, Long slotLo, Long slotHi, U32 * items, Long numItems);
+
+// Loads distinct sorted items into an empty table, which must be big enough that it
+// won't need to grow, in linear time. With U32_TABLE_ORDERED, the slots end up
+// the same as if the items had been inserted in order.
+void u32TableLoadSortedItems (u32Table * self, U32 * items, Long numItems);
+
+/*******************************************************/
+
+// These versions can be called by several threads at once, but not at the same
+// time as any of the other routines, nor while a resize is in progress. They never
+// resize the table. Instead of emptying a slot, a deletion leaves a tombstone, which
+// only u32TableRemoveTombstones() gets rid of. Since the tombstone is not a valid item, validBits must be at most 31.
+
+#define U32_TABLE_TOMBSTONE 0xfffffffeULL
+
+Short u32TableConcurrentMaybeInsert (u32Table * self, U32 item); // 1 if added, 0 if present, -1 if the table is full
+
+Boolean u32TableConcurrentMaybeDelete (u32Table * self, U32 item);
+
+void u32TableRemoveTombstones (u32Table * self, Short newLgSize);
+
 /*******************************************************/
 
 // this one slightly breaks the abstraction boundary
@@ -48,6 +141,11 @@ u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchL
 
 U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems);
 
+// Returns all of the items in increasing order. With U32_TABLE_ORDERED, this is just a
+// sweep over the slots. It still sorts them if concurrent insertions (which ignore
+// the order) have happened since the table was last rebuilt.
+U32 * u32TableGetSortedItems (u32Table * self, Long * returnNumItems);
+
 void printU32Array (U32 * array, Long arrayLength);
 
 /*******************************************************/